@@ -0,0 +1,50 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2008
+ *               Eino Tuominen <eino@utu.fi>
+ *               Antti Siira <antti@utu.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+/*
+ * A bump allocator. Objects are never freed one by one, the whole
+ * arena is reset or destroyed at once. An arena is not thread safe.
+ */
+
+#define ARENA_ALIGN 8
+
+typedef struct arena_chunk_s
+{
+	struct arena_chunk_s *next;	/* the previous chunk */
+	size_t size;
+	size_t used;
+} arena_chunk_t;
+
+typedef struct arena_s
+{
+	arena_chunk_t *chunk;	/* the chunk being filled */
+	arena_chunk_t *first;	/* kept over resets */
+} arena_t;
+
+arena_t *arena_create(size_t size);
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_strdup(arena_t *arena, const char *str);
+void arena_reset(arena_t *arena);
+void arena_destroy(arena_t *arena);
+
+#endif /* ARENA_H */
@@ -44,6 +44,7 @@ typedef struct
 	constchar_t *dnslname;
 	edict_t *edict;
 	dns_check_info_t *check_info;
+	thread_pool_t *pool;
 } callback_arg_t;
 
 int add_dnsbl(dnsbl_t **current, const char *name, int weight);
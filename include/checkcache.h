@@ -0,0 +1,113 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2008
+ *               Eino Tuominen <eino@utu.fi>
+ *               Antti Siira <antti@utu.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CHECKCACHE_H
+#define CHECKCACHE_H
+
+#include "arena.h"
+#include "thread_pool.h"
+
+/*
+ * A cache of check results for the checks that depend only on
+ * the client address or on the sender domain. The cache is split
+ * in shards with a lock each, and an entry lives check_cache_ttl
+ * seconds.
+ *
+ * While a job of such a check is running, requests for the same
+ * check and key join its flight instead of submitting a job of their
+ * own. The results of the job are copied to every edict on board.
+ */
+
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 256	/* per shard */
+
+typedef enum
+{
+	CACHE_NONE = 0,		/* the check can not be cached */
+	CACHE_CLIENT_ADDRESS,
+	CACHE_SENDER_DOMAIN,
+	CACHE_CLIENT_HELO,	/* client address and helo name */
+} cache_key_t;
+
+/* a result of a check as the cache keeps it */
+typedef struct cached_result_s
+{
+	judgment_t judgment;
+	int weight;
+	bool definitive;
+	bool wait;
+	const char *checkname;	/* check names are static */
+	char *reason;
+} cached_result_t;
+
+typedef struct cache_entry_s
+{
+	int check;		/* index in ctx->checklist */
+	char *key;
+	uint32_t hash;
+	time_t expires;
+	int count;
+	cached_result_t *results;
+	struct cache_entry_s *next;	/* hash chain */
+	struct cache_entry_s *newer;	/* insertion order for evictions */
+	struct cache_entry_s *older;
+} cache_entry_t;
+
+typedef struct flight_s
+{
+	int check;		/* index in ctx->checklist */
+	char *key;
+	uint32_t hash;
+	int size;		/* maximum number of results */
+	int count;
+	cached_result_t *results;
+	bool uncertain;		/* do not cache the results */
+	bool landed;		/* the final result has arrived */
+	edict_t **followers;
+	int nfollowers;
+	int maxfollowers;
+	struct flight_s *next;	/* hash chain */
+} flight_t;
+
+typedef struct
+{
+	pthread_mutex_t mx;
+	cache_entry_t *bucket[CACHE_BUCKETS];
+	flight_t *flights[CACHE_BUCKETS];
+	cache_entry_t *oldest;
+	cache_entry_t *newest;
+	int count;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t joined;
+} cache_shard_t;
+
+void checkcache_init(int size, int ttl);
+int checkcache_lookup(arena_t *arena, int check, const char *key, cached_result_t **results);
+void checkcache_store(int check, const char *key, const cached_result_t *results, int count);
+int checkcache_stats(char *buf, size_t len);
+flight_t *flight_join(int check, const char *key, int size, edict_t *edict);
+void flight_result(flight_t *flight, struct chkresult_s *result);
+void flight_abort(flight_t *flight);
+bool flight_followed(flight_t *flight);
+void flight_release(flight_t *flight);
+
+#endif /* CHECKCACHE_H */
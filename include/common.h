@@ -33,6 +33,8 @@
 /* socket(), inet_pton() etc */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #if HAVE_NETINET_IN_H
 # include <netinet/in.h>
 #endif
@@ -46,6 +48,7 @@
 #include <errno.h>
 #include <semaphore.h>
 #include <time.h>
+#include <limits.h>
 
 #ifdef HAVE_ARES_H
 # include <ares.h>
@@ -86,6 +89,7 @@
  */
 #include "bloom.h"
 #include "stats.h"
+#include "latency.h"
 #include "thread_pool.h"
 
 /*
@@ -135,6 +139,15 @@
 #define MIN(a,b) 	((a) < (b) ? (a) : (b))
 #endif
 
+/* atomic operations, full barriers */
+#ifndef ATOMIC_FETCH_ADD
+#define ATOMIC_FETCH_ADD(p, v)	__sync_fetch_and_add((p), (v))
+#define ATOMIC_ADD_FETCH(p, v)	__sync_add_and_fetch((p), (v))
+#define ATOMIC_LOAD(p)		__sync_fetch_and_add((p), 0)
+#define ATOMIC_STORE(p, v)	do { __sync_synchronize(); *(p) = (v); __sync_synchronize(); } while (0)
+#define ATOMIC_CAS(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#endif
+
 /*
  * common types
  */
@@ -157,6 +170,12 @@ typedef enum
 	GREY_TUPLE_SERVER,
 } greytupletype_t;
 
+typedef enum
+{
+	TUPLE_FORMAT_COMPAT = 0,	/* the hashed string of the old versions */
+	TUPLE_FORMAT_BINARY,
+} tupleformat_t;
+
 typedef struct peer_s
 {
 	struct sockaddr_in peer_addr;
@@ -166,18 +185,29 @@ typedef struct peer_s
 	int connected;
 } peer_t;
 
+#define REASONTEMPLATE "%reason%"
+
+/* a response template split at %reason% when the config is loaded */
+typedef struct response_template_s
+{
+	char *prologue;
+	char *epilogue;		/* NULL if the template has no %reason% */
+} response_template_t;
+
 typedef struct sjsms_config_s
 {
-	char *responsegrey;
+	response_template_t responsegrey;
 	char *responsematch;
 	char *responsetrust;
-	char *responseblock;
+	response_template_t responseblock;
+	char *listen;		/* unix socket path, NULL for host and port */
 } sjsms_config_t;
 
 typedef struct postfix_config_s
 {
-	char *responsegrey;
-	char *responseblock;
+	response_template_t responsegrey;
+	response_template_t responseblock;
+	char *listen;		/* unix socket path, NULL for host and port */
 } postfix_config_t;
 
 typedef struct blocker_config_s
@@ -186,6 +216,23 @@ typedef struct blocker_config_s
 	int weight;
 } blocker_config_t;
 
+/* per check stages, see 'check_stage' */
+typedef struct check_stage_s
+{
+	char *name;
+	int stage;
+	struct check_stage_s *next;	/* linked list */
+} check_stage_t;
+
+/* per pool thread limits, see 'pool_threads' */
+typedef struct pool_size_s
+{
+	char *name;
+	int min_thread;
+	int max_thread;
+	struct pool_size_s *next;	/* linked list */
+} pool_size_t;
+
 #ifdef MILTER
 typedef struct milter_config_s
 {
@@ -199,7 +246,11 @@ typedef struct
 	struct sockaddr_in sync_host;
 	struct sockaddr_in status_host;
 	peer_t peer;
-	int max_connq;
+	int max_connq;		/* the listen backlog */
+	int listen_threads;
+	int *listen_cpus;	/* processors for the listeners */
+	int listen_ncpus;
+	mode_t listen_mode;	/* of the unix sockets */
 	time_t rotate_interval;
 	time_t stat_interval;
 	bitindex_t filter_size;
@@ -211,9 +262,11 @@ typedef struct
 	int flags;
 	int checks;
 	int grey_mask;
+	int grey_mask6;
 	int protocols;
 	int greylist_delay;
 	greytupletype_t grey_tuple;
+	tupleformat_t tuple_format;
 	postfix_config_t postfix;
 	sjsms_config_t sjsms;
 	blocker_config_t blocker;
@@ -221,6 +274,26 @@ typedef struct
 	int grey_threshold;
 	int block_threshold;
 	int pool_maxthreads;
+	int postfix_io_threads;	/* 0 is a thread per connection */
+	int pool_minthreads;
+	mseconds_t pool_idle_time;
+	int pool_spawn_rate;
+	pool_size_t *pool_sizes;
+	check_stage_t *check_stages;
+	int executor_threads;
+	int pool_queue_len;
+	int pool_queue_policy;
+	mseconds_t pool_queue_timeout;
+	int update_queue_len;
+	int update_queue_policy;
+	mseconds_t update_queue_timeout;
+	int check_cache_size;
+	int check_cache_ttl;
+	int querylog_sample;	/* log one query in querylog_sample */
+	int querylog_rate;	/* query log lines per second, 0 is unlimited */
+	int querylog_trace;	/* trace one of this many query log lines, 0 is none */
+	char *querylog_file;	/* the binary query log, NULL if none */
+	int querylog_records;	/* size of the binary query log */
 	char *grey_reason;
 	char *block_reason;
 	char *pidfile;
@@ -268,10 +341,25 @@ typedef struct
 
 #define MAXCHECKS 128
 
+/* what running a check takes, expensive checks run in a later stage */
+typedef enum
+{
+	COST_LOCAL = 0,		/* no network traffic */
+	COST_DNS,		/* dns queries in parallel */
+	COST_REMOTE,		/* a connection or a chain of queries */
+} check_cost_t;
+
 typedef struct
 {
 	thread_pool_t *pool;
 	bool definitive;
+	int results;		/* maximum number of results per job */
+	int cache;		/* cache_key_t, see checkcache.h */
+	check_cost_t cost;
+	int min_weight;		/* the least weight a job may return, <= 0 */
+	int max_weight;		/* the most weight a job may return, >= 0 */
+	int stage;		/* the checks of stage 0 are started first */
+	uint64_t skipped;	/* atomic, not started as the verdict was settled */
 	char *name;
 	void (*init_routine) (void *, pool_limits_t *);
 	void *check_arg;
@@ -300,6 +388,7 @@ typedef struct gross_ctx_s
 {
 	bloom_ring_queue_t *filter;
 	int update_q;
+	int sync_q;		/* the oper syncs for the peer, see syncmgr.c */
 	thread_locks_t locks;
 	time_t *last_rotate;
 #ifdef DNSBL
@@ -316,6 +405,7 @@ typedef struct gross_ctx_s
 	stats_t stats;
 	check_t *checklist[MAXCHECKS];
 	bool syslog_open;
+	struct qlog_s *qlog;	/* the binary query log, NULL if none */
 } gross_ctx_t;
 
 #ifndef HAVE_USECONDS_T
@@ -40,8 +40,10 @@
 			"stat_type",		"delay",	\
 			"stat_type",		"status",	\
 			"grey_mask",		"24",		\
+			"grey_mask6",		"64",		\
 			"grey_delay",		"10",           \
 			"grey_tuple",		"user",		\
+			"tuple_format",		"compat",	\
 			"syslog_facility",	"mail",		\
 			"blocker_port",		"4466",		\
 			"blocker_weight",	"1",		\
@@ -50,7 +52,25 @@
 			"grey_reason",		"Please try again later", \
 			"block_reason",		"Bad reputation", \
 			"query_timelimit",	"5000",		\
-			"pool_maxthreads",	"100"
+			"pool_maxthreads",	"100",		\
+			"postfix_io_threads",	"2",		\
+			"listen_threads",	"1",		\
+			"listen_backlog",	"128",		\
+			"listen_mode",		"0660",		\
+			"pool_minthreads",	"8",		\
+			"pool_idle_time",	"10000",	\
+			"pool_spawn_rate",	"20",		\
+			"executor_threads",	"0",		\
+			"pool_queue_len",	"1000",		\
+			"pool_queue_policy",	"reject",	\
+			"update_queue_len",	"50000",	\
+			"update_queue_policy",	"block",	\
+			"check_cache_size",	"10000",	\
+			"check_cache_ttl",	"60",		\
+			"querylog_sample",	"1",		\
+			"querylog_rate",	"0",		\
+			"querylog_trace",	"0",		\
+			"querylog_records",	"100000"
 
 #define MULTIVALUES	"dnsbl",	\
 			"rhsbl",	\
@@ -58,6 +78,8 @@
 			"check",	\
                         "stat_type",	\
 			"protocol", 	\
+			"pool_threads",	\
+			"check_stage",	\
 			"log_method"
 
 #define VALID_NAMES     "dnsbl",			\
@@ -80,8 +102,10 @@
                         "log_method",			\
                         "log_level",			\
 			"grey_mask",			\
+			"grey_mask6",			\
                         "grey_delay",               	\
                         "grey_tuple",               	\
+			"tuple_format",			\
 			"check",			\
 			"protocol",			\
                         "syslog_facility",		\
@@ -101,7 +125,31 @@
 			"block_reason",			\
 			"milter_listen",		\
 			"pidfile",			\
-			"pool_maxthreads"
+			"pool_maxthreads",		\
+			"pool_minthreads",		\
+			"postfix_io_threads",		\
+			"listen_threads",		\
+			"listen_backlog",		\
+			"listen_cpus",			\
+			"listen_mode",			\
+			"postfix_listen",		\
+			"sjsms_listen",			\
+			"pool_idle_time",		\
+			"pool_spawn_rate",		\
+			"pool_threads",			\
+			"executor_threads",		\
+			"pool_queue_len",		\
+			"pool_queue_policy",		\
+			"update_queue_len",		\
+			"update_queue_policy",		\
+			"check_cache_size",		\
+			"check_cache_ttl",		\
+			"check_stage",			\
+			"querylog_sample",		\
+			"querylog_rate",		\
+			"querylog_trace",		\
+			"querylog_file",		\
+			"querylog_records"
 
 #define DEPRECATED_NAMES 	"syncport",		\
 				"synchost",		\
@@ -134,7 +182,11 @@
  */
 #define PARAMS	"dnsbl",	"0",	"1",	\
 		"rhsbl",	"0",	"1",	\
-		"pidfile",	"0",	"1"
+		"pidfile",	"0",	"1",	\
+		"pool_threads",	"2",	"2",	\
+		"check_stage",	"1",	"1",	\
+		"pool_queue_policy",	"0",	"1",	\
+		"update_queue_policy",	"0",	"1"
 
 typedef struct params_s
 {
@@ -39,9 +39,9 @@ typedef struct dns_request_s
 } dns_request_t;
 
 void helper_dns_init();
-struct hostent *Gethostbyname(const char *name, mseconds_t timeout);
-struct hostent *Gethostbyaddr(const char *addr, mseconds_t timeout);
-struct hostent *Gethostbyaddr_str(const char *addr, mseconds_t timeout);
+struct hostent *Gethostbyname(const char *name, mseconds_t timeout, edict_t *edict);
+struct hostent *Gethostbyaddr(const char *addr, mseconds_t timeout, edict_t *edict);
+struct hostent *Gethostbyaddr_str(const char *addr, mseconds_t timeout, edict_t *edict);
 void free_hostent(struct hostent *host);
 ub4 one_at_a_time(char *key, ub4 len);
 
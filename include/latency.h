@@ -0,0 +1,46 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2008
+ *               Eino Tuominen <eino@utu.fi>
+ *               Antti Siira <antti@utu.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+/*
+ * Latency histograms. Bucket i counts the samples from 2^(i-1) to
+ * 2^i - 1 microseconds, bucket 0 the ones under a microsecond. The
+ * counters are updated atomically, so any thread may add samples
+ * without locking.
+ */
+
+#define LATENCY_BUCKETS 32
+
+typedef struct
+{
+	uint64_t count;
+	uint64_t sum;		/* microseconds */
+	uint64_t max;
+	uint64_t bucket[LATENCY_BUCKETS];
+} latency_t;
+
+void latency_add(latency_t *hist, int usec);
+void latency_take(latency_t *hist, latency_t *snapshot);
+uint64_t latency_percentile(const latency_t *hist, double percentile);
+int latency_format(const latency_t *hist, char *buf, size_t len);
+
+#endif /* LATENCY_H */
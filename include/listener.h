@@ -0,0 +1,43 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2008
+ *               Eino Tuominen <eino@utu.fi>
+ *               Antti Siira <antti@utu.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LISTENER_H
+#define LISTENER_H
+
+/*
+ * The protocol servers take their input in listen_threads listener
+ * threads. With SO_REUSEPORT every listener has a socket of its own
+ * and the kernel spreads the connections or datagrams between them,
+ * otherwise the listeners share one socket. They share a unix socket
+ * as well, see postfix_listen and sjsms_listen. A listener may be bound
+ * to a processor, see listen_cpus.
+ */
+
+typedef struct listener_s
+{
+	int index;
+	int fd;			/* the listening socket */
+	void *(*routine) (struct listener_s *);
+} listener_t;
+
+void start_listeners(thread_info_t *tinfo, int type, const char *path,
+    void *(*routine) (listener_t *));
+
+#endif /* LISTENER_H */
@@ -28,9 +28,18 @@ typedef struct msg_s
 	struct timespec timestamp;
 } msg_t;
 
+/* what put_msg() does when a bounded queue is full */
+typedef enum
+{
+	OVERFLOW_REJECT = 0,	/* fail immediately with EAGAIN */
+	OVERFLOW_DROP_OLDEST,	/* discard the head of the queue */
+	OVERFLOW_BLOCK,		/* wait for space, then fail with EAGAIN */
+} overflow_policy_t;
+
 typedef struct msgqueue_s
 {
 	pthread_cond_t cv;
+	pthread_cond_t space_cv;	/* signalled when a bounded queue has room */
 	pthread_mutex_t mx;
 	msg_t *head;
 	msg_t *tail;
@@ -40,6 +49,11 @@ typedef struct msgqueue_s
 	int *impose_delay;	/* both the queues point to the same int */
 	bool active;
 	int id;
+	size_t maxlen;		/* 0 is unbounded */
+	overflow_policy_t policy;
+	mseconds_t block_timeout;	/* for OVERFLOW_BLOCK */
+	void (*drop) (void *);	/* destructor for dropped message contents */
+	uint64_t overflows;
 } msgqueue_t;
 
 typedef struct
@@ -53,7 +67,11 @@ int get_delay_queue(const struct timespec *ts);
 int disable_delay(int msqid);
 int enable_delay(int msqid);
 int set_delay(int msqid, const struct timespec *ts);
+int set_queue_limit(int msqid, size_t maxlen, overflow_policy_t policy, mseconds_t timeout,
+    void (*drop) (void *));
+uint64_t queue_overflows(int msqid);
 int put_msg(int msqid, void *msgp, size_t msgsz);
+int put_msg_nowait(int msqid, void *msgp, size_t msgsz);
 int instant_msg(int msqid, void *msgp, size_t msgsz);
 int release_queue(int msqid);
 size_t get_msg(int msqid, void *msgp, size_t maxsize);
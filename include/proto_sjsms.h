@@ -40,6 +40,7 @@ typedef struct
 #define MSGTYPE_QUERY    ((uint16_t) 0)
 #define MSGTYPE_LOGMSG   ((uint16_t) 1)
 #define MSGTYPE_QUERY_V2 ((uint16_t) 2)
+#define MSGTYPE_STATS    ((uint16_t) 3)
 
 typedef struct
 {
@@ -52,6 +53,7 @@ int fold(grey_req_t *request, const char *sender, const char *recipient, const c
 int sendquery(int fd, struct sockaddr_in *gserv, grey_req_t *request);
 int sendquerystr(int fd, struct sockaddr_in *gserv, const char *querystr);
 int senderrormsg(int fd, struct sockaddr_in *gserv, const char *fmt, ...);
+int sendstatsmsg(int fd, struct sockaddr_in *gserv, const char *stats);
 int sjsms_to_host_order(sjsms_msg_t *message);
 int recvquery(sjsms_msg_t *message, grey_req_t *request);
 char *recvquerystr(sjsms_msg_t *message);
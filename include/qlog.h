@@ -0,0 +1,96 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2008
+ *               Eino Tuominen <eino@utu.fi>
+ *               Antti Siira <antti@utu.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef QLOG_H
+#define QLOG_H
+
+/*
+ * The binary query log. A file holding a header and a ring of fixed
+ * size records, mapped to memory and shared by all the threads. A
+ * record is claimed by advancing the head, and it is committed by
+ * writing its sequence number last, so a reader can tell a finished
+ * record from one being written or already overwritten. When the ring
+ * is full the oldest records are overwritten.
+ */
+
+#define QLOG_MAGIC	0x47514c31	/* "GQL1" */
+#define QLOG_VERSION	1
+
+#define QLOG_PROTOLEN	8
+#define QLOG_IPLEN	48
+#define QLOG_ADDRLEN	128
+#define QLOG_HELOLEN	64
+#define QLOG_NAMELEN	24
+#define QLOG_MAXMATCH	8
+#define QLOG_MINRECORDS	1024	/* far more than threads appending at once */
+
+typedef struct qlog_header_s
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t unused;
+	uint64_t capacity;	/* number of records */
+	uint64_t head;		/* atomic, the next sequence number */
+	char pad[32];
+} qlog_header_t;
+
+typedef struct qlog_match_s
+{
+	char name[QLOG_NAMELEN];
+	int32_t weight;
+	int32_t delay;		/* ms from the start of the query to the result */
+} qlog_match_t;
+
+typedef struct qlog_record_s
+{
+	uint64_t seq;		/* sequence number + 1, 0 while being written */
+	uint64_t time;		/* start of the query, microseconds since the epoch */
+	uint32_t delay;		/* ms */
+	int32_t totalweight;
+	uint8_t action;		/* grey_status_t */
+	uint8_t nmatch;
+	uint8_t unused[6];
+	char proto[QLOG_PROTOLEN];
+	char client_ip[QLOG_IPLEN];
+	char sender[QLOG_ADDRLEN];
+	char recipient[QLOG_ADDRLEN];
+	char helo[QLOG_HELOLEN];
+	qlog_match_t match[QLOG_MAXMATCH];
+} qlog_record_t;
+
+typedef struct qlog_s
+{
+	qlog_header_t *header;
+	qlog_record_t *records;
+	size_t size;		/* of the mapping */
+	int fd;
+} qlog_t;
+
+qlog_t *qlog_open(const char *path, uint64_t capacity);
+qlog_t *qlog_map(const char *path);
+void qlog_close(qlog_t *qlog);
+void qlog_append(qlog_t *qlog, const qlog_record_t *record);
+uint64_t qlog_oldest(qlog_t *qlog);
+uint64_t qlog_head(qlog_t *qlog);
+int qlog_read(qlog_t *qlog, uint64_t seq, qlog_record_t *record);
+const char *qlog_action(int action);
+
+#endif /* QLOG_H */
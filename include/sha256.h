@@ -47,11 +47,23 @@ typedef struct
 	sha_uint_t h7;
 } sha_256_t;
 
+/* State of an incremental hash */
+typedef struct
+{
+	sha_256_t digest;
+	sha_ulong_t length;	/* bytes fed so far */
+	sha_uint_t fill;	/* bytes in block */
+	sha_byte_t block[64];
+} sha256_state_t;
+
 /* *to must be at least 72 bytes long char buffer */
 void string_sha256_hexdigest(char *to, char *message); 
 /* *to must be at least 72 bytes long char buffer */
 void sha256_hexdigest(char *to, char *message, sha_ulong_t size); 
 sha_256_t sha256_string(char *message);
 sha_256_t sha256(sha_byte_t *message, sha_ulong_t size);
+void sha256_init(sha256_state_t *state);
+void sha256_update(sha256_state_t *state, const void *data, sha_ulong_t size);
+sha_256_t sha256_final(sha256_state_t *state);
 
 #endif
@@ -62,6 +62,7 @@ enum logmsgtype_t
 	STATS_STATUS_BEGIN = 0x40002,
 	STATS_DELAY = 0x40004,
 	STATS_DNSBL = 0x40008,
+	STATS_LATENCY = 0x40010,
 	STATS_FULL = 0x4ffff
 };
 
@@ -83,21 +84,50 @@ typedef struct
 	char mtext[MSGSZ];
 } log_message_t;
 
+#define LOG_RING_SLOTS	64	/* lines buffered per thread */
+#define LOG_FLUSH_TIME	100	/* ms, the longest a line waits in a ring */
+#define LOG_BATCH_SIZE	(64 * 1024)
+
+typedef struct log_slot_s
+{
+	int level;
+	time_t when;
+	char text[MSGSZ];
+} log_slot_t;
+
+/* a single producer, single consumer ring of log lines */
+typedef struct log_ring_s
+{
+	unsigned int head;	/* atomic, written by the owner thread */
+	unsigned int tail;	/* atomic, written by the log writer */
+	int dead;		/* atomic, the owner thread has exited */
+	struct log_ring_s *next;	/* linked list */
+	log_slot_t slot[LOG_RING_SLOTS];
+} log_ring_t;
+
+/*
+ * The levels above GLOG_COMPILED are compiled out, see configure
+ * --disable-debug-log. logstr() tests the level before evaluating
+ * the arguments.
+ */
+#ifdef NO_DEBUG_LOG
+# define GLOG_COMPILED	GLOG_INFO
+#else
+# define GLOG_COMPILED	GLOG_FULL
+#endif
+#define logstr(level, ...)	\
+	((level) > GLOG_COMPILED || (level) > ctx->config.loglevel ? 0 : log_write((level), __VA_ARGS__))
+
 typedef struct
 {
 	int mtype;
 	char mtext[MSGSZ];
 } update_message_t;
 
-typedef struct
-{
-	void *result;
-} poolresult_message_t;
-
 /* global context */
 extern gross_ctx_t *ctx;
 
-int logstr(int level, const char *fmt, ...);
+int log_write(int level, const char *fmt, ...);
 int logmsg(log_message_t *mbuf);
 
 int statstr(int level, const char *fmt, ...);
@@ -110,13 +140,24 @@ void release_bloom_ring_queue(bloom_ring_queue_t *brq);
 void daemonize(void);
 void *Malloc(size_t size);
 void *create_thread(thread_info_t *tinfo, int detach, void *(*routine) (void *), void *arg);
-void register_check(thread_pool_t *pool, bool definitive);
-char *ipstr(struct sockaddr_in *saddr);
+void *create_thread_stack(thread_info_t *tinfo, int detach, void *(*routine) (void *), void *arg,
+    size_t stacksize);
+void register_check(thread_pool_t *pool, bool definitive, int results, int cache, check_cost_t cost,
+    int min_weight, int max_weight);
+char *ipstr(struct sockaddr *saddr);
+char *ipstr_r(struct sockaddr *saddr, char *buf);
+void compile_template(response_template_t *compiled, const char *template);
+char *expand_template(char *result, size_t len, const response_template_t *template, const char *reason);
+int template_iov(struct iovec *iov, const response_template_t *template, const char *reason);
 void create_statefile(void);
 void check_pidfile(void);
 void create_pidfile(void);
 int log_open(void);
 int log_close(void);
+void log_writer_init(void);
+void log_flush(void);
+int logging_stats(char *buf, size_t len);
+bool querylog_admit(void);
 
 
 #endif
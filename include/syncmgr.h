@@ -22,6 +22,8 @@
 
 #include "srvutils.h"
 
+#define SYNC_QUEUE_LEN 4096	/* oper syncs waiting for the peer */
+
 /* Sync protocol:
  * - All integers are 32bit in network order
  *
@@ -69,17 +71,20 @@ typedef struct
 	uint32_t count;
 } aggregate_sync_t;
 
+struct rbuf_s;
+
 int min(int x, int y);
 
 int send_startup_sync(peer_t *peer, startup_sync_t *sync);
 int send_oper_sync(peer_t *peer, oper_sync_t *sync);
+int queue_oper_sync(sha_256_t digest);
 int force_peer_aggregate();
 void send_filters(peer_t *peer);
 
 void *recv_syncs(void *arg);
-int recv_sync_msg(peer_t *peer);
-int recv_startup_sync(peer_t *peer);
-int recv_oper_sync(peer_t *peer);
+int recv_sync_msg(peer_t *peer, struct rbuf_s *rb);
+int recv_startup_sync(peer_t *peer, struct rbuf_s *rb);
+int recv_oper_sync(peer_t *peer, struct rbuf_s *rb);
 
 startup_sync_t sston(startup_sync_t ss);	/*  Startup sync to network order */
 startup_sync_t sstoh(startup_sync_t ss);	/*  Startup sync to host order */
@@ -29,14 +29,30 @@ typedef struct thread_pool_s
 	int work_queue_id;
 	const char *name;	/* name of the pool for logging purposes */
 	void *arg;		/* pool specific arguments, if needed */
+	int check;		/* index in ctx->checklist, -1 if not a check */
+	struct pool_ctx_s *pool_ctx;
 } thread_pool_t;
 
 typedef struct
 {
-	int count;
-	pthread_mutex_t mx;
+	int count;		/* atomic */
 } reference_count_t;
 
+/*
+ * Taking a reference needs no ordering, the caller already holds one.
+ * Dropping one releases our writes to the object, and the thread that
+ * drops the last one acquires everybody else's before freeing it.
+ */
+#ifdef __ATOMIC_ACQ_REL
+# define REFERENCE_INIT(r)	__atomic_store_n(&(r)->count, 1, __ATOMIC_RELAXED)
+# define REFERENCE_TAKE(r)	__atomic_add_fetch(&(r)->count, 1, __ATOMIC_RELAXED)
+# define REFERENCE_DROP(r)	__atomic_sub_fetch(&(r)->count, 1, __ATOMIC_ACQ_REL)
+#else
+# define REFERENCE_INIT(r)	((r)->count = 1)
+# define REFERENCE_TAKE(r)	__sync_add_and_fetch(&(r)->count, 1)
+# define REFERENCE_DROP(r)	__sync_sub_and_fetch(&(r)->count, 1)
+#endif
+
 #ifndef HAVE_BOOL
 # ifndef bool
 #  ifndef __bool_true_false_are_defined
@@ -49,13 +65,62 @@ typedef int bool;
 # endif	/* bool */
 #endif /* HAVE_BOOL */
 
+/* the check results are defined by the workers */
+struct chkresult_s;
+
+/*
+ * completion	- fixed result slots of an edict. The checks reserve a
+ * slot, fill it in place and publish it. The waiter is woken up only
+ * if it is sleeping.
+ */
+typedef struct completion_s
+{
+	struct chkresult_s *slot;
+	int size;		/* number of slots, 0 if results are not wanted */
+	int reserved;		/* atomic, slots handed out */
+	int published;		/* atomic, slots ready for the waiter */
+	int consumed;		/* waiter only */
+	int waiting;		/* atomic, the waiter is asleep */
+	pthread_mutex_t mx;
+	pthread_cond_t cv;
+} completion_t;
+
+/*
+ * cancel_hook	- a wake up registered by a check sleeping on something
+ * else than the edict, run once when the edict is cancelled
+ */
+typedef struct cancel_hook_s
+{
+	void (*wakeup) (void *);
+	void *arg;
+	struct cancel_hook_s *next;	/* linked list */
+} cancel_hook_t;
+
+/*
+ * cancel_t	- cancellation token of an edict. Checks may poll it
+ * with edict_cancelled() or register a wake up with cancel_register().
+ */
+typedef struct cancel_s
+{
+	int cancelled;		/* atomic */
+	pthread_mutex_t mx;
+	cancel_hook_t *hooks;
+} cancel_t;
+
 typedef struct edict_s
 {
 	void *job;
-	int resultmq;
-	bool obsolete;
+	completion_t results;
+	cancel_t cancel;
 	reference_count_t reference;
-	mseconds_t timelimit;
+	struct timespec deadline;	/* absolute (CLOCK_TYPE), zero if none */
+	void (*release) (void *job);	/* drops the reference of a job never run */
+	/*
+	 * the observer sees every result before it is published, and
+	 * it is called with NULL when the edict is freed
+	 */
+	void (*observer) (struct edict_s *, struct chkresult_s *);
+	void *observer_arg;
 } edict_t;
 
 typedef struct watchdog_s
@@ -73,12 +138,23 @@ typedef struct
 } thread_ctx_t;
 
 #define IDLETIME (mseconds_t)1000	/* max loop wait time */
+#define EXECUTOR_STACK_SIZE ((size_t)(256 * 1024))
+#define EXECUTOR_THREADS_PER_CPU 16
+#define MAXPOOLS 128
+#define CANCEL_POLL_TIME (mseconds_t)100	/* max sleep between cancellation polls */
 
 typedef struct
 {
 	int max_thread;
+	int min_thread;		/* threads started at init and kept running */
+	mseconds_t idle_time;	/* surplus time before idle threads retire */
+	int spawn_rate;		/* new threads per second, 0 is unlimited */
 	mseconds_t watchdog_time;
 	bool watchdog;
+	int queue_len;		/* maximum queued jobs, 0 is unlimited */
+	int queue_policy;	/* overflow_policy_t, see msgqueue.h */
+	mseconds_t queue_timeout;	/* for OVERFLOW_BLOCK */
+	bool shared;		/* run the jobs in the shared executor */
 } pool_limits_t;
 
 typedef struct pool_ctx_s
@@ -91,15 +167,57 @@ typedef struct pool_ctx_s
 	float ewma_idle;	/* moving average of count_idle */
 	struct timespec last_idle_check;
 	int max_thread;		/* maximum threads in the pool */
-	int idle_time;		/* how many seconds to wait new jobs */
+	int min_thread;		/* minimum threads in the pool */
+	mseconds_t idle_time;	/* surplus time before idle threads retire */
+	bool surplus;		/* too many idle threads */
+	struct timespec surplus_since;
+	int spawn_rate;		/* new threads per second, 0 is unlimited */
+	double spawn_budget;	/* threads we may start right now */
+	struct timespec last_spawn;
+	uint64_t spawned;
+	uint64_t retired;
 	watchdog_t *wdlist;	/* watchdog list */
 	int watchdog_time;	/* watchdog timer, 0 is disabled */
+	bool shared;		/* jobs run in the shared executor */
+	int index;		/* pool number in the executor */
+	int deferred;		/* tokens held back by max_thread */
+	uint64_t expired;	/* atomic, jobs dropped past their deadline */
+	latency_t wait;		/* from submit_job() to the start of the job */
+	latency_t run;		/* of the job */
 } pool_ctx_t;
 
+/* a worker thread of the shared executor */
+typedef struct executor_worker_s
+{
+	pthread_mutex_t mx;
+	pool_ctx_t **tokens;	/* deque of pools with a queued job */
+	int head;		/* oldest token, thieves take from here */
+	int count;
+	int size;
+	bool busy;
+	thread_ctx_t *thread_ctx[MAXPOOLS];	/* per pool state, created lazily */
+	watchdog_t watchdog;
+	int id;
+} executor_worker_t;
+
+typedef struct
+{
+	pthread_mutex_t mx;
+	pthread_cond_t cv;
+	int sleeping;		/* workers waiting for tokens */
+	int nworkers;
+	executor_worker_t *workers;
+	unsigned int next;	/* round robin for outside submitters */
+	int npools;
+	mseconds_t watchdog_time;	/* 0 is disabled */
+	struct timespec last_check;
+} executor_t;
+
 /* message queue wrap for edicts */
 typedef struct edict_message_s
 {
 	edict_t *edict;
+	struct timespec queued;	/* CLOCK_TYPE */
 } edict_message_t;
 
 #define LAMBDA 0.1
@@ -108,9 +226,21 @@ typedef struct edict_message_s
 int submit_job(thread_pool_t *pool, edict_t *edict);
 thread_pool_t *create_thread_pool(const char *name, int (*routine) (thread_pool_t *, thread_ctx_t *,
 	edict_t *), pool_limits_t *limits, void *arg);
-edict_t *edict_get();
-edict_t *edict_get();
-void send_result(edict_t *edict, void *result);
+edict_t *edict_get(int nresults);
+void executor_init(int nthreads, mseconds_t watchdog_time);
+int pool_stats(char *buf, size_t len);
+void pool_latency_stats(void);
+struct chkresult_s *result_reserve(edict_t *edict, thread_pool_t *pool);
+void result_publish(edict_t *edict, struct chkresult_s *result);
+void result_fail(edict_t *edict, thread_pool_t *pool);
+struct chkresult_s *result_wait(edict_t *edict, const struct timespec *deadline);
+void edict_reference(edict_t *edict);
 void edict_unlink(edict_t *edict);
+void edict_deadline(edict_t *edict, const struct timespec *start, mseconds_t timelimit);
+mseconds_t edict_timeleft(edict_t *edict);
+bool edict_cancelled(edict_t *edict);
+void edict_cancel(edict_t *edict);
+void cancel_register(edict_t *edict, cancel_hook_t *hook);
+void cancel_unregister(edict_t *edict, cancel_hook_t *hook);
 
 #endif /* THREAD_POOL_H */
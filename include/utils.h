@@ -23,6 +23,22 @@
 enum readlineret_t
 { ERROR = -1, EMPTY = 0, DATA = 1 };
 
+/*
+ * A buffered reader. It fills the buffer with as much as the descriptor
+ * has to give and hands out the lines as pointers into the buffer.
+ */
+#define RBUFSZ (4 * MAXLINELEN)
+
+#define WRITEVN_TIMEOUT 10000	/* ms to wait for a slow reader */
+
+typedef struct rbuf_s
+{
+	int fd;
+	size_t start;		/* of the data not consumed yet */
+	size_t end;		/* of the data in buf */
+	char buf[RBUFSZ + 1];	/* room for a terminator */
+} rbuf_t;
+
 #define SI_KILO 1000
 #define SI_MEGA (SI_KILO * SI_KILO)
 #define SI_GIGA (SI_KILO * SI_MEGA)
@@ -41,12 +57,19 @@ int clock_gettime(clockid_t clk_id, struct timespec *tp);
 int readline(int fd, void *vptr, size_t maxlen);
 ssize_t readn(int fd, void *vptr, size_t n);
 ssize_t writen(int fd, const void *vptr, size_t n);
+ssize_t writevn(int fd, struct iovec *iov, int iovcnt);
+void rbuf_init(rbuf_t *rb, int fd);
+ssize_t rbuf_fill(rbuf_t *rb);
+char *rbuf_line(rbuf_t *rb, size_t *len);
+int rbuf_readline(rbuf_t *rb, char **line);
+ssize_t rbuf_readn(rbuf_t *rb, void *vptr, size_t n);
 ssize_t writeline(int fd, const char *line);
 ssize_t writet(int fd, const char *line, const char *terminator);
 ssize_t respond(int fd, const char *response);
 int trim(char **buffer);
 int chomp(char *buffer);
 int ms_diff(struct timespec *t1, struct timespec *t2);
+int us_diff(struct timespec *t1, struct timespec *t2);
 int ts_sum(struct timespec *sum, const struct timespec *t1, const struct timespec *t2);
 int ts_diff(struct timespec *diff, const struct timespec *t1, const struct timespec *t2);
 void mstotimespec(int mseconds, struct timespec *ts);
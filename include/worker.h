@@ -22,17 +22,27 @@
 
 #include "thread_pool.h"
 #include "srvutils.h"
+#include "arena.h"
 
-#define MAXCONNQ 5
+/* initial size of a request arena, enough for a typical query */
+#define REQUEST_ARENA_SIZE 1024
 
 typedef enum
 { STATUS_GREY, STATUS_MATCH, STATUS_TRUST, STATUS_UNKNOWN, STATUS_FAIL, STATUS_BLOCK } grey_status_t;
 
 #define LEGALREASONCHARACTERS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ01234567890 .-_@";
-#define REASONTEMPLATE "%reason%"
+
+/* completion slot states */
+#define SLOT_EMPTY	0
+#define SLOT_READY	1
+#define SLOT_CONSUMED	2
 
 typedef struct chkresult_s
 {
+	int state;		/* owned by the completion */
+	bool failed;		/* the check never ran */
+	bool uncertain;		/* the check did not finish, do not cache */
+	int check;		/* index in ctx->checklist, -1 if unknown */
 	bool definitive;
 	bool wait;
 	int weight;
@@ -45,6 +55,7 @@ typedef struct check_match_s
 {
 	const char *name;
 	int weight;
+	int delay;		/* ms from the start of the query */
 	struct check_match_s *next;	/* linked list */
 } check_match_t;
 
@@ -61,18 +72,31 @@ typedef struct querylog_entry_s
 	check_match_t *match;
 } querylog_entry_t;
 
+/* stages of a query, see trace_mark() */
+typedef enum
+{ TRACE_PARSE, TRACE_HASH, TRACE_BLOOM, TRACE_SUBMIT, TRACE_CHECKS, TRACE_VERDICT, TRACE_RESPOND,
+	TRACE_STAGES } trace_stage_t;
+
 typedef struct final_status_s
 {
+	arena_t *arena;		/* the arena of the request */
 	char *reason;
 	grey_status_t status;
 	querylog_entry_t querylog_entry;
 	struct timespec starttime;
+	struct timespec mark;	/* end of the last traced stage */
+	int trace[TRACE_STAGES];	/* microseconds spent in each stage */
+	bool hashed;		/* digest is set */
+	sha_256_t digest;	/* of the greylist tuple */
+	bool filtered;		/* seen is set */
+	bool seen;		/* the digest was in the filter */
 } final_status_t;
 
 typedef struct client_info_s
 {
 	int connfd;
-	struct sockaddr_in *caddr;
+	struct sockaddr_storage *caddr;
+	socklen_t caddrlen;
 	char *ipstr;
 	int msglen;
 	void *message;
@@ -86,22 +110,31 @@ typedef struct grey_tuple_s
 	char *client_address;
 	char *helo_name;
 	reference_count_t reference;
+	arena_t *arena;		/* the request and its strings live here */
+	struct timespec arrival;	/* of the first line, zero if not known */
 } grey_tuple_t;
 
 int worker(edict_t *edict);
 void free_request(grey_tuple_t *arg);
+/* test_tuple_fast() could not answer, the checks must be run */
+#define TUPLE_CHECKS 1
+
 int test_tuple(final_status_t *final, grey_tuple_t *tuple, tmout_action_t *ta);
+int test_tuple_fast(final_status_t *final, grey_tuple_t *tuple);
+void prefetch_checks(grey_tuple_t *tuple);
 void free_client_info(client_info_t *arg);
 void request_unlink(grey_tuple_t *request);
 grey_tuple_t *request_new();
 int process_parameter(grey_tuple_t *tuple, const char *str);
-char *try_match(const char *matcher, const char *matchee);
+const char *try_match(const char *matcher, const char *matchee);
 int check_request(grey_tuple_t *tuple);
-void record_match(querylog_entry_t *q, chkresult_t *r);
-final_status_t *init_status(const char *proto);
-void querylogwrite(querylog_entry_t *q);
+void record_match(final_status_t *final, chkresult_t *r);
+final_status_t *init_status(const char *proto, grey_tuple_t *request);
+void querylogwrite(querylog_entry_t *q, const int *trace);
 void finalize(final_status_t *status);
-void querylogwrite(querylog_entry_t *q);
+void querylogwrite(querylog_entry_t *q, const int *trace);
 void update_delay_stats(querylog_entry_t *q);
+void trace_mark(final_status_t *final, trace_stage_t stage);
+void trace_stats(void);
 
 #endif /* #ifndef WORKER_H */
@@ -0,0 +1,90 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2008
+ *                    Eino Tuominen <eino@utu.fi>
+ *                    Antti Siira <antti@utu.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "common.h"
+#include "srvutils.h"
+#include "arena.h"
+
+#define ARENASIZE 64
+#define LOOPSIZE 1000
+
+/* dummy context */
+gross_ctx_t *ctx;
+
+int
+main(int argc, char **argv)
+{
+	arena_t *arena;
+	char *str[LOOPSIZE];
+	char buffer[32];
+	void *ptr;
+	int i;
+	int errors = 0;
+	gross_ctx_t myctx = { 0x00 };
+	ctx = &myctx;
+
+	printf("Check: arena\n");
+
+	arena = arena_create(ARENASIZE);
+
+	printf("  Allocating %d strings over the chunk size...", LOOPSIZE);
+	fflush(stdout);
+	for (i = 0; i < LOOPSIZE; i++) {
+		snprintf(buffer, sizeof(buffer), "string number %d", i);
+		str[i] = arena_strdup(arena, buffer);
+		if ((size_t)str[i] % ARENA_ALIGN)
+			errors++;
+	}
+	for (i = 0; i < LOOPSIZE; i++) {
+		snprintf(buffer, sizeof(buffer), "string number %d", i);
+		if (strcmp(str[i], buffer))
+			errors++;
+	}
+	if (errors) {
+		printf("  FAILED.\n");
+		return 1;
+	}
+	printf("  Done.\n");
+
+	printf("  Allocating an object larger than a chunk...");
+	fflush(stdout);
+	ptr = arena_alloc(arena, 4 * ARENASIZE);
+	memset(ptr, 0xff, 4 * ARENASIZE);
+	printf("  Done.\n");
+
+	printf("  Resetting the arena...");
+	fflush(stdout);
+	arena_reset(arena);
+	if (arena->chunk != arena->first || arena->first->used != 0) {
+		printf("  FAILED.\n");
+		return 2;
+	}
+	/* the first chunk is reused */
+	ptr = arena_alloc(arena, 1);
+	if (arena->chunk != arena->first) {
+		printf("  FAILED.\n");
+		return 3;
+	}
+	printf("  Done.\n");
+
+	arena_destroy(arena);
+
+	return 0;
+}
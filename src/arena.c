@@ -0,0 +1,109 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2008
+ *               Eino Tuominen <eino@utu.fi>
+ *               Antti Siira <antti@utu.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "common.h"
+#include "srvutils.h"
+#include "arena.h"
+
+#define ALIGNED(n) (((n) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+#define CHUNK_DATA(c) ((char *)(c) + ALIGNED(sizeof(arena_chunk_t)))
+
+/*
+ * arena_create	- create an arena with a first chunk of size bytes,
+ * the arena and its first chunk are one allocation
+ */
+arena_t *
+arena_create(size_t size)
+{
+	arena_t *arena;
+
+	size = ALIGNED(size);
+	arena = Malloc(ALIGNED(sizeof(arena_t)) + ALIGNED(sizeof(arena_chunk_t)) + size);
+	arena->first = (arena_chunk_t *)((char *)arena + ALIGNED(sizeof(arena_t)));
+	arena->first->next = NULL;
+	arena->first->size = size;
+	arena->first->used = 0;
+	arena->chunk = arena->first;
+
+	return arena;
+}
+
+/*
+ * arena_alloc	- allocate size bytes, a new chunk at least the size of
+ * the first one is chained if the current one is full
+ */
+void *
+arena_alloc(arena_t *arena, size_t size)
+{
+	arena_chunk_t *chunk;
+	size_t chunksize;
+	void *ptr;
+
+	size = ALIGNED(size);
+	chunk = arena->chunk;
+	if (chunk->size - chunk->used < size) {
+		chunksize = MAX(size, arena->first->size);
+		chunk = Malloc(ALIGNED(sizeof(arena_chunk_t)) + chunksize);
+		chunk->size = chunksize;
+		chunk->used = 0;
+		chunk->next = arena->chunk;
+		arena->chunk = chunk;
+	}
+	ptr = CHUNK_DATA(chunk) + chunk->used;
+	chunk->used += size;
+
+	return ptr;
+}
+
+char *
+arena_strdup(arena_t *arena, const char *str)
+{
+	size_t len;
+	char *copy;
+
+	len = strlen(str) + 1;
+	copy = arena_alloc(arena, len);
+	memcpy(copy, str, len);
+
+	return copy;
+}
+
+/*
+ * arena_reset	- release everything in one step, keep the first chunk
+ */
+void
+arena_reset(arena_t *arena)
+{
+	arena_chunk_t *chunk;
+
+	while (arena->chunk != arena->first) {
+		chunk = arena->chunk;
+		arena->chunk = chunk->next;
+		Free(chunk);
+	}
+	arena->first->used = 0;
+}
+
+void
+arena_destroy(arena_t *arena)
+{
+	arena_reset(arena);
+	Free(arena);
+}
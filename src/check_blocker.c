@@ -29,6 +29,39 @@
 #include "srvutils.h"
 #include "utils.h"
 #include "worker.h"
+#include "checkcache.h"
+
+#include <fcntl.h>
+
+/*
+ * blocker_wait	- wait until the socket is ready for reading or
+ * writing. Gives up when the edict is cancelled or its deadline passes,
+ * polling for that at least every CANCEL_POLL_TIME. Returns 1 if the
+ * socket is ready, 0 if we gave up and -1 on error.
+ */
+static int
+blocker_wait(edict_t *edict, int fd, bool write)
+{
+	fd_set fds;
+	struct timespec ts;
+	struct timeval tv;
+	mseconds_t timeleft;
+	int ret;
+
+	while (!edict_cancelled(edict)) {
+		timeleft = edict_timeleft(edict);
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		mstotimespec(MIN(timeleft, CANCEL_POLL_TIME), &ts);
+		tstotv(&ts, &tv);
+		ret = select(fd + 1, write ? NULL : &fds, write ? &fds : NULL, NULL, &tv);
+		if (ret > 0)
+			return 1;
+		if (ret < 0 && errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
 
 int
 blocker(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
@@ -36,61 +69,104 @@ blocker(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 	chkresult_t *result;
 	int blocker;
 	int ret;
+	int flags;
+	int error;
+	socklen_t len;
 
 	grey_tuple_t *request;
 	const char *client_address;
-	char buffer[MAXLINELEN] = { '\0' };
-	struct timespec start, timeleft;
+	static char query_prologue[] = "client_address=";
+	static char query_epilogue[] = "\n\n";
+	struct iovec iov[3];
+	rbuf_t rb;
+	char *answer;
+	struct timespec ts;
+	struct timeval tv;
 
 	request = (grey_tuple_t *)edict->job;
 	client_address = request->client_address;
 	assert(client_address);
 
-	result = (chkresult_t *)Malloc(sizeof(chkresult_t));
-	memset(result, 0, sizeof(*result));
+	result = result_reserve(edict, info);
 	result->judgment = J_UNDEFINED;
 	result->checkname = "blocker";
-
-	clock_gettime(CLOCK_TYPE, &start);
-	mstotimespec(edict->timelimit, &timeleft);
+	result->uncertain = true;	/* until the blocker answers */
 
 	blocker = socket(AF_INET, SOCK_STREAM, 0);
 	if (blocker < 0) {
 		logstr(GLOG_ERROR, "blocker: socket: %s", strerror(errno));
 		goto FINISH;
 	}
+
+	/* connect without blocking, so that we can give up in time */
+	flags = fcntl(blocker, F_GETFL, 0);
+	fcntl(blocker, F_SETFL, flags | O_NONBLOCK);
 	ret = connect(blocker, (struct sockaddr *)&ctx->config.blocker.server, sizeof(struct sockaddr_in));
+	if (ret < 0 && errno == EINPROGRESS) {
+		ret = blocker_wait(edict, blocker, true);
+		if (ret > 0) {
+			len = sizeof(error);
+			ret = getsockopt(blocker, SOL_SOCKET, SO_ERROR, &error, &len);
+			if (0 == ret && error) {
+				errno = error;
+				ret = -1;
+			}
+		} else if (0 == ret) {
+			logstr(GLOG_DEBUG, "blocker: gave up connecting");
+			close(blocker);
+			goto FINISH;
+		}
+	}
 	if (ret < 0) {
 		logstr(GLOG_ERROR, "blocker: connect: %s", strerror(errno));
 		close(blocker);
 		goto FINISH;
 	}
-	/* build a query string */
-	snprintf(buffer, MAXLINELEN, "client_address=%s\n\n", request->client_address);
-	buffer[MAXLINELEN - 1] = '\0';
+	fcntl(blocker, F_SETFL, flags);
+
+	/* the answer is short, but do not hang on a partial one either */
+	mstotimespec(edict_timeleft(edict), &ts);
+	tstotv(&ts, &tv);
+	setsockopt(blocker, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
 	/* send the query */
-	ret = writen(blocker, buffer, strlen(buffer));
+	iov[0].iov_base = query_prologue;
+	iov[0].iov_len = sizeof(query_prologue) - 1;
+	iov[1].iov_base = (void *)client_address;
+	iov[1].iov_len = strlen(client_address);
+	iov[2].iov_base = query_epilogue;
+	iov[2].iov_len = sizeof(query_epilogue) - 1;
+	ret = writevn(blocker, iov, 3);
 	if (ret < 0) {
-		logstr(GLOG_ERROR, "blocker: writen: %s", strerror(errno));
+		logstr(GLOG_ERROR, "blocker: writevn: %s", strerror(errno));
 		close(blocker);
 		goto FINISH;
 	}
-	ret = readline(blocker, &buffer, MAXLINELEN);
+	ret = blocker_wait(edict, blocker, false);
+	if (0 == ret) {
+		logstr(GLOG_DEBUG, "blocker: gave up waiting for the answer");
+		close(blocker);
+		goto FINISH;
+	}
+	if (ret > 0) {
+		rbuf_init(&rb, blocker);
+		ret = rbuf_readline(&rb, &answer);
+	}
 	if (ret < 0) {
 		logstr(GLOG_ERROR, "blocker: readline: %s", strerror(errno));
 		close(blocker);
 		goto FINISH;
 	}
 	close(blocker);
+	result->uncertain = false;
 
-	if (strncmp(buffer, "action=565 ", 11) == 0) {
+	if (ret == DATA && strncmp(answer, "action=565 ", 11) == 0) {
 		logstr(GLOG_DEBUG, "found match from blocker: %s", request->client_address);
 		result->judgment = J_SUSPICIOUS;
 		result->weight = ctx->config.blocker.weight;
 	}
       FINISH:
-	send_result(edict, result);
+	result_publish(edict, result);
 	logstr(GLOG_DEBUG, "blocker returning");
 	request_unlink(request);
 
@@ -108,5 +184,6 @@ blocker_init(pool_limits_t *limits)
 	if (pool == NULL)
 		daemon_fatal("create_thread_pool");
 
-	register_check(pool, false);
+	register_check(pool, false, 1, CACHE_CLIENT_ADDRESS, COST_REMOTE,
+	    MIN(ctx->config.blocker.weight, 0), MAX(ctx->config.blocker.weight, 0));
 }
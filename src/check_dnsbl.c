@@ -28,6 +28,7 @@
 #include "srvutils.h"
 #include "utils.h"
 #include "worker.h"
+#include "checkcache.h"
 #include "helper_dns.h"
 
 /* the cleanup routine */
@@ -122,13 +123,12 @@ addrinfo_callback(void *arg, int status, struct hostent *host)
 		 * need to send result here.
 		 */
 		if (cba->check_info->type != TYPE_DNSWL) {
-			result = Malloc(sizeof(chkresult_t));
-			memset(result, 0, sizeof(*result));
+			result = result_reserve(cba->edict, cba->pool);
 			result->judgment = J_SUSPICIOUS;
 			result->weight = cba->dnsbl->weight;
 			result->wait = true;
 			result->checkname = cba->dnsbl->name;
-			send_result(cba->edict, result);
+			result_publish(cba->edict, result);
 		} else {
 			*cba->dnslname = cba->dnsbl->name;
 			*cba->done = true;
@@ -213,7 +213,7 @@ dnsblc(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 	int timeout = 0;
 	fd_set readers, writers;
 	struct timeval tv;
-	struct timespec ts, start, now, timeleft;
+	struct timespec ts, timeleft;
 	char buffer[MAXQUERYSTRLEN];
 	char *query;
 	char *qstr;
@@ -223,24 +223,29 @@ dnsblc(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 	dnsbl_t *dnsbl;
 	callback_arg_t *callback_arg;
 	const char *dnslname;
-	int timeused;
+	mseconds_t ms;
+	bool uncertain = false;	/* some lists were not asked */
 
 	chkresult_t *result;
 	grey_tuple_t *request;
 	dns_check_info_t *check_info;
 
-	logstr(GLOG_DEBUG, "dnsblc called: timelimit %d", edict->timelimit);
+	logstr(GLOG_DEBUG, "dnsblc called: time left %d", edict_timeleft(edict));
 
 	/* fetch check_info */
 	assert(info);
 	assert(info->arg);
 	check_info = (dns_check_info_t *)info->arg;
 
+	request = (grey_tuple_t *)edict->job;
+	assert(request);
+
 	/* initialize if we are not yet initialized */
 	if (NULL == thread_ctx->state) {
 		channel = Malloc(sizeof(*channel));
 		if (ares_init(channel) != ARES_SUCCESS) {
 			gerror("ares_init");
+			uncertain = true;
 			goto FINISH;
 		}
 		thread_ctx->state = channel;
@@ -249,12 +254,6 @@ dnsblc(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 		channel = (ares_channel *)thread_ctx->state;
 	}
 
-	request = (grey_tuple_t *)edict->job;
-	assert(request);
-	result = (chkresult_t *)Malloc(sizeof(chkresult_t));
-	memset(result, 0, sizeof(*result));
-	result->checkname = "dnsbl"; /* the default is only used in a GLOG_INSANE log line */
-
 	if (check_info->type == TYPE_DNSBL || check_info->type == TYPE_DNSWL) {
 		/* test the client ip address */
 		assert(request->client_address);
@@ -318,24 +317,24 @@ dnsblc(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 			callback_arg->querystr = orig_qstr;
 			callback_arg->edict = edict;
 			callback_arg->check_info = check_info;
+			callback_arg->pool = info;
 			ares_gethostbyname(*channel, query, PF_INET, &addrinfo_callback, callback_arg);
 		} else {
 			logstr(GLOG_DEBUG, "skipping dnsbl %s due to timeouts.", dnsbl->name);
+			uncertain = true;
 		}
 		Free(query);
 		dnsbl = dnsbl->next;
 	}
 
-	clock_gettime(CLOCK_TYPE, &start);
-
 	while (!timeout) {
 		do {
-			clock_gettime(CLOCK_TYPE, &now);
-			timeused = ms_diff(&now, &start);
-			if (timeused >= edict->timelimit)
+			/* wake up every CANCEL_POLL_TIME to see if we are still needed */
+			ms = edict_timeleft(edict);
+			if (0 == ms)
 				break;
 
-			mstotimespec(edict->timelimit - timeused, &timeleft);
+			mstotimespec(MIN(ms, CANCEL_POLL_TIME), &timeleft);
 
 			FD_ZERO(&readers);
 			FD_ZERO(&writers);
@@ -352,31 +351,34 @@ dnsblc(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 
 			count = select(nfds, &readers, &writers, NULL, &tv);
 			ares_process(*channel, &readers, &writers);
-		} while (!(done || edict->obsolete));
-
-		clock_gettime(CLOCK_TYPE, &now);
-		timeused = ms_diff(&now, &start);
+		} while (!(done || edict_cancelled(edict)));
 
-		if (timeused >= edict->timelimit) {
+		if (0 == edict_timeleft(edict)) {
 			logstr(GLOG_INSANE, "dnsbl timeout");
 			/* the final timeout value */
 			timeout = 1;
 		}
-		if (edict->obsolete || done || nfds == 0)
+		if (edict_cancelled(edict) || done || nfds == 0)
 			break;
 	}
 
 	Free(qstr);
 
+	if (timeout || edict_cancelled(edict))
+		uncertain = true;
+
 	ares_cancel(*channel);
       FINISH:
+	result = result_reserve(edict, info);
+	result->checkname = "dnsbl"; /* the default is only used in a GLOG_INSANE log line */
 	if (done && check_info->type == TYPE_DNSWL) {
 		result->judgment = J_PASS;
 		result->checkname = dnslname;
 	} else {
 		result->judgment = J_UNDEFINED;
 	}
-	send_result(edict, result);
+	result->uncertain = uncertain;
+	result_publish(edict, result);
 
 	logstr(GLOG_DEBUG, "dnsblc returning");
 	request_unlink(request);
@@ -388,6 +390,9 @@ void
 dnsbl_init(dns_check_info_t *check_info, pool_limits_t *limits)
 {
 	thread_pool_t *pool;
+	dnsbl_t *dnsbl;
+	int results;
+	int min_weight, max_weight;
 
 	/* initialize the thread pool */
 	logstr(GLOG_INFO, "initializing dns checker thread pool '%s'", check_info->name);
@@ -395,5 +400,21 @@ dnsbl_init(dns_check_info_t *check_info, pool_limits_t *limits)
 	if (pool == NULL)
 		daemon_fatal("create_thread_pool");
 
-	register_check(pool, check_info->definitive);
+	/* one result per listing and the final one, dnswl adds no weight */
+	results = 1;
+	min_weight = max_weight = 0;
+	for (dnsbl = check_info->dnsbase; dnsbl; dnsbl = dnsbl->next) {
+		results++;
+		if (check_info->type == TYPE_DNSWL)
+			continue;
+		if (dnsbl->weight < 0)
+			min_weight += dnsbl->weight;
+		else
+			max_weight += dnsbl->weight;
+	}
+
+	/* rhsbl depends on the sender domain, the others on the client */
+	register_check(pool, check_info->definitive, results,
+	    check_info->type == TYPE_RHSBL ? CACHE_SENDER_DOMAIN : CACHE_CLIENT_ADDRESS,
+	    COST_DNS, min_weight, max_weight);
 }
@@ -22,6 +22,7 @@
 #include "srvutils.h"
 #include "utils.h"
 #include "worker.h"
+#include "checkcache.h"
 #include "helper_dns.h"
 
 /*
@@ -81,7 +82,6 @@ helo(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 	const char *client_address;
 	char addrstrbuf[INET_ADDRSTRLEN];
 	const char *ptr;
-	mseconds_t timelimit;
 
 	request = (grey_tuple_t *)edict->job;
 	helostr = request->helo_name;
@@ -89,13 +89,10 @@ helo(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 	assert(helostr);
 	assert(client_address);
 
-	result = (chkresult_t *)Malloc(sizeof(chkresult_t));
-	memset(result, 0, sizeof(*result));
+	result = result_reserve(edict, info);
 	result->judgment = J_UNDEFINED;
 	result->checkname = "helo";
 
-	timelimit = edict->timelimit;
-
 	/* check the validity of helo string */
 	if (check_helo(helostr)) {
 		logstr(GLOG_DEBUG, "Syntactically suspicious helo name");
@@ -106,7 +103,12 @@ helo(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 	}
 
 	/* check if helo resolves to client ip */
-	host = Gethostbyname(helostr, timelimit);
+	host = Gethostbyname(helostr, edict_timeleft(edict), edict);
+	if (edict_cancelled(edict)) {
+		/* the answer is not needed any more, and may be incomplete */
+		result->uncertain = true;
+		goto FINISH;
+	}
 	if (host) {
 		ptr = inet_ntop(AF_INET, host->h_addr_list[0], addrstrbuf, INET_ADDRSTRLEN);
 		if (NULL == ptr) {
@@ -127,8 +129,10 @@ helo(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 	}
 
 	/* check if client's PTR record match helo */
-	reversehost = Gethostbyaddr_str(client_address, timelimit);
-        if (reversehost) {
+	reversehost = Gethostbyaddr_str(client_address, edict_timeleft(edict), edict);
+	if (edict_cancelled(edict)) {
+		result->uncertain = true;
+	} else if (reversehost) {
                 logstr(GLOG_INSANE, "client_address (%s) has a PTR record (%s)",
                         client_address, reversehost->h_name);
 		if (strcmp(reversehost->h_name, helostr)) {
@@ -144,7 +148,7 @@ helo(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
       FINISH:
 	if (result->weight > 0)
 		result->judgment = J_SUSPICIOUS;
-	send_result(edict, result);
+	result_publish(edict, result);
 	logstr(GLOG_DEBUG, "helo returning");
 	request_unlink(request);
 
@@ -162,5 +166,5 @@ helo_init(pool_limits_t *limits)
 	if (pool == NULL)
 		daemon_fatal("create_thread_pool");
 
-	register_check(pool, false);
+	register_check(pool, false, 1, CACHE_CLIENT_HELO, COST_DNS, 0, 2);
 }
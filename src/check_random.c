@@ -27,6 +27,7 @@
 #include "srvutils.h"
 #include "utils.h"
 #include "worker.h"
+#include "checkcache.h"
 
 /* the cleanup routine */
 int
@@ -59,8 +60,7 @@ randomc(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 	client_address = request->client_address;
 	assert(client_address);
 
-	result = (chkresult_t *)Malloc(sizeof(chkresult_t));
-	memset(result, 0, sizeof(*result));
+	result = result_reserve(edict, info);
 	result->judgment = J_UNDEFINED;
 	result->checkname = "random";
 
@@ -78,7 +78,7 @@ randomc(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 		result->weight = 1;	/* FIXME: needs to be configurable */
 	}
 
-	send_result(edict, result);
+	result_publish(edict, result);
 	logstr(GLOG_DEBUG, "random returning");
 	request_unlink(request);
 
@@ -96,5 +96,5 @@ random_init(pool_limits_t *limits)
 	if (pool == NULL)
 		daemon_fatal("create_thread_pool");
 
-	register_check(pool, true);
+	register_check(pool, true, 1, CACHE_NONE, COST_LOCAL, 0, 1);
 }
@@ -22,6 +22,7 @@
 #include "srvutils.h"
 #include "utils.h"
 #include "worker.h"
+#include "checkcache.h"
 #include "helper_dns.h"
 
 int
@@ -34,25 +35,26 @@ reverse(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 	const char *client_address;
         char buf[INET_ADDRSTRLEN];
 	const char *ptr;
-	mseconds_t timelimit;
 
 	request = (grey_tuple_t *)edict->job;
 	client_address = request->client_address;
 	assert(client_address);
 
-	result = (chkresult_t *)Malloc(sizeof(chkresult_t));
-	memset(result, 0, sizeof(*result));
+	result = result_reserve(edict, info);
 	result->judgment = J_UNDEFINED;
 	result->checkname = "reverse";
 
-	timelimit = edict->timelimit;
-
-	reversehost = Gethostbyaddr_str(client_address, timelimit);
-	if (reversehost) {
+	reversehost = Gethostbyaddr_str(client_address, edict_timeleft(edict), edict);
+	if (edict_cancelled(edict)) {
+		/* the answer is not needed any more, and may be incomplete */
+		result->uncertain = true;
+	} else if (reversehost) {
                 logstr(GLOG_INSANE, "client_address (%s) has a PTR record (%s)",
                         client_address, reversehost->h_name);
-		canonicalhost = Gethostbyname(reversehost->h_name, timelimit);
-		if (canonicalhost) {
+		canonicalhost = Gethostbyname(reversehost->h_name, edict_timeleft(edict), edict);
+		if (edict_cancelled(edict)) {
+			result->uncertain = true;
+		} else if (canonicalhost) {
 			ptr = inet_ntop(AF_INET, canonicalhost->h_addr_list[0], buf, INET_ADDRSTRLEN);
 			assert(ptr);
 			logstr(GLOG_INSANE, "client_ip (%s) canonical (%s)",
@@ -74,7 +76,7 @@ reverse(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 		result->weight = 1;
 	}
 
-	send_result(edict, result);
+	result_publish(edict, result);
 	logstr(GLOG_DEBUG, "reverse returning");
 	request_unlink(request);
 
@@ -92,5 +94,5 @@ reverse_init(pool_limits_t *limits)
 	if (pool == NULL)
 		daemon_fatal("create_thread_pool");
 
-	register_check(pool, false);
+	register_check(pool, false, 1, CACHE_CLIENT_ADDRESS, COST_DNS, 0, 1);
 }
@@ -23,6 +23,7 @@
 #include "srvutils.h"
 #include "utils.h"
 #include "worker.h"
+#include "checkcache.h"
 
 #define SPF_DEBUG_LEVEL 0
 
@@ -56,8 +57,7 @@ spfc(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 	request = (grey_tuple_t *)edict->job;
 	assert(request);
 
-	result = (chkresult_t *)Malloc(sizeof(chkresult_t));
-	memset(result, 0, sizeof(*result));
+	result = result_reserve(edict, info);
 	result->judgment = J_UNDEFINED;
         result->checkname = "spf";
 
@@ -103,6 +103,12 @@ spfc(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 		goto CLEANUP;
 	}
 
+	/* libspf2 can not be interrupted, this is the last chance to give up */
+	if (edict_cancelled(edict)) {
+		logstr(GLOG_DEBUG, "spf: query cancelled");
+		goto CLEANUP;
+	}
+
 	ret = SPF_request_query_mailfrom(spf_request, &spf_response);
 	switch (ret) {
 	case SPF_E_SUCCESS:
@@ -153,7 +159,7 @@ spfc(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 		SPF_response_free(spf_response);
       FINISH:
 
-	send_result(edict, result);
+	result_publish(edict, result);
 
 	logstr(GLOG_DEBUG, "spfc returning");
 	request_unlink(request);
@@ -173,5 +179,5 @@ spf_init(pool_limits_t *limits)
 		daemon_fatal("create_thread_pool");
 
 	/* This is a definitive check */
-	register_check(pool, true);
+	register_check(pool, true, 1, CACHE_NONE, COST_REMOTE, 0, 1);
 }
@@ -0,0 +1,156 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2008
+ *               Eino Tuominen <eino@utu.fi>
+ *               Antti Siira <antti@utu.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "common.h"
+#include "srvutils.h"
+#include "worker.h"
+#include "checkcache.h"
+
+#define CACHESIZE (CACHE_SHARDS * 4)
+#define LOOPSIZE 1000
+
+/* dummy context */
+gross_ctx_t *ctx;
+
+int
+main(int argc, char **argv)
+{
+	arena_t *arena;
+	cached_result_t stored[2], *results;
+	chkresult_t landing[2], *result;
+	edict_t *leader, *follower;
+	flight_t *flight;
+	struct timespec deadline;
+	char key[32];
+	int i, count, found;
+	gross_ctx_t myctx = { 0x00 };
+	ctx = &myctx;
+
+	printf("Check: checkcache\n");
+
+	arena = arena_create(1024);
+	checkcache_init(CACHESIZE, 1);
+
+	memset(stored, 0, sizeof(stored));
+	stored[0].judgment = J_SUSPICIOUS;
+	stored[0].weight = 2;
+	stored[0].wait = true;
+	stored[0].checkname = "bl.example.com";
+	stored[0].reason = "listed";
+	stored[1].judgment = J_UNDEFINED;
+	stored[1].checkname = "dnsbl";
+
+	printf("  Storing and looking up an entry...");
+	fflush(stdout);
+	if (checkcache_lookup(arena, 0, "192.0.2.1", &results) != -1) {
+		printf("  FAILED.\n");
+		return 1;
+	}
+	checkcache_store(0, "192.0.2.1", stored, 2);
+	count = checkcache_lookup(arena, 0, "192.0.2.1", &results);
+	if (count != 2 || results[0].weight != 2 || !results[0].wait
+	    || strcmp(results[0].reason, "listed") || results[1].reason
+	    || results[0].reason == stored[0].reason) {
+		printf("  FAILED.\n");
+		return 2;
+	}
+	/* the check number is part of the key */
+	if (checkcache_lookup(arena, 1, "192.0.2.1", &results) != -1) {
+		printf("  FAILED.\n");
+		return 3;
+	}
+	printf("  Done.\n");
+
+	printf("  Storing %d entries into a cache of %d...", LOOPSIZE, CACHESIZE);
+	fflush(stdout);
+	for (i = 0; i < LOOPSIZE; i++) {
+		snprintf(key, sizeof(key), "10.0.%d.%d", i / 256, i % 256);
+		checkcache_store(0, key, stored, 1);
+	}
+	/* the last one stored must still be there */
+	if (checkcache_lookup(arena, 0, key, &results) != 1) {
+		printf("  FAILED.\n");
+		return 4;
+	}
+	found = 0;
+	for (i = 0; i < LOOPSIZE; i++) {
+		snprintf(key, sizeof(key), "10.0.%d.%d", i / 256, i % 256);
+		if (checkcache_lookup(arena, 0, key, &results) == 1)
+			found++;
+	}
+	if (found > CACHESIZE) {
+		printf("  FAILED.\n");
+		return 5;
+	}
+	printf("  Done.\n");
+
+	printf("  Joining a flight...");
+	fflush(stdout);
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += 5;
+	leader = edict_get(2);
+	follower = edict_get(2);
+	flight = flight_join(1, "192.0.2.2", 2, leader);
+	if (NULL == flight || flight_join(1, "192.0.2.2", 2, follower) != NULL
+	    || !flight_followed(flight)) {
+		printf("  FAILED.\n");
+		return 7;
+	}
+	memset(landing, 0, sizeof(landing));
+	landing[0].judgment = J_SUSPICIOUS;
+	landing[0].weight = 1;
+	landing[0].wait = true;
+	landing[0].checkname = "bl.example.com";
+	landing[0].reason = "listed";
+	landing[1].judgment = J_UNDEFINED;
+	landing[1].checkname = "dnsbl";
+	flight_result(flight, &landing[0]);
+	flight_result(flight, &landing[1]);
+	/* the follower got both results, and they were cached */
+	result = result_wait(follower, &deadline);
+	if (NULL == result || result->weight != 1 || strcmp(result->reason, "listed")) {
+		printf("  FAILED.\n");
+		return 8;
+	}
+	result = result_wait(follower, &deadline);
+	if (NULL == result || result->wait || flight_followed(flight)
+	    || checkcache_lookup(arena, 1, "192.0.2.2", &results) != 2) {
+		printf("  FAILED.\n");
+		return 9;
+	}
+	flight_release(flight);
+	edict_unlink(leader);
+	edict_unlink(follower);
+	printf("  Done.\n");
+
+	printf("  Waiting for the entries to expire...");
+	fflush(stdout);
+	checkcache_store(0, "192.0.2.1", stored, 2);
+	sleep(2);
+	if (checkcache_lookup(arena, 0, "192.0.2.1", &results) != -1) {
+		printf("  FAILED.\n");
+		return 6;
+	}
+	printf("  Done.\n");
+
+	arena_destroy(arena);
+
+	return 0;
+}
@@ -0,0 +1,431 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2008
+ *               Eino Tuominen <eino@utu.fi>
+ *               Antti Siira <antti@utu.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "common.h"
+#include "srvutils.h"
+#include "worker.h"
+#include "checkcache.h"
+#include "lookup3.h"
+
+#define FOLLOWERS 8		/* initial room for followers */
+
+static cache_shard_t shards[CACHE_SHARDS];
+static int shard_size;
+static int cache_ttl;
+
+/* internal functions */
+static void cache_evict(cache_shard_t *shard, cache_entry_t *entry);
+static void cache_insert(cache_shard_t *shard, cache_entry_t *entry, time_t now);
+static void flight_deliver(flight_t *flight, edict_t *edict, const cached_result_t *r);
+
+/*
+ * checkcache_init	- set up a cache of size entries, ttl 0
+ * disables the cache
+ */
+void
+checkcache_init(int size, int ttl)
+{
+	int i;
+
+	memset(shards, 0, sizeof(shards));
+	for (i = 0; i < CACHE_SHARDS; i++)
+		pthread_mutex_init(&shards[i].mx, NULL);
+	shard_size = MAX(1, size / CACHE_SHARDS);
+	cache_ttl = size > 0 ? ttl : 0;
+}
+
+/*
+ * cache_evict	- remove an entry, shard must be locked
+ */
+static void
+cache_evict(cache_shard_t *shard, cache_entry_t *entry)
+{
+	cache_entry_t **link;
+	int i;
+
+	link = &shard->bucket[(entry->hash / CACHE_SHARDS) % CACHE_BUCKETS];
+	while (*link != entry)
+		link = &(*link)->next;
+	*link = entry->next;
+
+	if (entry->older)
+		entry->older->newer = entry->newer;
+	else
+		shard->oldest = entry->newer;
+	if (entry->newer)
+		entry->newer->older = entry->older;
+	else
+		shard->newest = entry->older;
+	shard->count--;
+
+	for (i = 0; i < entry->count; i++)
+		if (entry->results[i].reason)
+			Free(entry->results[i].reason);
+	Free(entry->results);
+	Free(entry->key);
+	Free(entry);
+}
+
+/*
+ * checkcache_lookup	- find the cached results of a check. The results
+ * are copied into the arena. Returns the number of results or -1 if
+ * there is no valid entry.
+ */
+int
+checkcache_lookup(arena_t *arena, int check, const char *key, cached_result_t **results)
+{
+	cache_shard_t *shard;
+	cache_entry_t *entry;
+	uint32_t hash;
+	int i, count = -1;
+
+	if (0 == cache_ttl)
+		return -1;
+
+	hash = hashlittle(key, strlen(key), check);
+	shard = &shards[hash % CACHE_SHARDS];
+
+	pthread_mutex_lock(&shard->mx);
+	for (entry = shard->bucket[(hash / CACHE_SHARDS) % CACHE_BUCKETS]; entry; entry = entry->next)
+		if (entry->hash == hash && entry->check == check && strcmp(entry->key, key) == 0)
+			break;
+	if (entry && entry->expires <= time(NULL)) {
+		cache_evict(shard, entry);
+		shard->evictions++;
+		entry = NULL;
+	}
+	if (entry) {
+		count = entry->count;
+		*results = arena_alloc(arena, count * sizeof(cached_result_t));
+		memcpy(*results, entry->results, count * sizeof(cached_result_t));
+		for (i = 0; i < count; i++)
+			if (entry->results[i].reason)
+				(*results)[i].reason = arena_strdup(arena, entry->results[i].reason);
+		shard->hits++;
+	} else {
+		shard->misses++;
+	}
+	pthread_mutex_unlock(&shard->mx);
+
+	return count;
+}
+
+/*
+ * checkcache_store	- cache the results of a check, an older entry
+ * for the same key is replaced
+ */
+void
+checkcache_store(int check, const char *key, const cached_result_t *results, int count)
+{
+	cache_shard_t *shard;
+	cache_entry_t *entry;
+	time_t now;
+	int i;
+
+	if (0 == cache_ttl)
+		return;
+
+	now = time(NULL);
+
+	entry = Malloc(sizeof(*entry));
+	memset(entry, 0, sizeof(*entry));
+	entry->check = check;
+	entry->key = strdup(key);
+	entry->hash = hashlittle(key, strlen(key), check);
+	entry->expires = now + cache_ttl;
+	entry->count = count;
+	entry->results = Malloc(MAX(1, count) * sizeof(cached_result_t));
+	memcpy(entry->results, results, count * sizeof(cached_result_t));
+	for (i = 0; i < count; i++)
+		if (results[i].reason)
+			entry->results[i].reason = strdup(results[i].reason);
+
+	shard = &shards[entry->hash % CACHE_SHARDS];
+	pthread_mutex_lock(&shard->mx);
+	cache_insert(shard, entry, now);
+	pthread_mutex_unlock(&shard->mx);
+}
+
+/*
+ * cache_insert	- link a new entry, shard must be locked
+ */
+static void
+cache_insert(cache_shard_t *shard, cache_entry_t *entry, time_t now)
+{
+	cache_entry_t *old;
+	cache_entry_t **link;
+
+	link = &shard->bucket[(entry->hash / CACHE_SHARDS) % CACHE_BUCKETS];
+	for (old = *link; old; old = old->next)
+		if (old->hash == entry->hash && old->check == entry->check
+		    && strcmp(old->key, entry->key) == 0)
+			break;
+	if (old)
+		cache_evict(shard, old);
+
+	/* the oldest entries expire first */
+	while (shard->oldest && (shard->oldest->expires <= now || shard->count >= shard_size)) {
+		cache_evict(shard, shard->oldest);
+		shard->evictions++;
+	}
+
+	entry->next = *link;
+	*link = entry;
+	entry->older = shard->newest;
+	if (shard->newest)
+		shard->newest->newer = entry;
+	else
+		shard->oldest = entry;
+	shard->newest = entry;
+	shard->count++;
+}
+
+/*
+ * checkcache_stats	- describe the cache for the status report
+ */
+int
+checkcache_stats(char *buf, size_t len)
+{
+	uint64_t hits = 0, misses = 0, evictions = 0, joined = 0;
+	int i, count = 0;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		pthread_mutex_lock(&shards[i].mx);
+		count += shards[i].count;
+		hits += shards[i].hits;
+		misses += shards[i].misses;
+		evictions += shards[i].evictions;
+		joined += shards[i].joined;
+		pthread_mutex_unlock(&shards[i].mx);
+	}
+
+	snprintf(buf, len, " entries %d hits %llu misses %llu evictions %llu joined %llu",
+	    count, (unsigned long long)hits, (unsigned long long)misses,
+	    (unsigned long long)evictions, (unsigned long long)joined);
+
+	return strlen(buf);
+}
+
+/*
+ * flight_join	- join the flight of check and key, or start a new one.
+ * Returns the new flight led by edict, or NULL if edict joined a flight
+ * already in the air. The results so far are copied to a joining edict.
+ */
+flight_t *
+flight_join(int check, const char *key, int size, edict_t *edict)
+{
+	cache_shard_t *shard;
+	flight_t *flight;
+	flight_t **link;
+	uint32_t hash;
+	int i;
+
+	hash = hashlittle(key, strlen(key), check);
+	shard = &shards[hash % CACHE_SHARDS];
+	link = &shard->flights[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+
+	pthread_mutex_lock(&shard->mx);
+	for (flight = *link; flight; flight = flight->next)
+		if (flight->hash == hash && flight->check == check && strcmp(flight->key, key) == 0)
+			break;
+	if (flight) {
+		if (flight->nfollowers == flight->maxfollowers) {
+			flight->maxfollowers *= 2;
+			flight->followers = realloc(flight->followers,
+			    flight->maxfollowers * sizeof(edict_t *));
+			if (NULL == flight->followers)
+				daemon_fatal("realloc");
+		}
+		edict_reference(edict);
+		flight->followers[flight->nfollowers++] = edict;
+		for (i = 0; i < flight->count; i++)
+			flight_deliver(flight, edict, &flight->results[i]);
+		shard->joined++;
+		pthread_mutex_unlock(&shard->mx);
+		return NULL;
+	}
+
+	flight = Malloc(sizeof(*flight));
+	memset(flight, 0, sizeof(*flight));
+	flight->check = check;
+	flight->key = strdup(key);
+	flight->hash = hash;
+	flight->size = size;
+	flight->results = Malloc(size * sizeof(cached_result_t));
+	flight->maxfollowers = FOLLOWERS;
+	flight->followers = Malloc(FOLLOWERS * sizeof(edict_t *));
+	flight->next = *link;
+	*link = flight;
+	pthread_mutex_unlock(&shard->mx);
+
+	return flight;
+}
+
+/*
+ * flight_deliver	- copy a result to a follower, shard must be locked
+ */
+static void
+flight_deliver(flight_t *flight, edict_t *edict, const cached_result_t *r)
+{
+	chkresult_t *result;
+
+	result = result_reserve(edict, NULL);
+	result->check = flight->check;
+	result->judgment = r->judgment;
+	result->weight = r->weight;
+	result->definitive = r->definitive;
+	result->wait = r->wait;
+	result->checkname = r->checkname;
+	if (r->reason)
+		result->reason = strdup(r->reason);
+	result_publish(edict, result);
+}
+
+/*
+ * flight_result	- record a result of the job and copy it to the
+ * followers. The final result lands the flight: it is taken out of the
+ * table, the results are cached and the followers are let go.
+ */
+void
+flight_result(flight_t *flight, chkresult_t *result)
+{
+	cache_shard_t *shard;
+	cache_entry_t *entry;
+	cached_result_t *r;
+	flight_t **link;
+	edict_t **followers = NULL;
+	int i, nfollowers = 0;
+
+	shard = &shards[flight->hash % CACHE_SHARDS];
+
+	pthread_mutex_lock(&shard->mx);
+	if (flight->landed) {
+		pthread_mutex_unlock(&shard->mx);
+		return;
+	}
+	if (result->uncertain || result->failed)
+		flight->uncertain = true;
+
+	if (flight->count < flight->size) {
+		r = &flight->results[flight->count++];
+		r->judgment = result->judgment;
+		r->weight = result->weight;
+		r->definitive = result->definitive;
+		r->wait = result->failed ? false : result->wait;
+		r->checkname = result->checkname ? result->checkname : "aborted";
+		r->reason = result->reason ? strdup(result->reason) : NULL;
+		for (i = 0; i < flight->nfollowers; i++)
+			flight_deliver(flight, flight->followers[i], r);
+	} else {
+		/* the job returned more results than it said, end it here */
+		logstr(GLOG_ERROR, "too many results for check %d", flight->check);
+		flight->uncertain = true;
+		r = &flight->results[flight->count - 1];
+		r->wait = false;
+	}
+
+	if (!r->wait) {
+		link = &shard->flights[(flight->hash / CACHE_SHARDS) % CACHE_BUCKETS];
+		while (*link != flight)
+			link = &(*link)->next;
+		*link = flight->next;
+		flight->landed = true;
+
+		if (cache_ttl > 0 && !flight->uncertain) {
+			entry = Malloc(sizeof(*entry));
+			memset(entry, 0, sizeof(*entry));
+			entry->check = flight->check;
+			entry->key = strdup(flight->key);
+			entry->hash = flight->hash;
+			entry->expires = time(NULL) + cache_ttl;
+			entry->count = flight->count;
+			entry->results = Malloc(flight->count * sizeof(cached_result_t));
+			memcpy(entry->results, flight->results, flight->count * sizeof(cached_result_t));
+			for (i = 0; i < flight->count; i++)
+				if (flight->results[i].reason)
+					entry->results[i].reason = strdup(flight->results[i].reason);
+			cache_insert(shard, entry, time(NULL));
+		}
+
+		followers = flight->followers;
+		nfollowers = flight->nfollowers;
+		flight->followers = NULL;
+		flight->nfollowers = 0;
+	}
+	pthread_mutex_unlock(&shard->mx);
+
+	/* the last reference of a follower may release its own flights */
+	for (i = 0; i < nfollowers; i++)
+		edict_unlink(followers[i]);
+	if (followers)
+		Free(followers);
+}
+
+/*
+ * flight_abort	- the job will never return, land the flight with
+ * an undefined result
+ */
+void
+flight_abort(flight_t *flight)
+{
+	chkresult_t result;
+
+	memset(&result, 0, sizeof(result));
+	result.judgment = J_UNDEFINED;
+	result.uncertain = true;
+	result.check = flight->check;
+	flight_result(flight, &result);
+}
+
+/*
+ * flight_followed	- true if other edicts wait for the flight
+ */
+bool
+flight_followed(flight_t *flight)
+{
+	cache_shard_t *shard;
+	bool followed;
+
+	shard = &shards[flight->hash % CACHE_SHARDS];
+	pthread_mutex_lock(&shard->mx);
+	followed = !flight->landed && flight->nfollowers > 0;
+	pthread_mutex_unlock(&shard->mx);
+
+	return followed;
+}
+
+/*
+ * flight_release	- the leader is gone, land the flight if the job
+ * did not and free it
+ */
+void
+flight_release(flight_t *flight)
+{
+	int i;
+
+	flight_abort(flight);
+
+	for (i = 0; i < flight->count; i++)
+		if (flight->results[i].reason)
+			Free(flight->results[i].reason);
+	Free(flight->results);
+	Free(flight->key);
+	Free(flight);
+}
@@ -27,8 +27,9 @@ client_postfix(int argc, char **argv)
 	int fd;
 	struct sockaddr_in gserv;
 	char mbuf[MAXLINELEN * 4];
-	char line[MAXLINELEN];
-	size_t linelen;
+	char *line;
+	rbuf_t rb;
+	int ret;
 	int opt = 1;
 	int counter = 0;
 	int match = 0;
@@ -74,6 +75,8 @@ client_postfix(int argc, char **argv)
 	if (argc > 6)
 		runs = atoi(argv[6]);
 
+	rbuf_init(&rb, fd);
+
 	while (counter < runs) {
 		counter++;
 		snprintf(mbuf, MAXLINELEN * 4,
@@ -88,10 +91,13 @@ client_postfix(int argc, char **argv)
 		writen(fd, mbuf, strlen(mbuf));
 
 		do {
-			linelen = readline(fd, line, MAXLINELEN);
-			if (linelen < 0) {
+			ret = rbuf_readline(&rb, &line);
+			if (ret == ERROR) {
 				gerror("readline");
 				return 2;
+			} else if (ret == EMPTY) {
+				fprintf(stderr, "connection closed by server\n");
+				return 2;
 			}
 
 			if (strlen(line) > 0)
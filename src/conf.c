@@ -143,6 +143,7 @@ record_config_item(configlist_t **config, const char *name, const char *value, p
 		while (cp) {
 			if (strcmp(cp->name, name) == 0) {
 				cp->value = value;
+				cp->params = params;
 				break;
 			}
 			cp = cp->next;
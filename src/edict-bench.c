@@ -0,0 +1,118 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2008
+ *                    Eino Tuominen <eino@utu.fi>
+ *                    Antti Siira <antti@utu.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * edict-bench	- microbenchmark of the test_tuple() fan-out/fan-in
+ * path: an edict is created, referenced once per check, every check
+ * publishes its result and drops its reference, and the waiter
+ * collects the results. Another part hammers the reference count of
+ * a single edict from many threads.
+ */
+
+#include "common.h"
+#include "srvutils.h"
+#include "worker.h"
+#include "utils.h"
+
+#define CHECKS 8
+#define ROUNDS 200000
+#define THREADS 8
+#define LOOPSIZE 1000000
+
+/* internal functions */
+static void *hammer(void *arg);
+
+static void *
+hammer(void *arg)
+{
+	edict_t *edict;
+	int i;
+
+	edict = (edict_t *)arg;
+	for (i = 0; i < LOOPSIZE; i++) {
+		edict_reference(edict);
+		edict_unlink(edict);
+	}
+	pthread_exit(NULL);
+}
+
+static double
+ns_per_op(struct timespec *start, struct timespec *end, long ops)
+{
+	return ((end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec)) / ops;
+}
+
+int
+main(int argc, char **argv)
+{
+	thread_info_t threads[THREADS];
+	struct timespec start, end, deadline;
+	edict_t *edict;
+	chkresult_t *result;
+	int i, j;
+	gross_ctx_t myctx = { 0x00 }; /* dummy context */
+	ctx = &myctx;
+
+	printf("Benchmark: edict\n");
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += 60;
+
+	printf("  Contended references, %d threads x %d...", THREADS, LOOPSIZE);
+	fflush(stdout);
+	edict = edict_get(0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < THREADS; i++)
+		create_thread(&threads[i], 0, &hammer, edict);
+	for (i = 0; i < THREADS; i++)
+		pthread_join(*threads[i].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("  %.1f ns per reference/unlink pair.\n",
+	    ns_per_op(&start, &end, (long)THREADS * LOOPSIZE));
+	edict_unlink(edict);
+
+	/*
+	 * grossd is always multithreaded, and the C library takes shortcuts
+	 * with its locks as long as a process has only one thread: keep the
+	 * fan-out part after the threads have been started.
+	 */
+	printf("  Fan-out/fan-in of %d checks, %d rounds...", CHECKS, ROUNDS);
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < ROUNDS; i++) {
+		edict = edict_get(CHECKS);
+		for (j = 0; j < CHECKS; j++)
+			edict_reference(edict);
+		for (j = 0; j < CHECKS; j++) {
+			result = result_reserve(edict, NULL);
+			result->judgment = J_UNDEFINED;
+			result_publish(edict, result);
+			edict_unlink(edict);
+		}
+		for (j = 0; j < CHECKS; j++)
+			if (NULL == result_wait(edict, &deadline))
+				return 1;
+		edict_unlink(edict);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("  %.1f ns per round.\n", ns_per_op(&start, &end, ROUNDS));
+
+	return 0;
+}
@@ -0,0 +1,314 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2008
+ *               Eino Tuominen <eino@utu.fi>
+ *               Antti Siira <antti@utu.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * gqlog	- print or replay the binary query log of grossd
+ */
+
+#include <pthread.h>
+
+#include "common.h"
+#include "utils.h"
+#include "worker.h"
+#include "qlog.h"
+
+typedef struct replay_s
+{
+	qlog_record_t *records;
+	uint64_t count;
+	int connections;
+	int index;		/* of this connection */
+	double speed;		/* 0 is as fast as possible */
+	struct sockaddr_in server;
+	struct timespec start;
+	/* results */
+	uint64_t sent;
+	uint64_t failed;
+	uint64_t latency;	/* ms, sum */
+	int maxlatency;
+} replay_t;
+
+static void usage(void);
+static void print_record(const qlog_record_t *record, bool csv);
+static void *replay_connection(void *arg);
+static int replay(qlog_record_t *records, uint64_t count, const char *target, double speed,
+    int connections);
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: gqlog [-c] file\n");
+	fprintf(stderr, "       gqlog -r host:port [-s speed] [-n connections] file\n");
+	exit(1);
+}
+
+/*
+ * print_record	- one record, in the format of the text query log or as
+ * comma separated values
+ */
+static void
+print_record(const qlog_record_t *record, bool csv)
+{
+	char timestr[32];
+	struct tm tm;
+	time_t secs;
+	int i;
+
+	secs = record->time / 1000000;
+	localtime_r(&secs, &tm);
+	strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", &tm);
+
+	if (csv) {
+		printf("%s.%06u,%s,%u,%d,%s,%s,%s,%s,%s,", timestr,
+		    (unsigned int)(record->time % 1000000), qlog_action(record->action),
+		    record->delay, record->totalweight, record->proto, record->client_ip,
+		    record->sender, record->recipient, record->helo);
+		for (i = 0; i < record->nmatch; i++)
+			printf("%s%s:%d:%d", i ? ";" : "", record->match[i].name,
+			    record->match[i].weight, record->match[i].delay);
+		printf("\n");
+		return;
+	}
+
+	printf("%s.%03u a=%s d=%u w=%d c=%s s=%s r=%s", timestr,
+	    (unsigned int)(record->time % 1000000 / 1000), qlog_action(record->action),
+	    record->delay, record->totalweight, record->client_ip[0] ? record->client_ip : "N/A",
+	    record->sender[0] ? record->sender : "N/A",
+	    record->recipient[0] ? record->recipient : "N/A");
+	if (record->helo[0])
+		printf(" h=%s", record->helo);
+	for (i = 0; i < record->nmatch; i++) {
+		if (record->match[i].weight)
+			printf(" m=%s%+d", record->match[i].name, record->match[i].weight);
+		else
+			printf(" m=%s", record->match[i].name);
+	}
+	printf("\n");
+}
+
+/*
+ * replay_connection	- send every connections'th record over a single
+ * connection, keeping the original pace divided by speed
+ */
+static void *
+replay_connection(void *arg)
+{
+	replay_t *rp = (replay_t *)arg;
+	const qlog_record_t *record;
+	struct timespec due, now, sent;
+	char request[MAXLINELEN * 4];
+	char *line;
+	rbuf_t rb;
+	uint64_t i, offset;
+	int fd, ret, latency;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&rp->server, sizeof(rp->server)) < 0) {
+		perror("connect");
+		if (fd >= 0)
+			close(fd);
+		rp->failed = (rp->count - rp->index + rp->connections - 1) / rp->connections;
+		return NULL;
+	}
+	rbuf_init(&rb, fd);
+
+	for (i = rp->index; i < rp->count; i += rp->connections) {
+		record = &rp->records[i];
+
+		if (rp->speed > 0) {
+			offset = (uint64_t)((record->time - rp->records[0].time) / rp->speed);
+			mstotimespec(offset / 1000, &due);
+			ts_sum(&due, &due, &rp->start);
+			clock_gettime(CLOCK_TYPE, &now);
+			if (ts_diff(&sent, &due, &now) == 0)
+				nanosleep(&sent, NULL);
+		}
+
+		snprintf(request, sizeof(request),
+		    "request=smtpd_access_policy\nprotocol_state=RCPT\n"
+		    "client_address=%s\nsender=%s\nrecipient=%s\nhelo_name=%s\n\n",
+		    record->client_ip, record->sender, record->recipient, record->helo);
+
+		clock_gettime(CLOCK_TYPE, &sent);
+		if (writen(fd, request, strlen(request)) < 0) {
+			rp->failed++;
+			break;
+		}
+		rp->sent++;
+
+		/* the response ends with an empty line */
+		do {
+			ret = rbuf_readline(&rb, &line);
+		} while (ret > 0 && line[0]);
+		if (ret <= 0) {
+			rp->failed++;
+			break;
+		}
+
+		clock_gettime(CLOCK_TYPE, &now);
+		latency = ms_diff(&now, &sent);
+		rp->latency += latency;
+		if (latency > rp->maxlatency)
+			rp->maxlatency = latency;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+/*
+ * replay	- send the records to a postfix policy server
+ */
+static int
+replay(qlog_record_t *records, uint64_t count, const char *target, double speed, int connections)
+{
+	replay_t *replays;
+	pthread_t *threads;
+	struct sockaddr_in server;
+	struct timespec start, end;
+	uint64_t sent = 0, failed = 0, latency = 0;
+	int maxlatency = 0;
+	char host[INET_ADDRSTRLEN];
+	const char *port;
+	int i;
+
+	port = strchr(target, ':');
+	if (NULL == port || port - target >= sizeof(host))
+		usage();
+	memset(host, 0, sizeof(host));
+	strncpy(host, target, port - target);
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(atoi(port + 1));
+	if (inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+		fprintf(stderr, "invalid address: %s\n", host);
+		return 1;
+	}
+
+	replays = calloc(connections, sizeof(replay_t));
+	threads = calloc(connections, sizeof(pthread_t));
+	if (NULL == replays || NULL == threads) {
+		perror("calloc");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_TYPE, &start);
+	for (i = 0; i < connections; i++) {
+		replays[i].records = records;
+		replays[i].count = count;
+		replays[i].connections = connections;
+		replays[i].index = i;
+		replays[i].speed = speed;
+		replays[i].server = server;
+		replays[i].start = start;
+		if (pthread_create(&threads[i], NULL, &replay_connection, &replays[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (i = 0; i < connections; i++) {
+		pthread_join(threads[i], NULL);
+		sent += replays[i].sent;
+		failed += replays[i].failed;
+		latency += replays[i].latency;
+		if (replays[i].maxlatency > maxlatency)
+			maxlatency = replays[i].maxlatency;
+	}
+	clock_gettime(CLOCK_TYPE, &end);
+
+	printf("records %llu sent %llu failed %llu in %d ms, latency avg %.1f max %d ms\n",
+	    (unsigned long long)count, (unsigned long long)sent, (unsigned long long)failed,
+	    ms_diff(&end, &start), sent ? (double)latency / sent : 0.0, maxlatency);
+
+	free(threads);
+	free(replays);
+	return failed ? 2 : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	qlog_t *qlog;
+	qlog_record_t *records;
+	uint64_t seq, head, count = 0;
+	const char *target = NULL;
+	double speed = 1.0;
+	int connections = 1;
+	bool csv = false;
+	int c, ret = 0;
+
+	while ((c = getopt(argc, argv, "cr:s:n:")) != -1) {
+		switch (c) {
+		case 'c':
+			csv = true;
+			break;
+		case 'r':
+			target = optarg;
+			break;
+		case 's':
+			speed = atof(optarg);
+			if (speed < 0)
+				usage();
+			break;
+		case 'n':
+			connections = atoi(optarg);
+			if (connections < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+
+	qlog = qlog_map(argv[optind]);
+	if (NULL == qlog) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+
+	/* take a snapshot, skipping the records being written */
+	head = qlog_head(qlog);
+	seq = qlog_oldest(qlog);
+	records = malloc((head - seq + 1) * sizeof(qlog_record_t));
+	if (NULL == records) {
+		perror("malloc");
+		return 1;
+	}
+	for (; seq < head; seq++)
+		if (qlog_read(qlog, seq, &records[count]) == 0)
+			count++;
+	qlog_close(qlog);
+
+	if (target) {
+		if (count > 0)
+			ret = replay(records, count, target, speed, connections);
+	} else {
+		if (csv)
+			printf("time,action,delay,weight,proto,client_ip,sender,recipient,helo,matches\n");
+		for (seq = 0; seq < count; seq++)
+			print_record(&records[seq], csv);
+	}
+
+	free(records);
+	return ret;
+}
@@ -30,6 +30,8 @@
 #include "conf.h"
 #include "srvutils.h"
 #include "msgqueue.h"
+#include "checkcache.h"
+#include "qlog.h"
 
 #ifdef DNSBL
 #include "check_dnsbl.h"
@@ -46,13 +48,14 @@
 /* maximum simultaneus tcp worker threads */
 #define MAXWORKERS 1
 
-#define MAXCONNQ 5
-
 #define SECONDS_IN_HOUR ((time_t)60*60)
 #define MAX_PEER_NAME_LEN 1024
 
 #define CONF(item)	gconf(config, item)
 
+/* how long OVERFLOW_BLOCK waits if no timeout is configured */
+#define DEFAULT_BLOCK_TIMEOUT (mseconds_t)100
+
 /* function prototypes */
 void bloommgr_init();
 void syncmgr_init();
@@ -107,6 +110,60 @@ initialize_context()
 	return ctx;
 }
 
+/*
+ * overflow_policy	- parse a queue overflow policy option of form
+ *			  reject | drop_oldest | block [; timeout_ms]
+ */
+void
+overflow_policy(configlist_t *config, const char *name, int *policy, mseconds_t *timeout)
+{
+	configlist_t *cp;
+
+	cp = config;
+	while (cp && strcmp(cp->name, name) != 0)
+		cp = cp->next;
+	assert(cp);
+
+	*timeout = DEFAULT_BLOCK_TIMEOUT;
+	if (strcmp(cp->value, "reject") == 0)
+		*policy = OVERFLOW_REJECT;
+	else if (strcmp(cp->value, "drop_oldest") == 0)
+		*policy = OVERFLOW_DROP_OLDEST;
+	else if (strcmp(cp->value, "block") == 0)
+		*policy = OVERFLOW_BLOCK;
+	else
+		daemon_shutdown(EXIT_CONFIG, "Invalid %s: %s", name, cp->value);
+
+	if (cp->params) {
+		if (*policy != OVERFLOW_BLOCK)
+			daemon_shutdown(EXIT_CONFIG, "%s: only 'block' takes a timeout", name);
+		errno = 0;
+		*timeout = strtol(cp->params->value, (char **)NULL, 10);
+		if (errno || *timeout < 0)
+			daemon_shutdown(EXIT_CONFIG, "Invalid timeout for %s: %s", name, cp->params->value);
+	}
+}
+
+/*
+ * listen_path	- parse a listen option of form unix:/path. NULL if the
+ *		  option is not set and the server listens on host and port.
+ */
+char *
+listen_path(configlist_t *config, const char *name)
+{
+	struct sockaddr_un unaddr;
+	const char *value;
+
+	value = gconf(config, name);
+	if (NULL == value)
+		return NULL;
+	if (strncmp(value, "unix:", 5) != 0 || value[5] != '/')
+		daemon_shutdown(EXIT_CONFIG, "Invalid %s: %s (only unix:/path is supported)", name, value);
+	if (strlen(value + 5) >= sizeof(unaddr.sun_path))
+		daemon_shutdown(EXIT_CONFIG, "%s: path too long: %s", name, value + 5);
+	return strdup(value + 5);
+}
+
 void
 configure_grossd(configlist_t *config)
 {
@@ -116,6 +173,9 @@ configure_grossd(configlist_t *config)
 	struct hostent *host = NULL;
 	char buffer[MAXLINELEN] = { '\0' };
 	params_t *pp;
+	long ncpu;
+	pool_size_t *ps;
+	check_stage_t *cs;
 
 	cp = config;
 	if (ctx->config.flags & (FLG_NODAEMON))
@@ -174,9 +234,38 @@ configure_grossd(configlist_t *config)
 
 	ctx->config.sync_host.sin_port = htons(atoi(CONF("sync_port")));
 	ctx->config.gross_host.sin_port = htons(atoi(CONF("port")));
-	ctx->config.max_connq = 50;
+	ctx->config.max_connq = atoi(CONF("listen_backlog"));
+	if (ctx->config.max_connq < 1)
+		daemon_shutdown(EXIT_CONFIG, "Invalid listen_backlog: %s", CONF("listen_backlog"));
 	ctx->config.peer.connected = 0;
 
+	ctx->config.listen_threads = atoi(CONF("listen_threads"));
+	if (ctx->config.listen_threads < 1)
+		daemon_shutdown(EXIT_CONFIG, "Invalid listen_threads: %s", CONF("listen_threads"));
+	if (CONF("listen_cpus")) {
+		char *cpus, *cpu, *last;
+
+		cpus = strdup(CONF("listen_cpus"));
+		ctx->config.listen_cpus = Malloc((strlen(cpus) / 2 + 1) * sizeof(int));
+		for (cpu = strtok_r(cpus, ", ", &last); cpu; cpu = strtok_r(NULL, ", ", &last)) {
+			if (atoi(cpu) < 0 || strspn(cpu, "0123456789") != strlen(cpu))
+				daemon_shutdown(EXIT_CONFIG, "Invalid listen_cpus: %s", CONF("listen_cpus"));
+			ctx->config.listen_cpus[ctx->config.listen_ncpus++] = atoi(cpu);
+		}
+		Free(cpus);
+#ifndef HAVE_PTHREAD_SETAFFINITY_NP
+		logstr(GLOG_NOTICE, "no pthread_setaffinity_np, listen_cpus ignored");
+		ctx->config.listen_ncpus = 0;
+#endif /* HAVE_PTHREAD_SETAFFINITY_NP */
+	}
+
+	ctx->config.postfix.listen = listen_path(config, "postfix_listen");
+	ctx->config.sjsms.listen = listen_path(config, "sjsms_listen");
+	errno = 0;
+	ctx->config.listen_mode = strtol(CONF("listen_mode"), (char **)NULL, 8);
+	if (errno || ctx->config.listen_mode & ~0777)
+		daemon_shutdown(EXIT_CONFIG, "Invalid listen_mode: %s", CONF("listen_mode"));
+
 	ctx->config.greylist_delay = atoi(CONF("grey_delay"));
 
 	if (10 != ctx->config.greylist_delay)
@@ -225,12 +314,26 @@ configure_grossd(configlist_t *config)
 		daemon_shutdown(EXIT_CONFIG, "Invalid grey_tuple: %s", greytuplestr);
 	}
 
+	if (strcmp(CONF("tuple_format"), "compat") == 0) {
+		ctx->config.tuple_format = TUPLE_FORMAT_COMPAT;
+	} else if (strcmp(CONF("tuple_format"), "binary") == 0) {
+		logstr(GLOG_DEBUG, "tuple_format: BINARY");
+		ctx->config.tuple_format = TUPLE_FORMAT_BINARY;
+	} else {
+		daemon_shutdown(EXIT_CONFIG, "Invalid tuple_format: %s", CONF("tuple_format"));
+	}
+
 	/* we must reset errno because strtol returns 0 if it fails */
 	errno = 0;
 	ctx->config.grey_mask = strtol(CONF("grey_mask"), (char **)NULL, 10);
 	if (errno || ctx->config.grey_mask > 32 || ctx->config.grey_mask < 0)
 		daemon_shutdown(EXIT_CONFIG, "Invalid grey_mask: %s", CONF("grey_mask"));
 
+	errno = 0;
+	ctx->config.grey_mask6 = strtol(CONF("grey_mask6"), (char **)NULL, 10);
+	if (errno || ctx->config.grey_mask6 > 128 || ctx->config.grey_mask6 < 0)
+		daemon_shutdown(EXIT_CONFIG, "Invalid grey_mask6: %s", CONF("grey_mask6"));
+
 	ctx->config.status_host.sin_family = AF_INET;
 	host = gethostbyname(CONF("status_host") ? CONF("status_host") : CONF("host"));
 	if (NULL == host)
@@ -259,17 +362,17 @@ configure_grossd(configlist_t *config)
 	if (!CONF("postfix_response_grey"))
 		daemon_shutdown(EXIT_CONFIG, "No postfix_response_grey set!");
 	else
-		ctx->config.postfix.responsegrey = strdup(CONF("postfix_response_grey"));
+		compile_template(&ctx->config.postfix.responsegrey, CONF("postfix_response_grey"));
 	if (!CONF("postfix_response_block"))
 		daemon_shutdown(EXIT_CONFIG, "No postfix_response_block set!");
 	else
-		ctx->config.postfix.responseblock = strdup(CONF("postfix_response_block"));
+		compile_template(&ctx->config.postfix.responseblock, CONF("postfix_response_block"));
 
 
 	if (!CONF("sjsms_response_grey"))
 		daemon_shutdown(EXIT_CONFIG, "No sjsms_response_grey set!");
 	else
-		ctx->config.sjsms.responsegrey = strdup(CONF("sjsms_response_grey"));
+		compile_template(&ctx->config.sjsms.responsegrey, CONF("sjsms_response_grey"));
 	if (!CONF("sjsms_response_trust"))
 		daemon_shutdown(EXIT_CONFIG, "No sjsms_response_trust set!");
 	else
@@ -277,7 +380,7 @@ configure_grossd(configlist_t *config)
 	if (!CONF("sjsms_response_block"))
 		daemon_shutdown(EXIT_CONFIG, "No sjsms_response_block set!");
 	else
-		ctx->config.sjsms.responseblock = strdup(CONF("sjsms_response_block"));
+		compile_template(&ctx->config.sjsms.responseblock, CONF("sjsms_response_block"));
 	if (!CONF("sjsms_response_match"))
 		daemon_shutdown(EXIT_CONFIG, "No sjsms_response_match set!");
 	else
@@ -328,6 +431,8 @@ configure_grossd(configlist_t *config)
 			ctx->config.statlevel |= STATS_STATUS_BEGIN;
 		if (strncmp(cp->value, "delay", 6) == 0)
 			ctx->config.statlevel |= STATS_DELAY;
+		if (strncmp(cp->value, "latency", 8) == 0)
+			ctx->config.statlevel |= STATS_LATENCY;
 		cp = cp->next;
 	}
 
@@ -373,6 +478,107 @@ configure_grossd(configlist_t *config)
 #endif /* DNSBL */
 	ctx->config.pool_maxthreads = atoi(CONF("pool_maxthreads"));
 
+	ctx->config.postfix_io_threads = atoi(CONF("postfix_io_threads"));
+	if (ctx->config.postfix_io_threads < 0)
+		daemon_shutdown(EXIT_CONFIG, "Invalid postfix_io_threads: %s", CONF("postfix_io_threads"));
+#ifndef HAVE_SYS_EPOLL_H
+	if (ctx->config.postfix_io_threads > 0) {
+		logstr(GLOG_NOTICE, "no epoll, postfix_io_threads ignored");
+		ctx->config.postfix_io_threads = 0;
+	}
+#endif /* HAVE_SYS_EPOLL_H */
+
+	ctx->config.pool_minthreads = atoi(CONF("pool_minthreads"));
+	if (ctx->config.pool_minthreads < 0)
+		daemon_shutdown(EXIT_CONFIG, "Invalid pool_minthreads: %s", CONF("pool_minthreads"));
+	ctx->config.pool_idle_time = atoi(CONF("pool_idle_time"));
+	if (ctx->config.pool_idle_time < 0)
+		daemon_shutdown(EXIT_CONFIG, "Invalid pool_idle_time: %s", CONF("pool_idle_time"));
+	ctx->config.pool_spawn_rate = atoi(CONF("pool_spawn_rate"));
+	if (ctx->config.pool_spawn_rate < 0)
+		daemon_shutdown(EXIT_CONFIG, "Invalid pool_spawn_rate: %s", CONF("pool_spawn_rate"));
+
+	/* per pool thread limits */
+	ctx->config.pool_sizes = NULL;
+	cp = config;
+	while (cp) {
+		if (strcmp(cp->name, "pool_threads") == 0) {
+			ps = Malloc(sizeof(pool_size_t));
+			ps->name = strdup(cp->value);
+			ps->min_thread = atoi(cp->params->value);
+			ps->max_thread = atoi(cp->params->next->value);
+			if (ps->min_thread < 0 || ps->max_thread < 0
+			    || (ps->max_thread && ps->min_thread > ps->max_thread))
+				daemon_shutdown(EXIT_CONFIG, "Invalid pool_threads for %s: %s ; %s",
+				    cp->value, cp->params->value, cp->params->next->value);
+			ps->next = ctx->config.pool_sizes;
+			ctx->config.pool_sizes = ps;
+		}
+		cp = cp->next;
+	}
+
+	ctx->config.check_stages = NULL;
+	cp = config;
+	while (cp) {
+		if (strcmp(cp->name, "check_stage") == 0) {
+			cs = Malloc(sizeof(check_stage_t));
+			cs->name = strdup(cp->value);
+			errno = 0;
+			cs->stage = strtol(cp->params->value, (char **)NULL, 10);
+			if (errno || cs->stage < 0 || cs->stage >= MAXCHECKS)
+				daemon_shutdown(EXIT_CONFIG, "Invalid check_stage for %s: %s",
+				    cp->value, cp->params->value);
+			cs->next = ctx->config.check_stages;
+			ctx->config.check_stages = cs;
+		}
+		cp = cp->next;
+	}
+
+	/* the shared executor, 0 is automatic */
+	ctx->config.executor_threads = atoi(CONF("executor_threads"));
+	if (ctx->config.executor_threads < 0)
+		daemon_shutdown(EXIT_CONFIG, "Invalid executor_threads: %s", CONF("executor_threads"));
+	if (ctx->config.executor_threads == 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		ctx->config.executor_threads = EXECUTOR_THREADS_PER_CPU * (ncpu > 0 ? ncpu : 1);
+	}
+
+	/* queue limits, 0 is unbounded */
+	ctx->config.pool_queue_len = atoi(CONF("pool_queue_len"));
+	if (ctx->config.pool_queue_len < 0)
+		daemon_shutdown(EXIT_CONFIG, "Invalid pool_queue_len: %s", CONF("pool_queue_len"));
+	overflow_policy(config, "pool_queue_policy", &ctx->config.pool_queue_policy,
+	    &ctx->config.pool_queue_timeout);
+	ctx->config.update_queue_len = atoi(CONF("update_queue_len"));
+	if (ctx->config.update_queue_len < 0)
+		daemon_shutdown(EXIT_CONFIG, "Invalid update_queue_len: %s", CONF("update_queue_len"));
+	overflow_policy(config, "update_queue_policy", &ctx->config.update_queue_policy,
+	    &ctx->config.update_queue_timeout);
+
+	ctx->config.check_cache_size = atoi(CONF("check_cache_size"));
+	if (ctx->config.check_cache_size < 0)
+		daemon_shutdown(EXIT_CONFIG, "Invalid check_cache_size: %s", CONF("check_cache_size"));
+	ctx->config.check_cache_ttl = atoi(CONF("check_cache_ttl"));
+	if (ctx->config.check_cache_ttl < 0)
+		daemon_shutdown(EXIT_CONFIG, "Invalid check_cache_ttl: %s", CONF("check_cache_ttl"));
+
+	ctx->config.querylog_sample = atoi(CONF("querylog_sample"));
+	if (ctx->config.querylog_sample < 1)
+		daemon_shutdown(EXIT_CONFIG, "Invalid querylog_sample: %s", CONF("querylog_sample"));
+	ctx->config.querylog_rate = atoi(CONF("querylog_rate"));
+	if (ctx->config.querylog_rate < 0)
+		daemon_shutdown(EXIT_CONFIG, "Invalid querylog_rate: %s", CONF("querylog_rate"));
+	ctx->config.querylog_trace = atoi(CONF("querylog_trace"));
+	if (ctx->config.querylog_trace < 0)
+		daemon_shutdown(EXIT_CONFIG, "Invalid querylog_trace: %s", CONF("querylog_trace"));
+	if (CONF("querylog_file"))
+		ctx->config.querylog_file = strdup(CONF("querylog_file"));
+	else
+		ctx->config.querylog_file = NULL;
+	ctx->config.querylog_records = atoi(CONF("querylog_records"));
+	if (ctx->config.querylog_records < QLOG_MINRECORDS)
+		daemon_shutdown(EXIT_CONFIG, "querylog_records must be at least %d", QLOG_MINRECORDS);
+
 	ctx->config.query_timelimit = atoi(CONF("query_timelimit"));
 #ifdef __APPLE__
 	if (ctx->config.query_timelimit < 1000)
@@ -556,15 +762,37 @@ noop(int signo)
 	return;
 }
 
+/* the signal asking us to stop, see mrproper() */
+static volatile sig_atomic_t terminating = 0;
+
 /*
- * mrproper - clean up upon exit
+ * mrproper - signal handler to initiate a clean exit. The log rings
+ * can not be flushed in a signal handler, the main loop does the rest
+ * in terminate().
  */
 void
 mrproper(int signo)
 {
+	terminating = signo;
+}
+
+/*
+ * terminate	- clean up upon exit, and die of the signal
+ */
+static void
+terminate(int signo)
+{
+	logstr(GLOG_NOTICE, "Grossd shutdown on signal %d", signo);
+
 	if ((ctx->config.flags & FLG_CREATE_PIDFILE) && ctx->config.pidfile)
 		unlink(ctx->config.pidfile);
+	if (ctx->config.postfix.listen)
+		unlink(ctx->config.postfix.listen);
+	if (ctx->config.sjsms.listen)
+		unlink(ctx->config.sjsms.listen);
 
+	log_flush();
+	signal(signo, SIG_DFL);
 	raise(signo);
 }
 
@@ -749,6 +977,9 @@ main(int argc, char *argv[])
 	if (ret)
 		daemon_fatal("pthread_sigmask");
 
+	/* from now on the threads log through the log writer */
+	log_writer_init();
+
 	/* initialize the update queue */
 	delay = Malloc(sizeof(struct timespec));
 	delay->tv_sec = ctx->config.greylist_delay;
@@ -756,6 +987,12 @@ main(int argc, char *argv[])
 	ctx->update_q = get_delay_queue(delay);
 	if (ctx->update_q < 0)
 		daemon_fatal("get_delay_queue");
+	if (ctx->config.update_queue_len > 0) {
+		ret = set_queue_limit(ctx->update_q, ctx->config.update_queue_len,
+		    ctx->config.update_queue_policy, ctx->config.update_queue_timeout, NULL);
+		if (ret < 0)
+			daemon_fatal("set_queue_limit");
+	}
 
 	/* start the bloom manager thread */
 	bloommgr_init();
@@ -772,10 +1009,29 @@ main(int argc, char *argv[])
 	 * for client requests
 	 */
 
-	/* default limits, these should be configurable */
+	/* default limits, pool_threads may override these per pool */
 	limits.max_thread = ctx->config.pool_maxthreads;
+	limits.min_thread = ctx->config.pool_minthreads;
+	limits.idle_time = ctx->config.pool_idle_time;
+	limits.spawn_rate = ctx->config.pool_spawn_rate;
 	limits.watchdog = true;
 	limits.watchdog_time = ctx->config.query_timelimit * 2;
+	limits.queue_len = ctx->config.pool_queue_len;
+	limits.queue_policy = ctx->config.pool_queue_policy;
+	limits.queue_timeout = ctx->config.pool_queue_timeout;
+
+	/* the checks share the executor */
+	executor_init(ctx->config.executor_threads, limits.watchdog_time);
+	limits.shared = true;
+
+	checkcache_init(ctx->config.check_cache_size, ctx->config.check_cache_ttl);
+
+	if (ctx->config.querylog_file) {
+		ctx->qlog = qlog_open(ctx->config.querylog_file, ctx->config.querylog_records);
+		if (NULL == ctx->qlog)
+			daemon_shutdown(EXIT_FATAL, "can't open querylog_file %s: %s",
+			    ctx->config.querylog_file, strerror(errno));
+	}
 
 	/* start the check pools */
 #ifdef DNSBL
@@ -834,6 +1090,10 @@ main(int argc, char *argv[])
 
 	toleration = time(NULL);
 	for (;;) {
+		/* sleep() returns early on the signal */
+		if (terminating)
+			terminate(terminating);
+
 		if ((time(NULL) - *ctx->last_rotate) > ctx->config.rotate_interval) {
 			/* time to rotate filters */
 			rotatecmd.mtype = ROTATE;
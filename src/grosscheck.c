@@ -18,10 +18,16 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <ctype.h>
 #include <string.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include "common.h"
 #include "proto_sjsms.h"
+#include "lookup3.h"
 
 #define MTASTRLEN 252
 #define SBUFLEN 256
@@ -40,15 +46,502 @@
 
 #define MAP_SEPARATOR ','
 
+/* trust and match verdicts are reused for this many seconds by default */
+#define GC_CACHE_TTL 30
+#define GC_CACHE_SIZE 256	/* power of two */
+/* how often the counters are sent to the server, in seconds */
+#define GC_REPORT_INTERVAL 3600
+
+/* milliseconds to wait for an answer, 1 second of server timeout + some extra */
+#define GC_TIMEOUT 2000
+/* after the server has told us to wait */
+#define GC_PENDING_TIMEOUT 10000
+/* the bounds of the adaptive hedge delay, and the delay before any answers */
+#define GC_HEDGE_MIN 5
+#define GC_HEDGE_DEFAULT 100
+#define GC_HEDGE_AUTO -1
+/* servers tracked per process */
+#define GC_SERVERS 8
+
 /* #define ARGDEBUG */
 
+/*
+ * The socket and the parsed server part of the mapping call are kept
+ * per MTA thread, so that the answer a thread waits for is not read
+ * by another. The answers carry nothing to match them with the query,
+ * so a socket that may still get an answer to an earlier query, timed
+ * out or sent to both servers, is replaced before the next query.
+ */
+typedef struct
+{
+	int fd;
+	bool dirty;		/* an answer may still be on its way to fd */
+	char servers[SBUFLEN];	/* the server part of the last call */
+	struct sockaddr_in gserv[2];
+	int srv[2];		/* index to gc_server, -1 if not tracked */
+	int numservers;
+	int hedge;		/* ms, 0 for none or GC_HEDGE_AUTO */
+	int cache_ttl;		/* seconds, 0 for no cache */
+} gc_thread_t;
+
+/*
+ * The latency of a server as the MTA sees it, smoothed as TCP does
+ * the round trip time (RFC 2988). srtt + 4 * rttvar is taken for the
+ * high percentile of the latency.
+ */
+typedef struct
+{
+	struct sockaddr_in addr;
+	int srtt;		/* microseconds, 0 before the first sample */
+	int rttvar;
+	unsigned long answers;
+	unsigned long misses;	/* asked but not the first to answer */
+} gc_server_t;
+
+/* a verdict shared by all the threads of the process */
+typedef struct
+{
+	uint32_t hash;
+	time_t expires;
+	char tuple[SBUFLEN];
+	char result[MTASTRLEN + 1];
+} gc_cached_t;
+
+typedef struct
+{
+	unsigned long queries;
+	unsigned long cached;	/* answered from the cache */
+	unsigned long sent;	/* queries sent to a server */
+	unsigned long failovers;
+	unsigned long hedges;	/* second server asked while waiting */
+	unsigned long timeouts;
+	unsigned long stale;	/* sockets replaced for a late answer */
+	unsigned long errors;
+} gc_stats_t;
+
+static pthread_once_t gc_once = PTHREAD_ONCE_INIT;
+static pthread_key_t gc_key;
+static pthread_mutex_t gc_cache_mx = PTHREAD_MUTEX_INITIALIZER;
+static gc_cached_t gc_cache[GC_CACHE_SIZE];
+static gc_stats_t gc_stats;
+static time_t gc_next_report = 0;
+static pthread_mutex_t gc_server_mx = PTHREAD_MUTEX_INITIALIZER;
+static gc_server_t gc_server[GC_SERVERS];
+static int gc_nservers = 0;
+
+int grosscheck_stats(char *arg, long *arglen, char *res, long *reslen);
+
 #define GROSSCHECK_ERROR { 						\
-	senderrormsg(fd, gserv, "ERROR: request was: %s", requestcopy); \
+	senderrormsg(gc->fd, &gc->gserv[0], "ERROR: request was: %s", requestcopy); \
+	ATOMIC_ADD_FETCH(&gc_stats.errors, 1);				\
 	Free(requestcopy); 						\
-	close(fd);							\
 	return MAP_FAIL; 						\
 }
 
+static void
+gc_thread_free(void *arg)
+{
+	gc_thread_t *gc = (gc_thread_t *)arg;
+
+	close(gc->fd);
+	free(gc);
+}
+
+static void
+gc_key_create(void)
+{
+	pthread_key_create(&gc_key, &gc_thread_free);
+}
+
+/*
+ * gc_socket	- a new socket for the queries of the thread
+ */
+static int
+gc_socket(gc_thread_t *gc)
+{
+	gc->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (gc->fd < 0)
+		return -1;
+	/* the children of the MTA have no use for it */
+	fcntl(gc->fd, F_SETFD, FD_CLOEXEC);
+	gc->dirty = false;
+
+	return 0;
+}
+
+/*
+ * gc_strcpy	- copy at most size - 1 bytes of src and terminate,
+ * returns the length copied
+ */
+static size_t
+gc_strcpy(char *dst, const char *src, size_t size)
+{
+	size_t len;
+
+	len = MIN(strlen(src), size - 1);
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+
+	return len;
+}
+
+/*
+ * gc_thread	- the socket and the servers of the calling thread,
+ * created on the first call
+ */
+static gc_thread_t *
+gc_thread(void)
+{
+	gc_thread_t *gc;
+
+	pthread_once(&gc_once, &gc_key_create);
+	gc = pthread_getspecific(gc_key);
+	if (gc)
+		return gc;
+
+	gc = malloc(sizeof(*gc));
+	if (NULL == gc)
+		return NULL;
+	memset(gc, 0, sizeof(*gc));
+	if (gc_socket(gc) < 0) {
+		free(gc);
+		return NULL;
+	}
+	pthread_setspecific(gc_key, gc);
+
+	return gc;
+}
+
+/*
+ * gc_server_index	- the latency record of a server, created on
+ * the first use
+ */
+static int
+gc_server_index(struct sockaddr_in *addr)
+{
+	int i;
+
+	pthread_mutex_lock(&gc_server_mx);
+	for (i = 0; i < gc_nservers; i++)
+		if (gc_server[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr
+		    && gc_server[i].addr.sin_port == addr->sin_port)
+			break;
+	if (i == gc_nservers) {
+		if (gc_nservers < GC_SERVERS)
+			gc_server[gc_nservers++].addr = *addr;
+		else
+			i = -1;
+	}
+	pthread_mutex_unlock(&gc_server_mx);
+
+	return i;
+}
+
+/*
+ * gc_servers	- parse the server part of the mapping call. The port
+ * may be followed by options, each after a '/': the hedge delay in
+ * milliseconds, "auto" for a delay that follows the latency of the
+ * server, and "cache=" the seconds trust and match verdicts are
+ * reused, 0 for none.
+ */
+static int
+gc_servers(gc_thread_t *gc, const char *first, const char *second, const char *port)
+{
+	const char *opt;
+
+	memset(gc->gserv, 0, sizeof(gc->gserv));
+	gc->gserv[0].sin_family = AF_INET;
+	gc->gserv[1].sin_family = AF_INET;
+	gc->servers[0] = '\0';
+	gc->numservers = 0;
+	gc->hedge = 0;
+	gc->cache_ttl = GC_CACHE_TTL;
+
+	if (inet_pton(AF_INET, first, &gc->gserv[0].sin_addr) < 1)
+		return -1;
+	if (inet_pton(AF_INET, second, &gc->gserv[1].sin_addr) < 1)
+		gc->numservers = 1;
+	else
+		gc->numservers = 2;
+	gc->gserv[0].sin_port = gc->gserv[1].sin_port = htons(atoi(port));
+
+	for (opt = strchr(port, '/'); opt; opt = strchr(opt, '/')) {
+		opt++;
+		if (strncmp(opt, "cache=", 6) == 0) {
+			if (!isdigit((unsigned char)opt[6]))
+				return -1;
+			gc->cache_ttl = atoi(opt + 6);
+		} else if (strncmp(opt, "auto", 4) == 0 && (opt[4] == '\0' || opt[4] == '/')) {
+			gc->hedge = GC_HEDGE_AUTO;
+		} else if ((gc->hedge = atoi(opt)) <= 0) {
+			return -1;
+		}
+	}
+
+	gc->srv[0] = gc_server_index(&gc->gserv[0]);
+	gc->srv[1] = gc->numservers > 1 ? gc_server_index(&gc->gserv[1]) : -1;
+
+	return 0;
+}
+
+/*
+ * gc_sample	- record the latency of a server in microseconds. A
+ * server that was asked but did not answer first is recorded with
+ * the time waited, a lower bound of its latency.
+ */
+static void
+gc_sample(int index, int usec, bool answered)
+{
+	gc_server_t *server;
+
+	if (index < 0)
+		return;
+	server = &gc_server[index];
+
+	pthread_mutex_lock(&gc_server_mx);
+	if (0 == server->srtt) {
+		server->srtt = MAX(usec, 1);
+		server->rttvar = usec / 2;
+	} else {
+		server->rttvar = (3 * server->rttvar + abs(server->srtt - usec)) / 4;
+		server->srtt = MAX((7 * server->srtt + usec) / 8, 1);
+	}
+	if (answered)
+		server->answers++;
+	else
+		server->misses++;
+	pthread_mutex_unlock(&gc_server_mx);
+}
+
+/*
+ * gc_hedge_delay	- milliseconds to wait for the first server before
+ * the second one is asked
+ */
+static int
+gc_hedge_delay(gc_thread_t *gc, int first)
+{
+	gc_server_t *server;
+	int delay;
+
+	if (gc->hedge == 0 || gc->numservers < 2)
+		return GC_TIMEOUT;
+	if (gc->hedge > 0 || gc->srv[first] < 0)
+		return gc->hedge > 0 ? gc->hedge : GC_HEDGE_DEFAULT;
+
+	server = &gc_server[gc->srv[first]];
+	pthread_mutex_lock(&gc_server_mx);
+	if (0 == server->srtt)
+		delay = GC_HEDGE_DEFAULT;
+	else
+		delay = (server->srtt + 4 * server->rttvar) / 1000;
+	pthread_mutex_unlock(&gc_server_mx);
+
+	return MIN(MAX(delay, GC_HEDGE_MIN), GC_TIMEOUT);
+}
+
+/*
+ * gc_primary	- the server to ask first. With hedging it is the one
+ * answering faster, a server not heard of yet is tried first to get
+ * its latency. Otherwise it is always the first of the mapping call.
+ */
+static int
+gc_primary(gc_thread_t *gc)
+{
+	int srtt[2];
+	int i;
+
+	if (gc->hedge == 0 || gc->numservers < 2 || gc->srv[0] < 0 || gc->srv[1] < 0)
+		return 0;
+
+	pthread_mutex_lock(&gc_server_mx);
+	for (i = 0; i < 2; i++)
+		srtt[i] = gc_server[gc->srv[i]].srtt;
+	pthread_mutex_unlock(&gc_server_mx);
+
+	return srtt[1] < srtt[0] ? 1 : 0;
+}
+
+static int
+usec_since(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_usec - start->tv_usec);
+}
+
+/*
+ * gc_query	- send the query and wait for the answer. If the first
+ * server has not answered in the hedge delay the second one is asked
+ * too, and the first answer from either is taken. Without hedging the
+ * delay is the full timeout, and the second server is a failover.
+ * Datagrams from elsewhere are ignored. If an answer may still come,
+ * the socket is marked dirty.
+ * Returns the length of the answer in recbuf, or -1.
+ */
+static int
+gc_query(gc_thread_t *gc, const char *request, char *recbuf)
+{
+	struct timeval sent[2];
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	struct pollfd pfd;
+	int asked[2];
+	int nasked, answered = -1;
+	int timeout;
+	int i, n = -1;
+
+	asked[0] = gc_primary(gc);
+	asked[1] = 1 - asked[0];
+
+	sendquerystr(gc->fd, &gc->gserv[asked[0]], request);
+	gettimeofday(&sent[0], NULL);
+	nasked = 1;
+	ATOMIC_ADD_FETCH(&gc_stats.sent, 1);
+	timeout = gc_hedge_delay(gc, asked[0]);
+
+	pfd.fd = gc->fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		memset(recbuf, 0, MAXLINELEN);
+		if (poll(&pfd, 1, timeout) > 0 && (pfd.revents & POLLIN)) {
+			fromlen = sizeof(from);
+			n = recvfrom(gc->fd, recbuf, MAXLINELEN, 0, (struct sockaddr *)&from, &fromlen);
+			if (n < 0)
+				break;
+			for (i = 0; i < nasked; i++)
+				if (from.sin_addr.s_addr == gc->gserv[asked[i]].sin_addr.s_addr
+				    && from.sin_port == gc->gserv[asked[i]].sin_port)
+					answered = i;
+			if (answered < 0)
+				continue;
+			/* the server asks us to wait longer */
+			if (recbuf[0] == 'P') {
+				answered = -1;
+				timeout = GC_PENDING_TIMEOUT;
+				continue;
+			}
+			break;
+		}
+
+		if (nasked < gc->numservers) {
+			/* no answer in time, ask the other server too */
+			if (gc->hedge)
+				ATOMIC_ADD_FETCH(&gc_stats.hedges, 1);
+			else
+				ATOMIC_ADD_FETCH(&gc_stats.failovers, 1);
+			sendquerystr(gc->fd, &gc->gserv[asked[1]], request);
+			gettimeofday(&sent[1], NULL);
+			nasked = 2;
+			ATOMIC_ADD_FETCH(&gc_stats.sent, 1);
+			timeout = GC_TIMEOUT;
+			continue;
+		}
+		ATOMIC_ADD_FETCH(&gc_stats.timeouts, 1);
+		n = -1;
+		break;
+	}
+	if (n < 0)
+		recbuf[0] = '\0';
+	/* the server not heard of may answer yet */
+	if (n < 0 || nasked > 1)
+		gc->dirty = true;
+
+	for (i = 0; i < nasked; i++)
+		gc_sample(gc->srv[asked[i]], usec_since(&sent[i]), i == answered);
+
+	return n;
+}
+
+/*
+ * gc_cache_lookup	- copy a cached verdict on the tuple to res, at
+ * most MTASTRLEN bytes with the terminator. Returns its length or -1.
+ */
+static int
+gc_cache_lookup(const char *tuple, char *res)
+{
+	gc_cached_t *entry;
+	uint32_t hash;
+	int len = -1;
+
+	hash = hashlittle(tuple, strlen(tuple), 0);
+	entry = &gc_cache[hash & (GC_CACHE_SIZE - 1)];
+
+	pthread_mutex_lock(&gc_cache_mx);
+	if (entry->hash == hash && entry->expires > time(NULL)
+	    && strcmp(entry->tuple, tuple) == 0)
+		len = gc_strcpy(res, entry->result, MTASTRLEN);
+	pthread_mutex_unlock(&gc_cache_mx);
+
+	return len;
+}
+
+static void
+gc_cache_store(const char *tuple, const char *result, int ttl)
+{
+	gc_cached_t *entry;
+	uint32_t hash;
+
+	hash = hashlittle(tuple, strlen(tuple), 0);
+	entry = &gc_cache[hash & (GC_CACHE_SIZE - 1)];
+
+	pthread_mutex_lock(&gc_cache_mx);
+	entry->hash = hash;
+	entry->expires = time(NULL) + ttl;
+	gc_strcpy(entry->tuple, tuple, sizeof(entry->tuple));
+	gc_strcpy(entry->result, result, sizeof(entry->result));
+	pthread_mutex_unlock(&gc_cache_mx);
+}
+
+static void
+gc_stats_str(char *buf, size_t len)
+{
+	char addr[INET_ADDRSTRLEN];
+	size_t used;
+	int i;
+
+	snprintf(buf, len, "queries %lu cached %lu sent %lu failovers %lu hedges %lu timeouts %lu"
+	    " stale %lu errors %lu",
+	    ATOMIC_LOAD(&gc_stats.queries), ATOMIC_LOAD(&gc_stats.cached),
+	    ATOMIC_LOAD(&gc_stats.sent), ATOMIC_LOAD(&gc_stats.failovers),
+	    ATOMIC_LOAD(&gc_stats.hedges), ATOMIC_LOAD(&gc_stats.timeouts),
+	    ATOMIC_LOAD(&gc_stats.stale), ATOMIC_LOAD(&gc_stats.errors));
+
+	/* server latency in milliseconds, answers and misses */
+	pthread_mutex_lock(&gc_server_mx);
+	for (i = 0; i < gc_nservers; i++) {
+		used = strlen(buf);
+		if (NULL == inet_ntop(AF_INET, &gc_server[i].addr.sin_addr, addr, sizeof(addr)))
+			continue;
+		snprintf(buf + used, len - used, " %s %d.%03d %lu/%lu", addr,
+		    gc_server[i].srtt / 1000, gc_server[i].srtt % 1000,
+		    gc_server[i].answers, gc_server[i].misses);
+	}
+	pthread_mutex_unlock(&gc_server_mx);
+}
+
+/*
+ * gc_report	- send the counters to the server once in
+ * GC_REPORT_INTERVAL, grossd logs them
+ */
+static void
+gc_report(gc_thread_t *gc, struct sockaddr_in *gserv)
+{
+	char buf[MAXLINELEN];
+	time_t now, next;
+
+	now = time(NULL);
+	next = gc_next_report;
+	if (now < next || !ATOMIC_CAS(&gc_next_report, next, now + GC_REPORT_INTERVAL))
+		return;
+	/* the first call only starts the clock */
+	if (0 == next)
+		return;
+
+	gc_stats_str(buf, sizeof(buf));
+	sendstatsmsg(gc->fd, gserv, buf);
+}
+
 int
 grosscheck(char *arg, long *arglen, char *res, long *reslen)
 {
@@ -60,22 +553,20 @@ grosscheck(char *arg, long *arglen, char *res, long *reslen)
 	char helo[SBUFLEN] = { 0x00 };
 	char recbuf[MAXLINELEN] = { 0x00 };
 	char *requestcopy = NULL;	/* null terminated copy of the request */
+	const char *tuple;		/* the part after the servers */
 	int n = -1;
-	int ret = -1;
-	int numservers = 0;
+	size_t len;
 	char *rstr = 0x00;
 	char *begin;
 	char *end;
+	char *first, *second;
 	char *request;
 	bool success = false;
 
 #ifdef ARGDEBUG
 	FILE *foo;
 #endif
-	int fd;
-	struct sockaddr_in gserv1, gserv2, *gserv;
-	struct timeval tv;
-	fd_set readers;
+	gc_thread_t *gc;
 
 	assert(arglen);
 	assert(*arglen >= 0);
@@ -83,16 +574,10 @@ grosscheck(char *arg, long *arglen, char *res, long *reslen)
 	assert(res);
 	assert(reslen);
 
-	fd = socket(AF_INET, SOCK_DGRAM, 0);
-
-	if (fd < 0)
+	gc = gc_thread();
+	if (NULL == gc)
 		return MAP_FAIL;
-
-	/* initialize */
-	memset(&gserv1, 0, sizeof(struct sockaddr_in));
-	gserv1.sin_family = AF_INET;
-	memset(&gserv2, 0, sizeof(struct sockaddr_in));
-	gserv2.sin_family = AF_INET;
+	ATOMIC_ADD_FETCH(&gc_stats.queries, 1);
 
 	/* arg should contain a string <ip>,<sender>,<recipient> */
 	strncpy(buffer, arg, *arglen);
@@ -113,24 +598,24 @@ grosscheck(char *arg, long *arglen, char *res, long *reslen)
 	*end = '\0'; 				\
 }
 
-	/* primary server ip */
+	/* primary and secondary server ip and the port */
 	end = buffer - 1;	/* an ugly kludge, I know */
 	GETNEXT;
-	ret = inet_pton(AF_INET, begin, &gserv1.sin_addr);
-	if (ret < 1)
-		GROSSCHECK_ERROR;
-
-	/* secondary server ip */
+	first = begin;
 	GETNEXT;
-	ret = inet_pton(AF_INET, begin, &gserv2.sin_addr);
-	if (ret < 1)
-		numservers = 1;
-	else
-		numservers = 2;
-	assert((numservers == 1) || (numservers == 2));
-
+	second = begin;
 	GETNEXT;
-	gserv1.sin_port = gserv2.sin_port = htons(atoi(begin));
+
+	/* the servers are the same call after call, parse them only once */
+	len = end - buffer;
+	if (strncmp(gc->servers, requestcopy, len) || gc->servers[len] != '\0') {
+		if (gc_servers(gc, first, second, begin) < 0)
+			GROSSCHECK_ERROR;
+		memcpy(gc->servers, requestcopy, len);
+		gc->servers[len] = '\0';
+	}
+	assert((gc->numservers == 1) || (gc->numservers == 2));
+	tuple = requestcopy + len + 1;
 
 	GETNEXT;
 	strncpy(caddr, begin, SBUFLEN - 1);
@@ -165,7 +650,18 @@ grosscheck(char *arg, long *arglen, char *res, long *reslen)
 		strncpy(helo, "", SBUFLEN - 1);
 	}
 
-	gserv = &gserv1;
+	/* the same tuple is often checked more than once in a transaction */
+	n = gc->cache_ttl > 0 ? gc_cache_lookup(tuple, res) : -1;
+	if (n >= 0) {
+		ATOMIC_ADD_FETCH(&gc_stats.cached, 1);
+		*reslen = n;
+#ifdef ARGDEBUG
+		if (foo)
+			fclose(foo);
+#endif
+		Free(requestcopy);
+		return MAP_SUCCESS;
+	}
 
 	/* Make sure they are null terminated */
 	sender[SBUFLEN - 1] = '\0';
@@ -180,36 +676,18 @@ grosscheck(char *arg, long *arglen, char *res, long *reslen)
 	}
 #endif
 
-      QUERY:
-	sendquerystr(fd, gserv, request);
-
-	/* initial timeout value */
-	tv.tv_sec = 2;		/* 1 second of server timeout + some extra */
-	tv.tv_usec = 0;
-
-	do {
-		FD_ZERO(&readers);
-		FD_SET(fd, &readers);
-		memset(recbuf, 0, MAXLINELEN);
-		select(fd + 1, &readers, NULL, NULL, &tv);
-		if (FD_ISSET(fd, &readers)) {
-			n = recvfrom(fd, recbuf, MAXLINELEN, 0, NULL, NULL);
-			if (n < 0)
-				break;
-		} else {
-			/* error, try another server if configured */
-			numservers--;
-			if (numservers == 0) {
-				break;
-			} else {
-				gserv = &gserv2;
-				goto QUERY;
-			}
+	/* a late answer to an earlier query must not be taken for this one */
+	if (gc->dirty) {
+		close(gc->fd);
+		ATOMIC_ADD_FETCH(&gc_stats.stale, 1);
+		if (gc_socket(gc) < 0) {
+			Free(requestcopy);
+			Free(request);
+			return MAP_FAIL;
 		}
-		/* update timeout value in case we got 'P' */
-		if (recbuf[0] == 'P')
-			tv.tv_sec = 10;
-	} while (recbuf[0] == 'P');
+	}
+
+	gc_query(gc, request, recbuf);
 
 	switch (recbuf[0]) {
 	case 'G':
@@ -246,10 +724,11 @@ grosscheck(char *arg, long *arglen, char *res, long *reslen)
 	}
 
 	if (success) {
-		strncpy(res, rstr, MTASTRLEN);
-		*reslen = strlen(rstr);
-		if (*reslen > MTASTRLEN)
-			*reslen = MTASTRLEN;
+		*reslen = gc_strcpy(res, rstr, MTASTRLEN);
+
+		/* greylisting and blocking must be asked again */
+		if (gc->cache_ttl > 0 && (recbuf[0] == 'T' || recbuf[0] == 'M'))
+			gc_cache_store(tuple, rstr, gc->cache_ttl);
 
 #ifdef ARGDEBUG
 		if (foo) {
@@ -259,12 +738,30 @@ grosscheck(char *arg, long *arglen, char *res, long *reslen)
 #endif
 
 	}
+	gc_report(gc, &gc->gserv[0]);
 	Free(requestcopy);
 	Free(request);
-	close(fd);
 	return success ? MAP_SUCCESS : MAP_FAIL;
 }
 
+/*
+ * grosscheck_stats	- the counters of the process as a mapping
+ * result, the arguments are ignored
+ */
+int
+grosscheck_stats(char *arg, long *arglen, char *res, long *reslen)
+{
+	char buf[MAXLINELEN];
+
+	assert(res);
+	assert(reslen);
+
+	gc_stats_str(buf, sizeof(buf));
+	*reslen = gc_strcpy(res, buf, MTASTRLEN);
+
+	return MAP_SUCCESS;
+}
+
 #ifdef GROSSC_MAIN
 int
 main(int argc, char **argv)
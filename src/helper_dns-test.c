@@ -40,7 +40,7 @@ dnstest(void *arg)
 	int *errors = arg;
        
 	for (i=0; i < 1; i++) {
-		host = Gethostbyname("ns1.utu.fi", 0);
+		host = Gethostbyname("ns1.utu.fi", 0, NULL);
 		ptr = inet_ntop(AF_INET, host->h_addr_list[0], buf, INET_ADDRSTRLEN);
 		assert (ptr);
 		if (strcmp("130.232.1.1", buf))
@@ -67,12 +67,12 @@ main(int argc, char **argv)
 
 	helper_dns_init();
 
-	host = Gethostbyaddr_str("130.232.1.1", 0);
+	host = Gethostbyaddr_str("130.232.1.1", 0, NULL);
 	ptr = inet_ntop(AF_INET, host->h_addr_list[0], buf, INET_ADDRSTRLEN);
 	assert (ptr);
 	printf("got: %s -> %s\n", host->h_name, buf);
 	free_hostent(host);
-	host = Gethostbyaddr_str("130.232.1.3", 0);
+	host = Gethostbyaddr_str("130.232.1.3", 0, NULL);
 	ptr = inet_ntop(AF_INET, host->h_addr_list[0], buf, INET_ADDRSTRLEN);
 	assert (ptr);
 	printf("got: %s -> %s\n", host->h_name, buf);
@@ -47,9 +47,16 @@ pthread_mutex_t cache_mx = PTHREAD_MUTEX_INITIALIZER;
 #define CACHE_LOCK { pthread_mutex_lock(&cache_mx); }
 #define CACHE_UNLOCK { pthread_mutex_unlock(&cache_mx); }
 
+/*
+ * The callback argument is shared by the waiter and the resolver
+ * callback, as the waiter may give up before the resolver answers.
+ * The last one to let go drains and releases the queue.
+ */
 typedef struct dns_cba_s
 {
 	int response_q;
+	int refs;		/* the waiter and the callback */
+	char *query;		/* copy of the name or address */
 } dns_cba_t;
 
 typedef struct dns_reply_s
@@ -68,6 +75,10 @@ default_cb(void *arg, int status, struct hostent *host);
 #endif
 void cache_str(char *key, struct hostent *value);
 int count_ptrs(char **ptr);
+static struct hostent *wait_reply(dns_request_type_t type, const char *query, size_t querylen,
+    mseconds_t timeout, edict_t *edict);
+static void wake_waiter(void *arg);
+static void cba_release(dns_cba_t *cba);
 
 struct hostent *
 hostent_deepcopy(struct hostent *src)
@@ -136,16 +147,16 @@ default_cb(void *arg, int status, struct hostent *host)
 #endif
 {
         dns_cba_t *cba;
-	dns_reply_t *reply;
+	dns_reply_t reply;
 
         cba = (dns_cba_t *)arg;
-	reply = Malloc(sizeof(dns_reply_t));
 
         if (status == ARES_SUCCESS)
-		reply->host = hostent_deepcopy(host);
+		reply.host = hostent_deepcopy(host);
 	else
-		reply->host = NULL;
-	put_msg(cba->response_q, reply, sizeof(dns_reply_t));
+		reply.host = NULL;
+	put_msg(cba->response_q, &reply, sizeof(dns_reply_t));
+	cba_release(cba);
 }
 
 void
@@ -224,48 +235,101 @@ lookup_str(const char *key)
 	}
 }
 
-struct hostent *
-Gethostbyname(const char *name, mseconds_t timeout)
+/*
+ * wake_waiter	- cancel hook, an empty reply ends the wait
+ */
+static void
+wake_waiter(void *arg)
 {
+	dns_reply_t reply;
 
-	dns_cba_t cba;
-	ares_channel *channel;
-	size_t size;
+	reply.host = NULL;
+	put_msg(((dns_cba_t *)arg)->response_q, &reply, sizeof(dns_reply_t));
+}
+
+/*
+ * cba_release	- drop a reference, the last one frees the replies
+ * nobody waits for any more
+ */
+static void
+cba_release(dns_cba_t *cba)
+{
 	dns_reply_t reply;
-	struct hostent *entry;
+
+	if (ATOMIC_ADD_FETCH(&cba->refs, -1) > 0)
+		return;
+	while (get_msg_timed(cba->response_q, &reply, sizeof(dns_reply_t), -1) > 0)
+		if (reply.host)
+			free_hostent(reply.host);
+	release_queue(cba->response_q);
+	Free(cba->query);
+	Free(cba);
+}
+
+/*
+ * wait_reply	- pass the request to the helper thread and wait for
+ * the reply until timeout, or until the edict is cancelled if given
+ */
+static struct hostent *
+wait_reply(dns_request_type_t type, const char *query, size_t querylen,
+    mseconds_t timeout, edict_t *edict)
+{
+	dns_cba_t *cba;
 	dns_request_t request;
+	dns_reply_t reply;
+	cancel_hook_t hook;
+	size_t size;
 
-	request.type = HOSTBYNAME;
-	request.query = (void *)name;
+	cba = Malloc(sizeof(dns_cba_t));
+	cba->response_q = get_queue();
+	cba->refs = 2;
+	/* the helper may read the request after we have given up */
+	cba->query = Malloc(querylen);
+	memcpy(cba->query, query, querylen);
+
+	request.type = type;
+	request.query = cba->query;
 	request.callback = &default_cb;
-	request.cba = &cba;
+	request.cba = cba;
+	if (edict) {
+		hook.wakeup = &wake_waiter;
+		hook.arg = cba;
+		cancel_register(edict, &hook);
+	}
+	/* send the request via pipe to wake up the select loop */
+	size = write(ctx->dns_wake, &request, sizeof(request));
+	if (size != sizeof(request))
+		daemon_fatal("write");
+	/* wait for the reply via message queue */
+	size = get_msg_timed(cba->response_q, &reply, sizeof(dns_reply_t), timeout);
+	if (edict)
+		cancel_unregister(edict, &hook);
+	cba_release(cba);
+
+	return size > 0 ? reply.host : NULL;
+}
+
+/*
+ * Gethostbyname	- resolve name, waiting at most timeout milliseconds.
+ * If edict is not NULL, the wait ends when the edict is cancelled.
+ */
+struct hostent *
+Gethostbyname(const char *name, mseconds_t timeout, edict_t *edict)
+{
+	struct hostent *entry;
 
 	entry = lookup_str(name);
 
 	if (NULL == entry) {
-		channel = ctx->dns_channel;
-		cba.response_q = get_queue();
-		/* send the request via pipe to wake up the select loop */
-		size = write(ctx->dns_wake, &request, sizeof(request));
-		if (size != sizeof(request))
-			daemon_fatal("write");
-		/* wait for the reply via message queue */
-		size = get_msg_timed(cba.response_q, &reply, sizeof(dns_reply_t), timeout);
-		release_queue(cba.response_q);
-
-		if (size > 0) {
-			if (reply.host)
-				cache_str(strdup(name), reply.host);
-			return reply.host;
-		} else
-			return NULL;
-	} else {
-		return entry;
+		entry = wait_reply(HOSTBYNAME, name, strlen(name) + 1, timeout, edict);
+		if (entry)
+			cache_str(strdup(name), entry);
 	}
+	return entry;
 }
 
 struct hostent *
-Gethostbyaddr_str(const char *addr, mseconds_t timeout)
+Gethostbyaddr_str(const char *addr, mseconds_t timeout, edict_t *edict)
 {
         struct in_addr inaddr;
         int ret;
@@ -279,7 +343,7 @@ Gethostbyaddr_str(const char *addr, mseconds_t timeout)
 		logstr(GLOG_ERROR, "invalid IP address: %s", addr);
 		return NULL;
 	} else {
-		return Gethostbyaddr((char *)&inaddr, 0);
+		return Gethostbyaddr((char *)&inaddr, timeout, edict);
 	}
 	/* NOTREACHED */
 	assert(0);
@@ -287,22 +351,12 @@ Gethostbyaddr_str(const char *addr, mseconds_t timeout)
 }
 
 struct hostent *
-Gethostbyaddr(const char *addr, mseconds_t timeout)
+Gethostbyaddr(const char *addr, mseconds_t timeout, edict_t *edict)
 {
-	dns_cba_t cba;
-	ares_channel *channel;
-	size_t size;
-	dns_reply_t reply;
 	struct hostent *entry;
-	dns_request_t request;
 	char ipstr[INET_ADDRSTRLEN];
 	const char *ptr;
 
-	request.type = HOSTBYADDR;
-	request.query = (void *)addr;
-	request.callback = &default_cb;
-	request.cba = &cba;
-
 	ptr = inet_ntop(AF_INET, addr, ipstr, INET_ADDRSTRLEN);
 	if (NULL == ptr) {
 		gerror("inet_ntop");
@@ -311,25 +365,11 @@ Gethostbyaddr(const char *addr, mseconds_t timeout)
 	entry = lookup_str(ipstr);
 
 	if (NULL == entry) {
-		channel = ctx->dns_channel;
-		cba.response_q = get_queue();
-		/* send the request via pipe to wake up the select loop */
-		size = write(ctx->dns_wake, &request, sizeof(request));
-		if (size != sizeof(request))
-			daemon_fatal("write");
-		/* wait for the reply via message queue */
-		size = get_msg_timed(cba.response_q, &reply, sizeof(dns_reply_t), timeout);
-		release_queue(cba.response_q);
-
-		if (size > 0) {
-			if (reply.host)
-				cache_str(strdup(ipstr), reply.host);
-			return reply.host;
-		} else
-			return NULL;
-	} else {
-		return entry;
+		entry = wait_reply(HOSTBYADDR, addr, sizeof(struct in_addr), timeout, edict);
+		if (entry)
+			cache_str(strdup(ipstr), entry);
 	}
+	return entry;
 }
 
 void *
@@ -0,0 +1,81 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2008
+ *                    Eino Tuominen <eino@utu.fi>
+ *                    Antti Siira <antti@utu.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "common.h"
+#include "srvutils.h"
+#include "latency.h"
+
+#define LOOPSIZE 1000
+
+/* dummy context */
+gross_ctx_t *ctx;
+
+int
+main(int argc, char **argv)
+{
+	latency_t hist = { 0x00 };
+	latency_t snapshot;
+	char buf[TMP_BUF_SIZE];
+	int i;
+	gross_ctx_t myctx = { 0x00 };
+	ctx = &myctx;
+
+	printf("Check: latency\n");
+
+	printf("  Adding %d samples from 1 to %d us...", LOOPSIZE, LOOPSIZE);
+	fflush(stdout);
+	for (i = 1; i <= LOOPSIZE; i++)
+		latency_add(&hist, i);
+	if (hist.count != LOOPSIZE || hist.max != LOOPSIZE
+	    || hist.sum != (uint64_t)LOOPSIZE * (LOOPSIZE + 1) / 2) {
+		printf("  FAILED.\n");
+		return 1;
+	}
+	printf("  Done.\n");
+
+	printf("  Checking the percentiles...");
+	fflush(stdout);
+	/* the median 500 is in the bucket of 256..511 */
+	if (latency_percentile(&hist, 50.0) != 511
+	    || latency_percentile(&hist, 99.0) != LOOPSIZE
+	    || latency_percentile(&hist, 0.0) != 1) {
+		printf("  FAILED.\n");
+		return 2;
+	}
+	printf("  Done.\n");
+
+	printf("  Taking a snapshot...");
+	fflush(stdout);
+	latency_take(&hist, &snapshot);
+	if (snapshot.count != LOOPSIZE || snapshot.max != LOOPSIZE
+	    || hist.count != 0 || hist.max != 0 || hist.sum != 0
+	    || latency_percentile(&hist, 50.0) != 0) {
+		printf("  FAILED.\n");
+		return 3;
+	}
+	latency_format(&snapshot, buf, sizeof(buf));
+	if (strcmp(buf, "n 1000 avg 500 p50 511 p90 1000 p99 1000 max 1000")) {
+		printf("  FAILED: %s\n", buf);
+		return 4;
+	}
+	printf("  Done.\n");
+
+	return 0;
+}
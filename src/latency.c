@@ -0,0 +1,115 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2008
+ *               Eino Tuominen <eino@utu.fi>
+ *               Antti Siira <antti@utu.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "common.h"
+#include "latency.h"
+
+/*
+ * latency_add	- add a sample of usec microseconds
+ */
+void
+latency_add(latency_t *hist, int usec)
+{
+	uint64_t max;
+	int i;
+
+	if (usec < 0)
+		usec = 0;
+	for (i = 0; usec >> i && i < LATENCY_BUCKETS - 1; i++)
+		;
+	ATOMIC_ADD_FETCH(&hist->bucket[i], 1);
+	ATOMIC_ADD_FETCH(&hist->sum, usec);
+	ATOMIC_ADD_FETCH(&hist->count, 1);
+	do {
+		max = hist->max;
+		if (max >= usec)
+			break;
+	} while (!ATOMIC_CAS(&hist->max, max, usec));
+}
+
+/*
+ * latency_take	- copy the histogram to snapshot and start it over.
+ * Samples added meanwhile end up in either one, never in both.
+ */
+void
+latency_take(latency_t *hist, latency_t *snapshot)
+{
+	uint64_t value;
+	int i;
+
+	memset(snapshot, 0, sizeof(latency_t));
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		value = ATOMIC_LOAD(&hist->bucket[i]);
+		ATOMIC_FETCH_ADD(&hist->bucket[i], -value);
+		snapshot->bucket[i] = value;
+		snapshot->count += value;
+	}
+	value = ATOMIC_LOAD(&hist->sum);
+	ATOMIC_FETCH_ADD(&hist->sum, -value);
+	snapshot->sum = value;
+	do {
+		value = hist->max;
+	} while (!ATOMIC_CAS(&hist->max, value, 0));
+	snapshot->max = value;
+	value = ATOMIC_LOAD(&hist->count);
+	ATOMIC_FETCH_ADD(&hist->count, -value);
+}
+
+/*
+ * latency_percentile	- the upper bound of the bucket holding the
+ * given percentile, capped by the largest sample
+ */
+uint64_t
+latency_percentile(const latency_t *hist, double percentile)
+{
+	uint64_t count, rank;
+	int i;
+
+	count = 0;
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+		count += hist->bucket[i];
+	if (0 == count)
+		return 0;
+
+	rank = (uint64_t)(count * percentile / 100.0 + 0.5);
+	if (rank < 1)
+		rank = 1;
+	count = 0;
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		count += hist->bucket[i];
+		if (count >= rank)
+			break;
+	}
+	return MIN(((uint64_t)1 << i) - 1, hist->max);
+}
+
+/*
+ * latency_format	- describe the histogram in microseconds
+ */
+int
+latency_format(const latency_t *hist, char *buf, size_t len)
+{
+	return snprintf(buf, len, "n %llu avg %llu p50 %llu p90 %llu p99 %llu max %llu",
+	    (unsigned long long)hist->count,
+	    (unsigned long long)(hist->count ? hist->sum / hist->count : 0),
+	    (unsigned long long)latency_percentile(hist, 50.0),
+	    (unsigned long long)latency_percentile(hist, 90.0),
+	    (unsigned long long)latency_percentile(hist, 99.0), (unsigned long long)hist->max);
+}
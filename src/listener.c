@@ -0,0 +1,172 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2008
+ *               Eino Tuominen <eino@utu.fi>
+ *               Antti Siira <antti@utu.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* for pthread_setaffinity_np() */
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <pthread.h>
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+# include <sched.h>
+#endif
+
+#include "common.h"
+#include "srvutils.h"
+#include "listener.h"
+
+/* prototypes of internals */
+static int listener_socket(int type);
+static int listener_unix(int type, const char *path);
+static void listener_affinity(listener_t *listener);
+static void *listener_main(void *arg);
+
+/*
+ * listener_socket	- a socket bound to the policy server address
+ */
+static int
+listener_socket(int type)
+{
+	int fd;
+	int opt = 1;
+
+	fd = socket(PF_INET, type, SOCK_STREAM == type ? IPPROTO_TCP : IPPROTO_UDP);
+	if (fd < 0)
+		daemon_fatal("listener: socket");
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+		daemon_fatal("setsockopt (SO_REUSEADDR)");
+#ifdef SO_REUSEPORT
+	if (ctx->config.listen_threads > 1
+	    && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+		daemon_fatal("setsockopt (SO_REUSEPORT)");
+#endif /* SO_REUSEPORT */
+
+	if (bind(fd, (struct sockaddr *)&(ctx->config.gross_host), sizeof(struct sockaddr_in)) < 0)
+		daemon_fatal("bind");
+	if (SOCK_STREAM == type && listen(fd, ctx->config.max_connq) < 0)
+		daemon_fatal("listen");
+
+	return fd;
+}
+
+/*
+ * listener_unix	- a unix socket bound to path. The file permissions
+ * decide who may talk to the server.
+ */
+static int
+listener_unix(int type, const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t omask;
+	int fd, ret;
+
+	fd = socket(PF_UNIX, type, 0);
+	if (fd < 0)
+		daemon_fatal("listener: socket");
+
+	/* a socket left behind by an earlier run */
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode))
+			daemon_shutdown(EXIT_CONFIG, "%s exists and is not a socket", path);
+		unlink(path);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	/* no window with looser permissions */
+	omask = umask(~ctx->config.listen_mode & 0777);
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(omask);
+	if (ret < 0)
+		daemon_fatal("bind");
+	if (SOCK_STREAM == type && listen(fd, ctx->config.max_connq) < 0)
+		daemon_fatal("listen");
+
+	logstr(GLOG_INFO, "listening on unix socket %s", path);
+	return fd;
+}
+
+/*
+ * listener_affinity	- bind the calling listener to its processor
+ */
+static void
+listener_affinity(listener_t *listener)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t cpus;
+	int cpu, ret;
+
+	if (0 == ctx->config.listen_ncpus)
+		return;
+
+	cpu = ctx->config.listen_cpus[listener->index % ctx->config.listen_ncpus];
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (ret)
+		logstr(GLOG_ERROR, "listener %d: can not bind to cpu %d: %s",
+		    listener->index, cpu, strerror(ret));
+	else
+		logstr(GLOG_DEBUG, "listener %d bound to cpu %d", listener->index, cpu);
+#endif /* HAVE_PTHREAD_SETAFFINITY_NP */
+}
+
+static void *
+listener_main(void *arg)
+{
+	listener_t *listener = (listener_t *)arg;
+
+	listener_affinity(listener);
+	return listener->routine(listener);
+}
+
+/*
+ * start_listeners	- open the sockets and start the listener threads.
+ * With a path the listeners share a unix socket. tinfo gets the first
+ * thread.
+ */
+void
+start_listeners(thread_info_t *tinfo, int type, const char *path, void *(*routine) (listener_t *))
+{
+	listener_t *listener;
+	int fd = -1;
+	int i;
+
+	if (path)
+		fd = listener_unix(type, path);
+
+	for (i = 0; i < ctx->config.listen_threads; i++) {
+		listener = Malloc(sizeof(listener_t));
+		listener->index = i;
+		listener->routine = routine;
+		if (NULL == path) {
+#ifdef SO_REUSEPORT
+			fd = listener_socket(type);
+#else
+			if (fd < 0)
+				fd = listener_socket(type);
+#endif /* SO_REUSEPORT */
+		}
+		listener->fd = fd;
+		create_thread(0 == i ? tinfo : NULL, DETACH, &listener_main, listener);
+	}
+}
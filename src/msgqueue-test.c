@@ -34,8 +34,83 @@ typedef struct queuepair_s {
 	int outq;
 } queuepair_t;
 
+#define BOUND 4
+
 /* internal functions */
 static void *msgqueueping(void *arg); 
+static void count_drop(void *msgp);
+static int bounded(void);
+
+static int dropped = 0;
+
+static void
+count_drop(void *msgp)
+{
+	dropped += *(int *)msgp;
+}
+
+/*
+ * bounded	- test the overflow policies of a bounded queue
+ */
+static int
+bounded(void)
+{
+	int q;
+	int i;
+	int msg;
+	size_t size;
+
+	q = get_queue();
+
+	printf("  Testing OVERFLOW_REJECT...");
+	fflush(stdout);
+	set_queue_limit(q, BOUND, OVERFLOW_REJECT, 0, NULL);
+	for (i = 0; i < BOUND; i++)
+		if (put_msg(q, &i, sizeof(i)) < 0)
+			return 4;
+	if (put_msg(q, &i, sizeof(i)) == 0 || errno != EAGAIN)
+		return 5;
+	if (queue_overflows(q) != 1)
+		return 6;
+	printf("  Done.\n");
+
+	printf("  Testing OVERFLOW_DROP_OLDEST...");
+	fflush(stdout);
+	set_queue_limit(q, BOUND, OVERFLOW_DROP_OLDEST, 0, &count_drop);
+	msg = 100;
+	if (put_msg(q, &msg, sizeof(msg)) < 0)
+		return 7;
+	/* the head (0) was dropped, the queue holds 1, 2, 3, 100 */
+	size = get_msg_timed(q, &msg, sizeof(msg), -1);
+	if (size != sizeof(msg) || msg != 1 || dropped != 0 || queue_overflows(q) != 2)
+		return 8;
+	msg = 200;
+	put_msg(q, &msg, sizeof(msg));
+	msg = 300;
+	put_msg(q, &msg, sizeof(msg));
+	/* 2 was dropped */
+	if (dropped != 2)
+		return 9;
+	printf("  Done.\n");
+
+	printf("  Testing OVERFLOW_BLOCK...");
+	fflush(stdout);
+	set_queue_limit(q, BOUND, OVERFLOW_BLOCK, 50, NULL);
+	if (put_msg(q, &msg, sizeof(msg)) == 0 || errno != EAGAIN)
+		return 10;
+	get_msg_timed(q, &msg, sizeof(msg), -1);
+	if (put_msg(q, &msg, sizeof(msg)) < 0)
+		return 11;
+	if (in_queue_len(q) != BOUND)
+		return 12;
+	/* put_msg_nowait() does not wait for the space */
+	set_queue_limit(q, BOUND, OVERFLOW_BLOCK, 10000, NULL);
+	if (put_msg_nowait(q, &msg, sizeof(msg)) == 0 || errno != EAGAIN)
+		return 13;
+	printf("  Done.\n");
+
+	return 0;
+}
 
 static void *
 msgqueueping(void *arg)
@@ -139,6 +214,6 @@ main(int argc, char **argv)
 
 	if (sum != LOOPSIZE * THREADS)
 		return 3;
-	else 
-		return 0;
+
+	return bounded();
 }
@@ -23,6 +23,10 @@
  * queues by calling queue_init(). Then, use get_queue() to get a message queue id,
  * and then put_msg() to add messages to the created queue and get_msg() to
  * receive messages from the queue. All functions are re-entrant and thread safe.
+ *
+ * Queues are unbounded by default. set_queue_limit() caps the number of
+ * messages a queue holds and chooses what put_msg() does when the cap is
+ * reached. For a delay queue the cap covers both halves of the pair.
  */
 
 #include "common.h"
@@ -37,6 +41,8 @@
 msgqueue_t *queuebyid(int msqid);
 void *delay(void *arg);
 int put_msg_raw(msgqueue_t *mq, msg_t *msg);
+int put_msg_bounded(msgqueue_t *mq, msg_t *msg, bool wait);
+static int queue_msg(int msqid, void *omsgp, size_t msgsz, bool wait);
 msg_t *get_msg_raw(msgqueue_t *mq, mseconds_t timeout);
 int set_delay_status(int msqid, int state);
 void queue_realloc(void);
@@ -191,6 +197,7 @@ create_queue(void)
 	mq = Malloc(sizeof(msgqueue_t));
 	memset(mq, 0, sizeof(msgqueue_t));
 	pthread_cond_init(&mq->cv, NULL);
+	pthread_cond_init(&mq->space_cv, NULL);
 	pthread_mutex_init(&mq->mx, NULL);
 
 	return mq;
@@ -374,6 +381,57 @@ set_delay(int msqid, const struct timespec *ts)
 	return 0;
 }
 
+/*
+ * set_queue_limit	- bound the queue to maxlen messages, 0 removes the limit.
+ * drop is called with the message contents for every message discarded
+ * by OVERFLOW_DROP_OLDEST, it may be NULL.
+ */
+int
+set_queue_limit(int msqid, size_t maxlen, overflow_policy_t policy, mseconds_t timeout,
+    void (*drop) (void *))
+{
+	msgqueue_t *mq;
+	int ret;
+
+	mq = queuebyid(msqid);
+	if (!mq) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (timeout < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ret = pthread_mutex_lock(&mq->mx);
+	assert(ret == 0);
+	mq->maxlen = maxlen;
+	mq->policy = policy;
+	mq->block_timeout = timeout;
+	mq->drop = drop;
+	/* wake up blocked writers, the limit may have grown */
+	pthread_cond_broadcast(&mq->space_cv);
+	ret = pthread_mutex_unlock(&mq->mx);
+	assert(ret == 0);
+
+	return 0;
+}
+
+/*
+ * queue_overflows	- returns the number of messages rejected or dropped
+ */
+uint64_t
+queue_overflows(int msqid)
+{
+	msgqueue_t *mq;
+
+	mq = queuebyid(msqid);
+	assert(mq);
+
+	return mq->overflows;
+}
+
 int
 put_msg_raw(msgqueue_t *mq, msg_t *msg)
 {
@@ -409,8 +467,96 @@ put_msg_raw(msgqueue_t *mq, msg_t *msg)
 	return 0;
 }
 
+/*
+ * put_msg_bounded	- append the message to a queue with a length limit,
+ * applying the overflow policy if the queue is full. OVERFLOW_BLOCK
+ * waits for space only if wait is set. Frees the message and returns -1
+ * with errno set to EAGAIN if it was not queued.
+ */
 int
-put_msg(int msqid, void *omsgp, size_t msgsz)
+put_msg_bounded(msgqueue_t *mq, msg_t *msg, bool wait)
+{
+	msg_t *dropped = NULL;
+	struct timespec now, timeout, abstime;
+	size_t fill;
+	int ret;
+
+	if (mq->active == false) {
+		logstr(GLOG_ERROR, "message queue is marked inactive");
+		Free(msg->msgp);
+		Free(msg);
+		return -1;
+	}
+
+	ret = pthread_mutex_lock(&mq->mx);
+	assert(ret == 0);
+
+	if (mq->policy == OVERFLOW_BLOCK && wait) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		mstotimespec(mq->block_timeout, &timeout);
+		ts_sum(&abstime, &now, &timeout);
+	}
+
+	for (;;) {
+		/* a delay queue is full when both halves together are */
+		fill = mq->msgcount + (mq->delaypair ? mq->delaypair->msgcount : 0);
+		if (mq->maxlen == 0 || fill < mq->maxlen)
+			break;
+
+		if (mq->policy == OVERFLOW_DROP_OLDEST && mq->head) {
+			dropped = mq->head;
+			mq->head = dropped->next;
+			dropped->next = NULL;
+			if (mq->head == NULL)
+				mq->tail = NULL;
+			mq->msgcount--;
+			mq->overflows++;
+			break;
+		} else if (mq->policy == OVERFLOW_BLOCK && wait) {
+			ret = pthread_cond_timedwait(&mq->space_cv, &mq->mx, &abstime);
+			if (ret != ETIMEDOUT)
+				continue;
+		}
+
+		/* OVERFLOW_REJECT, block timed out or nothing to drop */
+		mq->overflows++;
+		pthread_mutex_unlock(&mq->mx);
+		Free(msg->msgp);
+		Free(msg);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (mq->tail) {
+		assert(mq->head);
+		mq->tail->next = msg;
+	} else {
+		assert(mq->head == NULL);
+		mq->head = msg;
+	}
+	mq->tail = msg;
+	assert(mq->tail->next == NULL);
+	mq->msgcount++;
+
+	pthread_cond_signal(&mq->cv);
+	pthread_mutex_unlock(&mq->mx);
+
+	if (dropped) {
+		logstr(GLOG_DEBUG, "queue %d full, dropped the oldest message", mq->id);
+		if (mq->drop)
+			mq->drop(dropped->msgp);
+		Free(dropped->msgp);
+		Free(dropped);
+	}
+
+	return 0;
+}
+
+/*
+ * queue_msg	- put a copy of the message in the queue
+ */
+static int
+queue_msg(int msqid, void *omsgp, size_t msgsz, bool wait)
 {
 	msgqueue_t *mq;
 	msg_t *new;
@@ -432,11 +578,34 @@ put_msg(int msqid, void *omsgp, size_t msgsz)
 	new->msgp = msgp;
 	new->msgsz = msgsz;
 
-	ret = put_msg_raw(mq, new);
+	if (mq->maxlen)
+		ret = put_msg_bounded(mq, new, wait);
+	else
+		ret = put_msg_raw(mq, new);
 
 	return ret;
 }
 
+int
+put_msg(int msqid, void *omsgp, size_t msgsz)
+{
+	return queue_msg(msqid, omsgp, msgsz, true);
+}
+
+/*
+ * put_msg_nowait	- put_msg() for threads that must not wait: a full
+ * OVERFLOW_BLOCK queue rejects the message at once
+ */
+int
+put_msg_nowait(int msqid, void *omsgp, size_t msgsz)
+{
+	return queue_msg(msqid, omsgp, msgsz, false);
+}
+
+/*
+ * instant_msg	- bypasses the delay and the length limit of the queue,
+ * meant for control messages
+ */
 int
 instant_msg(int msqid, void *omsgp, size_t msgsz)
 {
@@ -523,6 +692,9 @@ try_available(void)
 	if (msg) {
 		mq = (msgqueue_t *)msg->msgp;
 		mq->active = true;
+		/* the previous user's limits do not apply */
+		mq->maxlen = 0;
+		mq->drop = NULL;
 		Free(msg);
 	}
 
@@ -617,9 +789,22 @@ get_msg_raw(msgqueue_t *mq, mseconds_t timeout)
 			assert(mq->msgcount == 0);
 			mq->tail = NULL;
 		}
+		if (mq->maxlen)
+			pthread_cond_signal(&mq->space_cv);
 	}
 
 	pthread_mutex_unlock(&mq->mx);
+
+	/*
+	 * a bounded delay queue counts both halves, so taking a message
+	 * from the out queue makes room in the in queue
+	 */
+	if (msg && mq->delaypair && mq->delaypair->maxlen) {
+		pthread_mutex_lock(&mq->delaypair->mx);
+		pthread_cond_signal(&mq->delaypair->space_cv);
+		pthread_mutex_unlock(&mq->delaypair->mx);
+	}
+
 	return msg;
 }
 
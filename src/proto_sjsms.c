@@ -52,6 +52,20 @@ senderrormsg(int fd, struct sockaddr_in *gserv, const char *fmt, ...)
 	return send_sjsms_msg(fd, gserv, &message);
 }
 
+/*
+ * sendstatsmsg	- the counters of a grosscheck client, grossd logs them
+ */
+int
+sendstatsmsg(int fd, struct sockaddr_in *gserv, const char *stats)
+{
+	sjsms_msg_t message;
+
+	snprintf(message.message, MAXLINELEN, "%s", stats);
+	message.msglen = MIN(strlen(message.message) + 1, MAXLINELEN);
+	message.msgtype = MSGTYPE_STATS;
+
+	return send_sjsms_msg(fd, gserv, &message);
+}
 
 int
 sendquery(int fd, struct sockaddr_in *gserv, grey_req_t *request)
@@ -0,0 +1,112 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2008
+ *                    Eino Tuominen <eino@utu.fi>
+ *                    Antti Siira <antti@utu.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "common.h"
+#include "srvutils.h"
+#include "worker.h"
+#include "qlog.h"
+
+#define CAPACITY 1024
+#define LOOPSIZE 2500
+
+/* dummy context */
+gross_ctx_t *ctx;
+
+int
+main(int argc, char **argv)
+{
+	qlog_t *qlog;
+	qlog_record_t record;
+	char path[] = "/tmp/qlog-test.XXXXXX";
+	uint64_t seq;
+	int fd, i;
+	int errors = 0;
+	gross_ctx_t myctx = { 0x00 };
+	ctx = &myctx;
+
+	printf("Check: qlog\n");
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+
+	printf("  Appending %d records to a ring of %d...", LOOPSIZE, CAPACITY);
+	fflush(stdout);
+	qlog = qlog_open(path, CAPACITY);
+	if (NULL == qlog) {
+		printf("  FAILED.\n");
+		unlink(path);
+		return 1;
+	}
+	for (i = 0; i < LOOPSIZE; i++) {
+		memset(&record, 0, sizeof(record));
+		record.delay = i;
+		record.action = STATUS_GREY;
+		snprintf(record.sender, QLOG_ADDRLEN, "sender%d@example.com", i);
+		qlog_append(qlog, &record);
+	}
+	qlog_close(qlog);
+	printf("  Done.\n");
+
+	printf("  Reading the surviving records...");
+	fflush(stdout);
+	qlog = qlog_map(path);
+	if (NULL == qlog || qlog_head(qlog) != LOOPSIZE
+	    || qlog_oldest(qlog) != LOOPSIZE - CAPACITY) {
+		printf("  FAILED.\n");
+		unlink(path);
+		return 2;
+	}
+	for (seq = qlog_oldest(qlog); seq < qlog_head(qlog); seq++) {
+		char buffer[QLOG_ADDRLEN];
+
+		snprintf(buffer, sizeof(buffer), "sender%d@example.com", (int)seq);
+		if (qlog_read(qlog, seq, &record) || record.delay != seq
+		    || strcmp(record.sender, buffer) || strcmp(qlog_action(record.action), "greylist"))
+			errors++;
+	}
+	/* overwritten ones are refused */
+	if (qlog_read(qlog, 0, &record) == 0)
+		errors++;
+	qlog_close(qlog);
+	if (errors) {
+		printf("  FAILED.\n");
+		unlink(path);
+		return 3;
+	}
+	printf("  Done.\n");
+
+	printf("  Reopening with another size...");
+	fflush(stdout);
+	qlog = qlog_open(path, 2 * CAPACITY);
+	if (NULL == qlog || qlog_head(qlog) != 0) {
+		printf("  FAILED.\n");
+		unlink(path);
+		return 4;
+	}
+	qlog_close(qlog);
+	printf("  Done.\n");
+
+	unlink(path);
+	return 0;
+}
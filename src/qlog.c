@@ -0,0 +1,242 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2008
+ *               Eino Tuominen <eino@utu.fi>
+ *               Antti Siira <antti@utu.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The binary query log, see qlog.h. This file is linked to the gqlog
+ * tool as well, so the errors are left for the caller to report.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "common.h"
+#include "worker.h"
+#include "qlog.h"
+
+#define QLOG_SIZE(capacity) (sizeof(qlog_header_t) + (capacity) * sizeof(qlog_record_t))
+
+/* plain loads, a read only mapping does not take the atomic ones */
+#define QLOG_LOAD(p) (__sync_synchronize(), *(volatile uint64_t *)(p))
+
+static qlog_t *qlog_mmap(int fd, size_t size, int prot);
+
+static qlog_t *
+qlog_mmap(int fd, size_t size, int prot)
+{
+	qlog_t *qlog;
+	void *base;
+
+	base = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == base)
+		return NULL;
+
+	qlog = malloc(sizeof(qlog_t));
+	if (NULL == qlog) {
+		munmap(base, size);
+		return NULL;
+	}
+	qlog->header = (qlog_header_t *)base;
+	qlog->records = (qlog_record_t *)((char *)base + sizeof(qlog_header_t));
+	qlog->size = size;
+	qlog->fd = fd;
+	return qlog;
+}
+
+/*
+ * qlog_open	- open the query log for writing, creating it if needed.
+ * An existing log of the same layout is continued, otherwise it is
+ * started over. Returns NULL with errno set on failure.
+ */
+qlog_t *
+qlog_open(const char *path, uint64_t capacity)
+{
+	qlog_t *qlog;
+	qlog_header_t *header;
+	struct stat st;
+	size_t size;
+	int fd;
+
+	assert(capacity > 0);
+	size = QLOG_SIZE(capacity);
+
+	fd = open(path, O_RDWR | O_CREAT, 0640);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0)
+		goto FAIL;
+	if (st.st_size != size) {
+		/* a new log, or a different size: start from zeroes */
+		if (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0)
+			goto FAIL;
+	}
+
+	qlog = qlog_mmap(fd, size, PROT_READ | PROT_WRITE);
+	if (NULL == qlog)
+		goto FAIL;
+
+	header = qlog->header;
+	if (header->magic != QLOG_MAGIC || header->version != QLOG_VERSION
+	    || header->record_size != sizeof(qlog_record_t) || header->capacity != capacity) {
+		memset(qlog->header, 0, size);
+		header->version = QLOG_VERSION;
+		header->record_size = sizeof(qlog_record_t);
+		header->capacity = capacity;
+		header->head = 0;
+		header->magic = QLOG_MAGIC;
+	}
+	return qlog;
+
+FAIL:
+	close(fd);
+	return NULL;
+}
+
+/*
+ * qlog_map	- open the query log for reading. Returns NULL with errno
+ * set on failure, EINVAL if the file is not a query log.
+ */
+qlog_t *
+qlog_map(const char *path)
+{
+	qlog_t *qlog;
+	qlog_header_t *header;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0)
+		goto FAIL;
+	if (st.st_size < sizeof(qlog_header_t)) {
+		errno = EINVAL;
+		goto FAIL;
+	}
+
+	qlog = qlog_mmap(fd, st.st_size, PROT_READ);
+	if (NULL == qlog)
+		goto FAIL;
+
+	header = qlog->header;
+	if (header->magic != QLOG_MAGIC || header->version != QLOG_VERSION
+	    || header->record_size != sizeof(qlog_record_t)
+	    || QLOG_SIZE(header->capacity) != st.st_size) {
+		qlog_close(qlog);
+		errno = EINVAL;
+		return NULL;
+	}
+	return qlog;
+
+FAIL:
+	close(fd);
+	return NULL;
+}
+
+void
+qlog_close(qlog_t *qlog)
+{
+	munmap(qlog->header, qlog->size);
+	close(qlog->fd);
+	free(qlog);
+}
+
+/*
+ * qlog_append	- write a record. The seq field of the record is
+ * ignored. Any number of threads may append at the same time, as
+ * long as the ring is larger than the number of threads.
+ */
+void
+qlog_append(qlog_t *qlog, const qlog_record_t *record)
+{
+	qlog_record_t *slot;
+	uint64_t seq;
+
+	seq = ATOMIC_FETCH_ADD(&qlog->header->head, 1);
+	slot = &qlog->records[seq % qlog->header->capacity];
+
+	ATOMIC_STORE(&slot->seq, 0);
+	memcpy((char *)slot + sizeof(slot->seq), (const char *)record + sizeof(record->seq),
+	    sizeof(qlog_record_t) - sizeof(record->seq));
+	ATOMIC_STORE(&slot->seq, seq + 1);
+}
+
+/*
+ * qlog_head	- the sequence number of the next record to be written
+ */
+uint64_t
+qlog_head(qlog_t *qlog)
+{
+	return QLOG_LOAD(&qlog->header->head);
+}
+
+/*
+ * qlog_oldest	- the sequence number of the oldest record in the ring
+ */
+uint64_t
+qlog_oldest(qlog_t *qlog)
+{
+	uint64_t head;
+
+	head = qlog_head(qlog);
+	return head > qlog->header->capacity ? head - qlog->header->capacity : 0;
+}
+
+/*
+ * qlog_read	- copy the record seq. Returns -1 if the record is
+ * being written, or has been overwritten already.
+ */
+int
+qlog_read(qlog_t *qlog, uint64_t seq, qlog_record_t *record)
+{
+	qlog_record_t *slot;
+
+	slot = &qlog->records[seq % qlog->header->capacity];
+	if (QLOG_LOAD(&slot->seq) != seq + 1)
+		return -1;
+	memcpy(record, slot, sizeof(qlog_record_t));
+	if (QLOG_LOAD(&slot->seq) != seq + 1)
+		return -1;
+	return 0;
+}
+
+/*
+ * qlog_action	- the name of the action as in the text query log
+ */
+const char *
+qlog_action(int action)
+{
+	switch (action) {
+	case STATUS_GREY:
+		return "greylist";
+	case STATUS_MATCH:
+		return "match";
+	case STATUS_TRUST:
+		return "trust";
+	case STATUS_UNKNOWN:
+		return "unknown";
+	case STATUS_FAIL:
+		return "fail";
+	case STATUS_BLOCK:
+		return "block";
+	default:
+		return "invalid";
+	}
+}
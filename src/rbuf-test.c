@@ -0,0 +1,139 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2008
+ *                    Eino Tuominen <eino@utu.fi>
+ *                    Antti Siira <antti@utu.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "common.h"
+#include "srvutils.h"
+#include "utils.h"
+
+#define LINES 1000
+
+/* dummy context */
+gross_ctx_t *ctx;
+
+int
+main(int argc, char **argv)
+{
+	rbuf_t rb;
+	struct iovec iov[3];
+	char lines[LINES * 32];
+	char buffer[MAXLINELEN];
+	char *line;
+	size_t len;
+	uint32_t word;
+	int sv[2];
+	int i, ret;
+	int errors = 0;
+	gross_ctx_t myctx = { 0x00 };
+	ctx = &myctx;
+
+	printf("Check: rbuf\n");
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+	rbuf_init(&rb, sv[0]);
+
+	printf("  Reading %d lines over the buffer size...", LINES);
+	fflush(stdout);
+	/* one write, a socket takes only so many small ones */
+	len = 0;
+	for (i = 0; i < LINES; i++)
+		len += snprintf(lines + len, sizeof(lines) - len, "attribute%d=value%d%s", i, i,
+		    i % 2 ? "\r\n" : "\n");
+	writen(sv[1], lines, len);
+	for (i = 0; i < LINES; i++) {
+		snprintf(buffer, sizeof(buffer), "attribute%d=value%d", i, i);
+		ret = rbuf_readline(&rb, &line);
+		if (ret != DATA || strcmp(line, buffer))
+			errors++;
+	}
+	/* nothing complete is left */
+	if (rbuf_line(&rb, &len) != NULL)
+		errors++;
+	if (errors) {
+		printf("  FAILED.\n");
+		return 2;
+	}
+	printf("  Done.\n");
+
+	printf("  Cutting a line longer than the buffer...");
+	fflush(stdout);
+	memset(buffer, 'x', sizeof(buffer));
+	for (i = 0; i < RBUFSZ / MAXLINELEN; i++)
+		writen(sv[1], buffer, MAXLINELEN);
+	writen(sv[1], "tail\n", 5);
+	if (rbuf_readline(&rb, &line) != DATA || strlen(line) != RBUFSZ)
+		errors++;
+	if (rbuf_readline(&rb, &line) != DATA || strcmp(line, "tail"))
+		errors++;
+	if (errors) {
+		printf("  FAILED.\n");
+		return 3;
+	}
+	printf("  Done.\n");
+
+	printf("  Writing a response with writevn...");
+	fflush(stdout);
+	iov[0].iov_base = "action=";
+	iov[0].iov_len = 7;
+	iov[1].iov_base = "dunno";
+	iov[1].iov_len = 5;
+	iov[2].iov_base = "\n\n";
+	iov[2].iov_len = 2;
+	if (writevn(sv[1], iov, 3) != 14)
+		errors++;
+	if (rbuf_readline(&rb, &line) != DATA || strcmp(line, "action=dunno"))
+		errors++;
+	if (rbuf_readline(&rb, &line) != DATA || *line)
+		errors++;
+	if (errors) {
+		printf("  FAILED.\n");
+		return 4;
+	}
+	printf("  Done.\n");
+
+	printf("  Reading binary data and the end of the stream...");
+	fflush(stdout);
+	for (i = 0; i < LINES; i++) {
+		word = htonl(i);
+		memcpy(lines + i * sizeof(word), &word, sizeof(word));
+	}
+	memcpy(lines + LINES * sizeof(word), "last", 4);
+	writen(sv[1], lines, LINES * sizeof(word) + 4);
+	shutdown(sv[1], SHUT_WR);
+	for (i = 0; i < LINES; i++)
+		if (rbuf_readn(&rb, &word, sizeof(word)) != sizeof(word) || ntohl(word) != i)
+			errors++;
+	/* a last line without a terminator */
+	if (rbuf_readline(&rb, &line) != DATA || strcmp(line, "last"))
+		errors++;
+	if (rbuf_readline(&rb, &line) != EMPTY)
+		errors++;
+	if (errors) {
+		printf("  FAILED.\n");
+		return 5;
+	}
+	printf("  Done.\n");
+
+	close(sv[0]);
+	close(sv[1]);
+	return 0;
+}
@@ -55,6 +55,8 @@ main(int argc, char **argv)
 	int error_count = 0;
 	test_vector *test;
 	char *long_message;
+	sha256_state_t state;
+	int i, piece;
 
 	printf("Check: sha256\n");
 
@@ -97,6 +99,26 @@ main(int argc, char **argv)
 			verbose_result(TRUE, long_message, digest_hex, reference_digest);
 		}
 	}
+
+	/* The same long message fed in pieces of varying size */
+	sha256_init(&state);
+	for (i = 0, piece = 1; i < 1000000; i += piece, piece = piece % 131 + 1)
+		sha256_update(&state, long_message + i, MIN(piece, 1000000 - i));
+	digest = sha256_final(&state);
+	snprintf(digest_hex, 72, "%08x %08x %08x %08x %08x %08x %08x %08x", digest.h0, digest.h1,
+	    digest.h2, digest.h3, digest.h4, digest.h5, digest.h6, digest.h7);
+
+	if (strncmp(digest_hex, reference_digest, MAX_MESSAGE_LEN) != 0) {
+		if (argc > 1) {
+			verbose_result(FALSE, "(incremental long message)", digest_hex, reference_digest);
+		}
+
+		error_count++;
+	} else {
+		if (argc > 1) {
+			verbose_result(TRUE, "(incremental long message)", digest_hex, reference_digest);
+		}
+	}
 	Free(long_message);
 
 	return error_count > 0;
@@ -21,18 +21,9 @@
 #include "sha256.h"
 
 /* prototypes of internals */
-int little_endian();
-void swap_bytes(sha_byte_t *a, sha_byte_t *b);
-void convert_int64_little_endian(sha_ulong_t *num);
-void convert_int64_big_endian(sha_ulong_t *num);
-void convert_int32_little_endian(sha_uint_t *num);
-void convert_int32_big_endian(sha_uint_t *num);
 sha_uint_t rotate_right(sha_uint_t num, int amount);
 void debug_print_digest(sha_256_t digest, int with_newline);
-
-
-void (*p_convert_int64_to_big_endian) (sha_ulong_t *num) = &convert_int64_big_endian;
-void (*p_convert_int32_to_big_endian) (sha_uint_t *num) = &convert_int32_big_endian;
+static void sha256_transform(sha_256_t *digest, const sha_byte_t *block);
 
 /* 232 times the square root of the first 8 primes 2..19 */
 const sha_256_t DEFAULT_SHA256 = {
@@ -58,65 +49,6 @@ rotate_right(sha_uint_t num, int amount)
 	return (num >> amount) | (num << (32 - amount));
 }
 
-/* Return TRUE if little endian. False otherwise. */
-int
-little_endian()
-{
-	int i = 1;
-	char *p = (char *)&i;
-
-	/* Lowest address contains the least significant byte */
-	if (p[0] == 1)
-		return TRUE;
-	else
-		return FALSE;
-}
-
-void
-swap_bytes(sha_byte_t *a, sha_byte_t *b)
-{
-	sha_byte_t tmp = *a;
-
-	*a = *b;
-	*b = tmp;
-}
-
-void
-convert_int64_little_endian(sha_ulong_t *num)
-{
-	sha_byte_t *index = (sha_byte_t *)num;
-
-	swap_bytes(index + 0, index + 7);
-	swap_bytes(index + 1, index + 6);
-	swap_bytes(index + 2, index + 5);
-	swap_bytes(index + 3, index + 4);
-}
-
-void
-convert_int64_big_endian(sha_ulong_t *num)
-{
-	do {
-		num = num;
-	} while (0);
-}
-
-void
-convert_int32_little_endian(sha_uint_t *num)
-{
-	sha_byte_t *index = (sha_byte_t *)num;
-
-	swap_bytes(index + 0, index + 3);
-	swap_bytes(index + 1, index + 2);
-}
-
-void
-convert_int32_big_endian(sha_uint_t *num)
-{
-	do {
-		num = num;
-	} while (0);
-}
-
 void
 string_sha256_hexdigest(char *to, char *message)
 {
@@ -143,112 +75,152 @@ debug_print_digest(sha_256_t digest, int with_newline)
 		printf("\n");
 }
 
-sha_256_t
-sha256(sha_byte_t *message, sha_ulong_t size)
+/*
+ * sha256_transform	- process one 64 byte block
+ */
+static void
+sha256_transform(sha_256_t *digest, const sha_byte_t *block)
 {
-	sha_256_t digest = DEFAULT_SHA256;
-	sha_256_t tmp_digest = DEFAULT_SHA256;
-
-	sha_ulong_t new_size = size + 1 + 8 + ((448 - (((sha_ulong_t)8) * (size + 1))) % 512) / 8;
-	sha_ulong_t tmp_size = size * 8;
-
-	/* Multipurpose indices */
-	sha_uint_t i, j, k;
-	sha_byte_t *iter;
+	sha_uint_t j;
 	sha_uint_t w[64];
-	sha_uint_t s0, s1, maj, t2, ch, t1, chunk;
-
-	sha_byte_t digestable_block[64] = { 0x00 };
+	sha_uint_t s0, s1, maj, t2, ch, t1;
+	sha_256_t tmp_digest;
 
-	if (little_endian()) {
-		p_convert_int64_to_big_endian = &convert_int64_little_endian;
-		p_convert_int32_to_big_endian = &convert_int32_little_endian;
+	/* Initialize the beginning 0..15 of the word block, big endian */
+	for (j = 0; j < 16; j++) {
+		w[j] = ((sha_uint_t)block[j * 4] << 24) | ((sha_uint_t)block[j * 4 + 1] << 16) |
+		    ((sha_uint_t)block[j * 4 + 2] << 8) | (sha_uint_t)block[j * 4 + 3];
 	}
 
-	/*
-	 * Insert message bit length to the end of the buffer
-	 * in big endian 64 integer
-	 */
-	(*p_convert_int64_to_big_endian) (&tmp_size);
+	/* Initialize the end 16..63 of the word block */
+	for (j = 16; j < 64; j++) {
+		s0 = rotate_right(w[j - 15], 7) ^ rotate_right(w[j - 15], 18) ^ (w[j - 15] >> 3);
+		s1 = rotate_right(w[j - 2], 17) ^ rotate_right(w[j - 2], 19) ^ (w[j - 2] >> 10);
+		w[j] = w[j - 16] + s0 + w[j - 7] + s1;
+	}
 
-	for (i = 0; i < new_size; i += 64) {
-		bzero(digestable_block, 64);
-		if (i + 64 <= size) {
-			memcpy((void *)digestable_block, (const void *)(message + i), 64);
-		}
+	/* Init the temporary digest */
+	tmp_digest = *digest;
+
+	/*  Main loop */
+	for (j = 0; j < 64; j++) {
+		s0 = rotate_right(tmp_digest.h0, 2) ^ rotate_right(tmp_digest.h0,
+		    13) ^ rotate_right(tmp_digest.h0, 22);
+		maj =
+		    (tmp_digest.h0 & tmp_digest.h1) ^ (tmp_digest.h1 & tmp_digest.h2) ^ (tmp_digest.
+		    h2 & tmp_digest.h0);
+		t2 = s0 + maj;
+		s1 = rotate_right(tmp_digest.h4, 6) ^ rotate_right(tmp_digest.h4,
+		    11) ^ rotate_right(tmp_digest.h4, 25);
+		ch = (tmp_digest.h4 & tmp_digest.h5) ^ ((~tmp_digest.h4) & tmp_digest.h6);
+		t1 = tmp_digest.h7 + s1 + ch + ROUND_CONSTANTS[j] + w[j];
+
+		/* Update values for next iteration */
+		tmp_digest.h7 = tmp_digest.h6;
+		tmp_digest.h6 = tmp_digest.h5;
+		tmp_digest.h5 = tmp_digest.h4;
+		tmp_digest.h4 = tmp_digest.h3 + t1;
+		tmp_digest.h3 = tmp_digest.h2;
+		tmp_digest.h2 = tmp_digest.h1;
+		tmp_digest.h1 = tmp_digest.h0;
+		tmp_digest.h0 = t2 + t1;
+	}
 
-		if ((i + 64 > size) && (size >= i)) {
-			/* Padding round */
-			memcpy((void *)digestable_block, (const void *)(message + i), size % 64);
-			digestable_block[size % 64] = 0x80;
-		}
+	/* Add this chunk's hash to result so far: */
+	digest->h0 += tmp_digest.h0;
+	digest->h1 += tmp_digest.h1;
+	digest->h2 += tmp_digest.h2;
+	digest->h3 += tmp_digest.h3;
+	digest->h4 += tmp_digest.h4;
+	digest->h5 += tmp_digest.h5;
+	digest->h6 += tmp_digest.h6;
+	digest->h7 += tmp_digest.h7;
+}
 
-		if (i + 64 >= new_size) {
-			/* Last round */
-			for (k = 0, j = 0, iter = (sha_byte_t *)&tmp_size; k < 8; k++, j++) {
-				*(digestable_block + k + 56) = *(iter + j);
-			}
-		}
+void
+sha256_init(sha256_state_t *state)
+{
+	state->digest = DEFAULT_SHA256;
+	state->length = 0;
+	state->fill = 0;
+}
 
-		iter = digestable_block;
+/*
+ * sha256_update	- feed size bytes to the hash, may be called
+ * any number of times
+ */
+void
+sha256_update(sha256_state_t *state, const void *data, sha_ulong_t size)
+{
+	const sha_byte_t *message = (const sha_byte_t *)data;
+	sha_ulong_t n;
+
+	state->length += size;
+
+	/* complete a partial block first */
+	if (state->fill > 0) {
+		n = 64 - state->fill;
+		if (n > size)
+			n = size;
+		memcpy(state->block + state->fill, message, n);
+		state->fill += n;
+		message += n;
+		size -= n;
+		if (state->fill < 64)
+			return;
+		sha256_transform(&state->digest, state->block);
+		state->fill = 0;
+	}
 
-		/* Initialize the beginning 0..15 of the word block */
-		for (j = 0; j < 64; j += 4) {
-			chunk = *((sha_uint_t *)(iter + j));
-			p_convert_int32_to_big_endian(&chunk);
-			w[j / 4] = chunk;
-		}
+	/* whole blocks straight from the message */
+	while (size >= 64) {
+		sha256_transform(&state->digest, message);
+		message += 64;
+		size -= 64;
+	}
 
-		/* Initialize the end 16..63 of the word block */
-		for (j = 16; j < 64; j++) {
-			s0 = rotate_right(w[j - 15], 7) ^ rotate_right(w[j - 15], 18) ^ (w[j - 15] >> 3);
-			s1 = rotate_right(w[j - 2], 17) ^ rotate_right(w[j - 2], 19) ^ (w[j - 2] >> 10);
-			w[j] = w[j - 16] + s0 + w[j - 7] + s1;
-		}
+	/* save the rest */
+	if (size > 0) {
+		memcpy(state->block, message, size);
+		state->fill = size;
+	}
+}
 
-		/* Init the temporary digest */
-		tmp_digest = digest;
+/*
+ * sha256_final	- pad the message and return the digest
+ */
+sha_256_t
+sha256_final(sha256_state_t *state)
+{
+	sha_ulong_t bits;
+	int i;
 
-		/*  Main loop */
-		for (j = 0; j < 64; j++) {
-			s0 = rotate_right(tmp_digest.h0, 2) ^ rotate_right(tmp_digest.h0,
-			    13) ^ rotate_right(tmp_digest.h0, 22);
-			maj =
-			    (tmp_digest.h0 & tmp_digest.h1) ^ (tmp_digest.h1 & tmp_digest.h2) ^ (tmp_digest.
-			    h2 & tmp_digest.h0);
-			t2 = s0 + maj;
-			s1 = rotate_right(tmp_digest.h4, 6) ^ rotate_right(tmp_digest.h4,
-			    11) ^ rotate_right(tmp_digest.h4, 25);
-			ch = (tmp_digest.h4 & tmp_digest.h5) ^ ((~tmp_digest.h4) & tmp_digest.h6);
-			t1 = tmp_digest.h7 + s1 + ch + ROUND_CONSTANTS[j] + w[j];
+	bits = state->length * 8;
 
-			/* Update values for next iteration */
-			tmp_digest.h7 = tmp_digest.h6;
-			tmp_digest.h6 = tmp_digest.h5;
-			tmp_digest.h5 = tmp_digest.h4;
-			tmp_digest.h4 = tmp_digest.h3 + t1;
-			tmp_digest.h3 = tmp_digest.h2;
-			tmp_digest.h2 = tmp_digest.h1;
-			tmp_digest.h1 = tmp_digest.h0;
-			tmp_digest.h0 = t2 + t1;
-		}
+	state->block[state->fill++] = 0x80;
+	if (state->fill > 56) {
+		memset(state->block + state->fill, 0, 64 - state->fill);
+		sha256_transform(&state->digest, state->block);
+		state->fill = 0;
+	}
+	memset(state->block + state->fill, 0, 56 - state->fill);
 
-		/* Add this chunk's hash to result so far: */
-		digest.h0 += tmp_digest.h0;
-		digest.h1 += tmp_digest.h1;
-		digest.h2 += tmp_digest.h2;
-		digest.h3 += tmp_digest.h3;
-		digest.h4 += tmp_digest.h4;
-		digest.h5 += tmp_digest.h5;
-		digest.h6 += tmp_digest.h6;
-		digest.h7 += tmp_digest.h7;
+	/* message bit length in big endian 64 bit integer */
+	for (i = 0; i < 8; i++)
+		state->block[56 + i] = (sha_byte_t)(bits >> (56 - 8 * i));
+	sha256_transform(&state->digest, state->block);
 
-	}
+	return state->digest;
+}
 
-	/* Free Willy! */
-/* 	Free(digestable_message); */
+sha_256_t
+sha256(sha_byte_t *message, sha_ulong_t size)
+{
+	sha256_state_t state;
 
-	return digest;
+	sha256_init(&state);
+	sha256_update(&state, message, size);
+	return sha256_final(&state);
 }
 
 sha_256_t
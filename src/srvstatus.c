@@ -25,6 +25,7 @@
 #include "stats.h"
 #include "srvutils.h"
 #include "msgqueue.h"
+#include "checkcache.h"
 #include "utils.h"
 
 /* prototypes */
@@ -50,6 +51,38 @@ test_thread(pthread_t * thread)
 }
 
 
+/*
+ * check_overflows	- jobs rejected or dropped by full check queues
+ */
+static uint64_t
+check_overflows(void)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; ctx->checklist[i]; i++)
+		sum += queue_overflows(ctx->checklist[i]->pool->work_queue_id);
+
+	return sum;
+}
+
+/*
+ * check_skips	- checks not started because the verdict was settled
+ */
+static void
+check_skips(char *buf, size_t len)
+{
+	size_t used = 0;
+	int i;
+
+	*buf = '\0';
+	for (i = 0; ctx->checklist[i] && used < len; i++) {
+		snprintf(buf + used, len - used, " %s %llu", ctx->checklist[i]->pool->name,
+		    (unsigned long long)ctx->checklist[i]->skipped);
+		used = strlen(buf);
+	}
+}
+
 void
 get_srvstatus(char *buf, int len)
 {
@@ -99,6 +132,17 @@ get_srvstatus(char *buf, int len)
 		    ctx->stats.all_block,
 		    (double)(ctx->stats.all_trust + ctx->stats.all_match + ctx->stats.all_greylist +
 			ctx->stats.all_block) / (double)(time(NULL) - ctx->stats.startup));
+		snprintf(buf + strlen(buf), len - strlen(buf), " Overflows: update %llu checks %llu",
+		    (unsigned long long)queue_overflows(ctx->update_q),
+		    (unsigned long long)check_overflows());
+		snprintf(buf + strlen(buf), len - strlen(buf), " Pools:");
+		pool_stats(buf + strlen(buf), len - strlen(buf));
+		snprintf(buf + strlen(buf), len - strlen(buf), " Check cache:");
+		checkcache_stats(buf + strlen(buf), len - strlen(buf));
+		snprintf(buf + strlen(buf), len - strlen(buf), " Skipped checks:");
+		check_skips(buf + strlen(buf), len - strlen(buf));
+		snprintf(buf + strlen(buf), len - strlen(buf), " Log:");
+		logging_stats(buf + strlen(buf), len - strlen(buf));
 		snprintf(buf + strlen(buf), len - strlen(buf), " Dnsbl matches: ");
 		dnsbl_stats(buf + strlen(buf), len - strlen(buf));
 		RELEASE_STATS_GUARD();
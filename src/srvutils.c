@@ -31,66 +31,354 @@ gross_ctx_t *ctx;
 /* prototypes of internals */
 int log_put(const char *msg);
 size_t date_fmt(char *msg, size_t len);
+static int log_vwrite(int level, bool prefix, const char *fmt, va_list vap);
+static int log_emit(int level, const char *text);
+static log_ring_t *log_ring(void);
+static void log_ring_exit(void *arg);
+static void log_batch(log_slot_t *slot);
+static void log_batch_flush(void);
+static void *log_writer(void *arg);
+
+/*
+ * Asynchronous logging. Every thread writes its log lines into a ring
+ * of its own and the log writer thread drains the rings in batches, so
+ * the workers never wait for syslog() or stdout. Before the writer is
+ * started the lines are written directly. If a ring is full, the lines
+ * less severe than GLOG_ERROR are dropped and counted.
+ */
+static bool log_running = false;
+static pthread_key_t log_key;
+static log_ring_t *log_rings = NULL;
+static pthread_mutex_t log_rings_mx = PTHREAD_MUTEX_INITIALIZER;	/* the list of rings */
+static pthread_mutex_t log_drain_mx = PTHREAD_MUTEX_INITIALIZER;	/* one drainer at a time */
+static pthread_mutex_t log_mx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cv = PTHREAD_COND_INITIALIZER;
+static int log_sleeping = 0;		/* atomic, the writer waits for log_cv */
+static uint64_t log_written = 0;	/* atomic */
+static uint64_t log_dropped = 0;	/* atomic */
+static uint64_t log_reported = 0;	/* drops already reported */
+static char log_batchbuf[LOG_BATCH_SIZE];	/* stdout batch, under log_drain_mx */
+static size_t log_batchlen = 0;
+
+/* querylog_sample and querylog_rate */
+static uint64_t querylog_seen = 0;	/* atomic */
+static uint64_t querylog_suppressed = 0;	/* atomic */
+static time_t querylog_second = 0;	/* atomic */
+static int querylog_count = 0;		/* atomic, lines in querylog_second */
+
+/*
+ * log_write	- the function behind logstr(), which does the level test
+ * before the arguments are evaluated
+ */
+int
+log_write(int level, const char *fmt, ...)
+{
+	va_list vap;
+	int ret;
+
+	va_start(vap, fmt);
+	ret = log_vwrite(level, true, fmt, vap);
+	va_end(vap);
+
+	return ret;
+}
 
 int
-logstr(int level, const char *fmt, ...)
+statstr(int level, const char *fmt, ...)
 {
-	char logfmt[MSGSZ] = { '\0' };
-	char mbuf[MSGSZ] = { '\0' };
 	va_list vap;
+	int ret;
 
-	if (level > ctx->config.loglevel) {
+	if ((level & ctx->config.statlevel) == STATS_NONE) {
 		return 0;
 	}
 
-	/* prepend thread id */
-	snprintf(logfmt, MSGSZ, "#%x: %s", (uint32_t) pthread_self(), fmt);
+	if (GLOG_NOTICE > ctx->config.loglevel) {
+		return 0;
+	}
 
 	va_start(vap, fmt);
-	vsnprintf(mbuf, MSGSZ, logfmt, vap);
+	ret = log_vwrite(GLOG_NOTICE, false, fmt, vap);
 	va_end(vap);
 
+	return ret;
+}
+
+/*
+ * log_vwrite	- format the line once, straight into the ring of the
+ * thread if the writer is running, prefixed with the thread id
+ */
+static int
+log_vwrite(int level, bool prefix, const char *fmt, va_list vap)
+{
+	char mbuf[MSGSZ];
+	log_ring_t *ring;
+	log_slot_t *slot;
+	unsigned int head, used;
+	char *text;
+	int n = 0;
+
+	ring = log_running ? log_ring() : NULL;
+	if (ring) {
+		head = ring->head;
+		used = head - ATOMIC_LOAD(&ring->tail);
+		if (used < LOG_RING_SLOTS) {
+			slot = &ring->slot[head % LOG_RING_SLOTS];
+			slot->level = level;
+			slot->when = time(NULL);
+			text = slot->text;
+		} else if (level > GLOG_ERROR) {
+			ATOMIC_ADD_FETCH(&log_dropped, 1);
+			return 0;
+		} else {
+			/* never lose an error, write it ourselves */
+			ring = NULL;
+			text = mbuf;
+		}
+	} else {
+		text = mbuf;
+	}
+
+	if (prefix)
+		n = snprintf(text, MSGSZ, "#%x: ", (uint32_t) pthread_self());
+	vsnprintf(text + n, MSGSZ - n, fmt, vap);
+
+	if (NULL == ring)
+		return log_emit(level, text);
+
+	ATOMIC_STORE(&ring->head, head + 1);
+	/* the writer comes by every LOG_FLUSH_TIME, call it early only if the ring fills up */
+	if (used + 1 >= LOG_RING_SLOTS / 2 && ATOMIC_LOAD(&log_sleeping)) {
+		pthread_mutex_lock(&log_mx);
+		pthread_cond_signal(&log_cv);
+		pthread_mutex_unlock(&log_mx);
+	}
+	return 0;
+}
+
+/*
+ * log_emit	- write a line to the configured log right away
+ */
+static int
+log_emit(int level, const char *text)
+{
+	ATOMIC_ADD_FETCH(&log_written, 1);
+
 	if (false == ctx->syslog_open)
-		return log_put(mbuf);
+		return log_put(text);
 
 	if (level > GLOG_DEBUG)
 		level = GLOG_DEBUG;
 
 	level ^= LOG_TYPE;
 
-	syslog(level, "%s", mbuf);
+	syslog(level, "%s", text);
 
 	return 0;
 }
 
-int
-statstr(int level, const char *fmt, ...)
+/*
+ * log_ring	- the ring of the calling thread, created on the first use
+ */
+static log_ring_t *
+log_ring(void)
 {
-	char mbuf[MSGSZ] = { 0x00 };
-	va_list vap;
+	log_ring_t *ring;
 
-	if ((level & ctx->config.statlevel) == STATS_NONE) {
-		return 0;
+	ring = pthread_getspecific(log_key);
+	if (ring)
+		return ring;
+
+	ring = Malloc(sizeof(log_ring_t));
+	ring->head = 0;
+	ring->tail = 0;
+	ring->dead = 0;
+
+	pthread_mutex_lock(&log_rings_mx);
+	ring->next = log_rings;
+	log_rings = ring;
+	pthread_mutex_unlock(&log_rings_mx);
+
+	pthread_setspecific(log_key, ring);
+	return ring;
+}
+
+/*
+ * log_ring_exit	- the thread is gone, the writer frees the ring
+ * once it has been drained
+ */
+static void
+log_ring_exit(void *arg)
+{
+	ATOMIC_STORE(&((log_ring_t *)arg)->dead, 1);
+}
+
+/*
+ * log_batch	- add a line to the batch. Syslog takes the lines one
+ * by one, but only the writer thread waits for it.
+ */
+static void
+log_batch(log_slot_t *slot)
+{
+	static time_t last = 0;
+	static char timestr[DATESTRLEN];
+	int level;
+	int n;
+
+	ATOMIC_ADD_FETCH(&log_written, 1);
+
+	if (ctx->syslog_open) {
+		level = slot->level;
+		if (level > GLOG_DEBUG)
+			level = GLOG_DEBUG;
+		syslog(level ^ LOG_TYPE, "%s", slot->text);
+		return;
 	}
 
-	if (GLOG_NOTICE > ctx->config.loglevel) {
-		return 0;
+	/* the same timestamp as log_put(), formatted once a second */
+	if (slot->when != last) {
+		last = slot->when;
+		ctime_r(&last, timestr);
+		chomp(timestr);
 	}
+	if (log_batchlen + DATESTRLEN + MSGSZ + 2 > LOG_BATCH_SIZE)
+		log_batch_flush();
+	n = snprintf(log_batchbuf + log_batchlen, LOG_BATCH_SIZE - log_batchlen, "%s %s\n",
+	    timestr, slot->text);
+	log_batchlen += MIN(n, LOG_BATCH_SIZE - log_batchlen - 1);
+}
 
-	va_start(vap, fmt);
-	vsnprintf(mbuf, MSGSZ, fmt, vap);
-	va_end(vap);
+static void
+log_batch_flush(void)
+{
+	if (log_batchlen > 0) {
+		fwrite(log_batchbuf, 1, log_batchlen, stdout);
+		fflush(stdout);
+		log_batchlen = 0;
+	}
+}
 
-	if (ctx->config.flags & FLG_NODAEMON)
-		return log_put(mbuf);
+/*
+ * log_flush	- write out everything the threads have logged so far
+ */
+void
+log_flush(void)
+{
+	log_ring_t *ring, **ringp;
+	unsigned int head, tail;
+	uint64_t dropped;
+	char mbuf[MSGSZ];
+	int dead;
 
-	level = GLOG_NOTICE;
+	if (false == log_running)
+		return;
 
-	level ^= LOG_TYPE;
+	pthread_mutex_lock(&log_drain_mx);
+	pthread_mutex_lock(&log_rings_mx);
+	ringp = &log_rings;
+	while ((ring = *ringp)) {
+		/* a dead ring gets no more lines after this */
+		dead = ATOMIC_LOAD(&ring->dead);
+		head = ATOMIC_LOAD(&ring->head);
+		for (tail = ring->tail; tail != head; tail++)
+			log_batch(&ring->slot[tail % LOG_RING_SLOTS]);
+		ATOMIC_STORE(&ring->tail, tail);
+		if (dead) {
+			*ringp = ring->next;
+			Free(ring);
+		} else {
+			ringp = &ring->next;
+		}
+	}
+	pthread_mutex_unlock(&log_rings_mx);
+	log_batch_flush();
+
+	dropped = ATOMIC_LOAD(&log_dropped);
+	if (dropped != log_reported) {
+		snprintf(mbuf, MSGSZ, "log rings full, %llu lines dropped",
+		    (unsigned long long)(dropped - log_reported));
+		log_reported = dropped;
+		log_emit(GLOG_NOTICE, mbuf);
+	}
+	pthread_mutex_unlock(&log_drain_mx);
+}
 
-	syslog(level, "%s", mbuf);
+/*
+ * log_writer	- drain the log rings every LOG_FLUSH_TIME, or when a
+ * thread finds its ring half full
+ */
+static void *
+log_writer(void *arg)
+{
+	struct timespec now, interval, deadline;
+
+	mstotimespec(LOG_FLUSH_TIME, &interval);
+	for (;;) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		ts_sum(&deadline, &now, &interval);
+		pthread_mutex_lock(&log_mx);
+		ATOMIC_STORE(&log_sleeping, 1);
+		pthread_cond_timedwait(&log_cv, &log_mx, &deadline);
+		ATOMIC_STORE(&log_sleeping, 0);
+		pthread_mutex_unlock(&log_mx);
+
+		log_flush();
+	}
+	/* NOTREACHED */
+	return NULL;
+}
 
-	return 0;
+/*
+ * log_writer_init	- start logging through the writer thread
+ */
+void
+log_writer_init(void)
+{
+	if (pthread_key_create(&log_key, &log_ring_exit))
+		daemon_fatal("pthread_key_create");
+	create_thread(NULL, DETACH, &log_writer, NULL);
+	log_running = true;
+}
+
+/*
+ * querylog_admit	- apply querylog_sample and querylog_rate, true
+ * if the query should be logged
+ */
+bool
+querylog_admit(void)
+{
+	time_t now, second;
+	uint64_t seen;
+
+	seen = ATOMIC_FETCH_ADD(&querylog_seen, 1);
+	if (ctx->config.querylog_sample > 1 && seen % ctx->config.querylog_sample) {
+		ATOMIC_ADD_FETCH(&querylog_suppressed, 1);
+		return false;
+	}
+
+	if (ctx->config.querylog_rate > 0) {
+		now = time(NULL);
+		second = ATOMIC_LOAD(&querylog_second);
+		if (now != second && ATOMIC_CAS(&querylog_second, second, now))
+			ATOMIC_STORE(&querylog_count, 0);
+		if (ATOMIC_ADD_FETCH(&querylog_count, 1) > ctx->config.querylog_rate) {
+			ATOMIC_ADD_FETCH(&querylog_suppressed, 1);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * logging_stats	- describe the logging for the status report
+ */
+int
+logging_stats(char *buf, size_t len)
+{
+	return snprintf(buf, len, " written %llu dropped %llu querylog suppressed %llu",
+	    (unsigned long long)ATOMIC_LOAD(&log_written),
+	    (unsigned long long)ATOMIC_LOAD(&log_dropped),
+	    (unsigned long long)ATOMIC_LOAD(&querylog_suppressed));
 }
 
 void
@@ -117,6 +405,7 @@ daemon_shutdown(int return_code, const char *fmt, ...)
 
 	if (EXIT_NOERROR == return_code && (ctx->config.flags & FLG_CREATE_PIDFILE) && ctx->config.pidfile)
 		unlink(ctx->config.pidfile);
+	log_flush();
 	exit(return_code);
 }
 
@@ -500,6 +789,16 @@ Malloc(size_t size)
  */
 void *
 create_thread(thread_info_t *tinfo, int detach, void *(*routine) (void *), void *arg)
+{
+	return create_thread_stack(tinfo, detach, routine, arg, THREAD_STACK_SIZE);
+}
+
+/*
+ * create_thread_stack	- create_thread() with a given stack size
+ */
+void *
+create_thread_stack(thread_info_t *tinfo, int detach, void *(*routine) (void *), void *arg,
+    size_t stacksize)
 {
 	pthread_t *tid;
 	pthread_attr_t tattr;
@@ -516,7 +815,7 @@ create_thread(thread_info_t *tinfo, int detach, void *(*routine) (void *), void
 			daemon_fatal("pthread_attr_setdetachstate");
 	}
 
-	ret = pthread_attr_setstacksize(&tattr, THREAD_STACK_SIZE);
+	ret = pthread_attr_setstacksize(&tattr, stacksize);
 	if (ret)
 		daemon_fatal("pthread_attr_setstacksize");
 
@@ -567,33 +866,114 @@ date_fmt(char *msg, size_t len)
 }
 
 void
-register_check(thread_pool_t *pool, bool definitive)
+register_check(thread_pool_t *pool, bool definitive, int results, int cache, check_cost_t cost,
+    int min_weight, int max_weight)
 {
 	int i;
 	check_t *check;
+	check_stage_t *cs;
 
 	check = Malloc(sizeof(*check));
+	memset(check, 0, sizeof(*check));
 	check->pool = pool;
 	check->definitive = definitive;
+	check->results = results;
+	check->cache = cache;
+	check->cost = cost;
+	assert(min_weight <= 0 && max_weight >= 0);
+	check->min_weight = min_weight;
+	check->max_weight = max_weight;
+
+	/* the expensive checks wait for the rest unless configured otherwise */
+	check->stage = cost == COST_REMOTE ? 1 : 0;
+	for (cs = ctx->config.check_stages; cs; cs = cs->next)
+		if (strcmp(cs->name, pool->name) == 0)
+			check->stage = cs->stage;
 
 	for (i = 0; i < MAXCHECKS; i++)
 		if (NULL == ctx->checklist[i]) {
 			ctx->checklist[i] = check;
+			pool->check = i;
 			break;
 		}
 	if (i == MAXCHECKS)
 		logstr(GLOG_ERROR, "unable to register pool %s", pool->name);
 }
 
+/*
+ * compile_template	- split a response template at %reason%
+ */
+void
+compile_template(response_template_t *compiled, const char *template)
+{
+	char *reasonsubstitute;
+
+	compiled->prologue = strdup(template);
+	reasonsubstitute = strstr(compiled->prologue, REASONTEMPLATE);
+	if (NULL == reasonsubstitute) {
+		/* the reason is ignored */
+		compiled->epilogue = NULL;
+	} else {
+		/* null terminate the first part */
+		*reasonsubstitute = '\0';
+		compiled->epilogue = reasonsubstitute + strlen(REASONTEMPLATE);
+	}
+}
+
+/*
+ * expand_template	- write the response into result
+ */
 char *
-ipstr(struct sockaddr_in *saddr)
+expand_template(char *result, size_t len, const response_template_t *template, const char *reason)
+{
+	if (NULL == template->epilogue)
+		snprintf(result, len, "%s", template->prologue);
+	else
+		snprintf(result, len, "%s%s%s", template->prologue, reason, template->epilogue);
+	result[len - 1] = '\0';
+
+	return result;
+}
+
+/*
+ * template_iov	- point iov at the pieces of the response instead of
+ * copying them, returns the number of buffers used (at most 3)
+ */
+int
+template_iov(struct iovec *iov, const response_template_t *template, const char *reason)
+{
+	iov[0].iov_base = template->prologue;
+	iov[0].iov_len = strlen(template->prologue);
+	if (NULL == template->epilogue)
+		return 1;
+	iov[1].iov_base = (void *)reason;
+	iov[1].iov_len = strlen(reason);
+	iov[2].iov_base = template->epilogue;
+	iov[2].iov_len = strlen(template->epilogue);
+	return 3;
+}
+
+/*
+ * ipstr_r	- format the address of a client into buf of at least
+ * INET_ADDRSTRLEN bytes
+ */
+char *
+ipstr_r(struct sockaddr *saddr, char *buf)
+{
+	/* the clients of a unix socket are local */
+	if (AF_UNIX == saddr->sa_family)
+		strncpy(buf, "local", INET_ADDRSTRLEN);
+	else if (inet_ntop(AF_INET, &((struct sockaddr_in *)saddr)->sin_addr, buf, INET_ADDRSTRLEN) == NULL)
+		strncpy(buf, "UNKNOWN", INET_ADDRSTRLEN);
+	return buf;
+}
+
+char *
+ipstr(struct sockaddr *saddr)
 {
 	char ipstr[INET_ADDRSTRLEN];
 
-	if (inet_ntop(AF_INET, &saddr->sin_addr, ipstr, INET_ADDRSTRLEN) == NULL) {
-		strncpy(ipstr, "UNKNOWN\0", INET_ADDRSTRLEN);
-	}
-	return strdup(ipstr);
+	return strdup(ipstr_r(saddr, ipstr));
 }
 
 /*
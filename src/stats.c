@@ -20,6 +20,7 @@
 
 #include "common.h"
 #include "srvutils.h"
+#include "worker.h"
 
 void
 init_stats()
@@ -249,6 +250,11 @@ log_stats()
 
 	statstr(STATS_DNSBL, "%s", dnsbl_stats(buf, TMP_BUF_SIZE));
 
+	if ((ctx->config.statlevel & STATS_LATENCY) != STATS_NONE) {
+		trace_stats();
+		pool_latency_stats();
+	}
+
 
 	return stats;
 }
@@ -24,8 +24,10 @@
 #include "msgqueue.h"
 
 /* prototypes of internals */
-int recv_config_sync(peer_t *peer);
+int recv_config_sync(peer_t *peer, rbuf_t *rb);
+static int send_sync_msg(peer_t *peer, int type, void *body, size_t len);
 static void *syncmgr(void *arg);
+static void *sync_sender(void *arg);
 int send_update_msg_as_oper_sync(void *arg);
 
 
@@ -141,6 +143,30 @@ send_update_to_peer(peer_t *peer, void *ptr, int size)
 }
 
 
+/*
+ * send_sync_msg	- send the prologue and the body with one writev()
+ */
+static int
+send_sync_msg(peer_t *peer, int type, void *body, size_t len)
+{
+	sync_msg_t prologue;
+	struct iovec iov[2];
+	int ret;
+
+	prologue.type = htonl(type);
+	prologue.length = htonl(len);
+	iov[0].iov_base = &prologue;
+	iov[0].iov_len = sizeof(sync_msg_t);
+	iov[1].iov_base = body;
+	iov[1].iov_len = len;
+
+	pthread_mutex_lock(&(peer->peer_in_mutex));
+	ret = writevn(peer->connected, iov, 2);
+	pthread_mutex_unlock(&(peer->peer_in_mutex));
+
+	return ret;
+}
+
 int
 send_sync_config(peer_t *peer, sync_config_t *sync)
 {
@@ -153,39 +179,56 @@ send_sync_config(peer_t *peer, sync_config_t *sync)
 int
 send_startup_sync(peer_t *peer, startup_sync_t *sync)
 {
-	sync_msg_t prologue;
-	char buf[sizeof(sync_msg_t) + sizeof(startup_sync_t)] = { 0x00 };
 	startup_sync_t tmp = sston(*sync);
 
-	prologue.type = htonl(STARTUP_SYNC);
-	prologue.length = htonl(sizeof(startup_sync_t));
-
-	memcpy(buf, &prologue, sizeof(sync_msg_t));
-	memcpy(buf + sizeof(sync_msg_t), &tmp, sizeof(startup_sync_t));
-	return send_update_to_peer(peer, buf, sizeof(sync_msg_t) + sizeof(startup_sync_t));
+	return send_sync_msg(peer, STARTUP_SYNC, &tmp, sizeof(startup_sync_t));
 }
 
 int
 send_oper_sync(peer_t *peer, oper_sync_t *sync)
 {
-	sync_msg_t prologue;
-	char buf[sizeof(sync_msg_t) + sizeof(oper_sync_t)] = { 0x00 };
+	sync->digest = dton(sync->digest);
+	return send_sync_msg(peer, OPER_SYNC, sync, sizeof(oper_sync_t));
+}
 
-	prologue.type = htonl(OPER_SYNC);
-	prologue.length = htonl(sizeof(oper_sync_t));
+/*
+ * queue_oper_sync	- have the digest sent to the peer. Never waits:
+ * if the peer does not keep up, the oldest updates are dropped.
+ */
+int
+queue_oper_sync(sha_256_t digest)
+{
+	oper_sync_t os;
 
-	sync->digest = dton(sync->digest);
-	memcpy(buf, &prologue, sizeof(sync_msg_t));
-	memcpy(buf + sizeof(sync_msg_t), sync, sizeof(oper_sync_t));
-	return send_update_to_peer(peer, buf, sizeof(sync_msg_t) + sizeof(oper_sync_t));
+	os.digest = digest;
+	return put_msg_nowait(ctx->sync_q, &os, sizeof(os));
+}
+
+/*
+ * sync_sender	- write the queued oper syncs to the peer, so that the
+ * threads answering the queries do not wait for the network
+ */
+static void *
+sync_sender(void *arg)
+{
+	oper_sync_t os;
+	size_t size;
+
+	for (;;) {
+		size = get_msg(ctx->sync_q, &os, sizeof(os));
+		if (size != sizeof(os))
+			continue;
+		if (connected(&(ctx->config.peer)))
+			send_oper_sync(&(ctx->config.peer), &os);
+	}
+	/* NOTREACHED */
+	return NULL;
 }
 
 int
 send_update_msg_as_oper_sync(void *arg)
 {
 	update_message_t *update;
-	sync_msg_t prologue;
-	char buf[sizeof(sync_msg_t) + sizeof(oper_sync_t)] = { 0x00 };
 	sha_256_t digest;
 	oper_sync_t os;
 
@@ -194,14 +237,8 @@ send_update_msg_as_oper_sync(void *arg)
 
 	if (update->mtype == UPDATE) {
 		memcpy(&digest, update->mtext, sizeof(sha_256_t));
-
-		prologue.type = htonl(OPER_SYNC);
-		prologue.length = htonl(sizeof(oper_sync_t));
-
 		os.digest = dton(digest);
-		memcpy(buf, &prologue, sizeof(sync_msg_t));
-		memcpy(buf + sizeof(sync_msg_t), &os, sizeof(oper_sync_t));
-		return send_update_to_peer(&ctx->config.peer, buf, sizeof(sync_msg_t) + sizeof(oper_sync_t));
+		return send_sync_msg(&ctx->config.peer, OPER_SYNC, &os, sizeof(oper_sync_t));
 	}
 
 	return 0;
@@ -223,29 +260,35 @@ recv_syncs(void *arg)
 {
 	int ret;
 	peer_t *peer = &(ctx->config.peer);
+	rbuf_t *rb;
 
 	assert(peer);
 
 	/* logstr(GLOG_INFO, "Startup syncer started: %s", peer->peer_name); */
 
+	/* the messages are read in big chunks, this thread is the only reader */
+	rb = Malloc(sizeof(rbuf_t));
+	rbuf_init(rb, peer->connected);
+
 	/* Ensure config first. Does not return on failure */
 
-	recv_config_sync(peer);
+	recv_config_sync(peer, rb);
 
 	while (TRUE) {
-		ret = recv_sync_msg(peer);
+		ret = recv_sync_msg(peer, rb);
 		/* logstr(GLOG_DEBUG, "Recv returned %d", ret); */
 		if (0x00 == ret) {
+			Free(rb);
 			return NULL;
 		}
 	}
 }
 
 int
-recv_sync_msg(peer_t *peer)
+recv_sync_msg(peer_t *peer, rbuf_t *rb)
 {
 	sync_msg_t msg = { -1 };
-	int ret = readn(peer->connected, &msg, sizeof(msg));
+	int ret = rbuf_readn(rb, &msg, sizeof(msg));
 	update_message_t update;
 
 	if (ERROR == ret) {
@@ -263,11 +306,11 @@ recv_sync_msg(peer_t *peer)
 	switch (ntohl(msg.type)) {
 	case STARTUP_SYNC:
 		/* logstr(GLOG_DEBUG, "Recv startup sync"); */
-		return recv_startup_sync(peer);
+		return recv_startup_sync(peer, rb);
 		break;
 	case OPER_SYNC:
 		logstr(GLOG_DEBUG, "Recv oper sync");
-		return recv_oper_sync(peer);
+		return recv_oper_sync(peer, rb);
 		break;
 	case AGGREGATE_SYNC:
 		logstr(GLOG_INFO, "Startup sync received. Syncing aggregate");
@@ -291,10 +334,10 @@ recv_sync_msg(peer_t *peer)
 }
 
 int
-recv_startup_sync(peer_t *peer)
+recv_startup_sync(peer_t *peer, rbuf_t *rb)
 {
 	startup_sync_t msg = { -1 };
-	int ret = readn(peer->connected, &msg, sizeof(msg));
+	int ret = rbuf_readn(rb, &msg, sizeof(msg));
 	update_message_t update;
 
 	if (ret != sizeof(msg))
@@ -320,10 +363,10 @@ recv_startup_sync(peer_t *peer)
 }
 
 int
-recv_oper_sync(peer_t *peer)
+recv_oper_sync(peer_t *peer, rbuf_t *rb)
 {
 	oper_sync_t msg;
-	int ret = readn(peer->connected, &msg, sizeof(msg));
+	int ret = rbuf_readn(rb, &msg, sizeof(msg));
 	update_message_t update;
 
 	if (ERROR == ret) {
@@ -345,10 +388,10 @@ recv_oper_sync(peer_t *peer)
 }
 
 int
-recv_config_sync(peer_t *peer)
+recv_config_sync(peer_t *peer, rbuf_t *rb)
 {
 	sync_config_t msg;
-	int ret = readn(peer->connected, &msg, sizeof(msg));
+	int ret = rbuf_readn(rb, &msg, sizeof(msg));
 
 	if (ERROR == ret) {
 		/* error */
@@ -426,6 +469,7 @@ synchronize(peer_t *peer, int syncfd)
 	update_message_t rotatecmd;
 	struct sockaddr_in receive;
 	struct sockaddr_in sync_out;
+	rbuf_t *rb;
 
 	peer->peerfd_out = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -519,10 +563,13 @@ synchronize(peer_t *peer, int syncfd)
 		RELEASE_SYNC_GUARD();
 
 		logstr(GLOG_INFO, "Sent filters. Waiting for oper syncs");
+		rb = Malloc(sizeof(rbuf_t));
+		rbuf_init(rb, peer->peerfd_in);
 		do {
-			ret = recv_sync_msg(peer);
+			ret = recv_sync_msg(peer, rb);
 			/* logstr(GLOG_DEBUG, "Recv returned %d", ret); */
 		} while (0x00 != ret);
+		Free(rb);
 	}
 
 	/* NOTREACHED */
@@ -569,6 +616,13 @@ syncmgr(void *arg)
 void
 syncmgr_init()
 {
+	ctx->sync_q = get_queue();
+	if (ctx->sync_q < 0)
+		daemon_fatal("get_queue");
+	if (set_queue_limit(ctx->sync_q, SYNC_QUEUE_LEN, OVERFLOW_DROP_OLDEST, 0, NULL) < 0)
+		daemon_fatal("set_queue_limit");
+	create_thread(NULL, DETACH, &sync_sender, NULL);
+
 	ACTIVATE_SYNC_GUARD();
 	create_thread(&ctx->process_parts.syncmgr, DETACH, &syncmgr, NULL);
 }
@@ -22,6 +22,14 @@
  * This files implements thread pools. They are self contained groups
  * threads which automatically handle adding new threads to the pools
  * and removing idling threads from the pools.
+ *
+ * Pools created with limits->shared set have no threads of their own.
+ * Their jobs are run by the shared executor, a fixed set of worker
+ * threads. Every worker has a deque of tokens, one for each job queued
+ * to a pool. A worker takes the newest token from its own deque, or
+ * steals the oldest one from another worker, and then runs the next
+ * job of that pool. The jobs themselves stay in the pool's work queue,
+ * so the queue limits apply as with dedicated pools.
  */
 
 #include "common.h"
@@ -33,11 +41,57 @@
 
 /* internals */
 static void *thread_pool(void *arg);
-void edict_reference(edict_t *edict);
+static bool spawn_allowed(pool_ctx_t *pool_ctx);
+static void drop_job(void *msgp);
+static void abandon_job(pool_ctx_t *pool_ctx, edict_t *edict);
+static void *executor_thread(void *arg);
+static void executor_push(pool_ctx_t *pool_ctx);
+static pool_ctx_t *executor_pop(executor_worker_t *worker);
+static pool_ctx_t *executor_steal(executor_worker_t *worker);
+static void executor_run(executor_worker_t *worker, pool_ctx_t *pool_ctx);
+static void executor_watchdog(void);
 
 /* macros */
 #define POOL_MUTEX_LOCK { pthread_mutex_lock(pool_ctx->mx); }
 #define POOL_MUTEX_UNLOCK { pthread_mutex_unlock(pool_ctx->mx); }
+#define WORKER_LOCK(w) { assert(pthread_mutex_lock(&(w)->mx) == 0); }
+#define WORKER_UNLOCK(w) { pthread_mutex_unlock(&(w)->mx); }
+#define EXECUTOR_LOCK { assert(pthread_mutex_lock(&executor->mx) == 0); }
+#define EXECUTOR_UNLOCK { pthread_mutex_unlock(&executor->mx); }
+
+static executor_t *executor = NULL;
+static pool_ctx_t *pools[MAXPOOLS];	/* every pool, for the status report */
+static int npools = 0;
+static pthread_mutex_t pools_mx = PTHREAD_MUTEX_INITIALIZER;
+#define POOLS_LOCK { pthread_mutex_lock(&pools_mx); }
+#define POOLS_UNLOCK { pthread_mutex_unlock(&pools_mx); }
+static pthread_key_t executor_key;	/* executor_worker_t of the running thread */
+
+/*
+ * spawn_allowed	- token bucket for thread creation, the caller
+ *			  must hold the pool mutex
+ */
+static bool
+spawn_allowed(pool_ctx_t *pool_ctx)
+{
+	struct timespec now;
+
+	if (0 == pool_ctx->spawn_rate)
+		return true;
+
+	clock_gettime(CLOCK_TYPE, &now);
+	pool_ctx->spawn_budget += ms_diff(&now, &pool_ctx->last_spawn) * pool_ctx->spawn_rate / 1000.0;
+	pool_ctx->last_spawn = now;
+	/* allow bursts of a second's worth */
+	if (pool_ctx->spawn_budget > pool_ctx->spawn_rate)
+		pool_ctx->spawn_budget = pool_ctx->spawn_rate;
+
+	if (pool_ctx->spawn_budget < 1.0)
+		return false;
+
+	pool_ctx->spawn_budget -= 1.0;
+	return true;
+}
 
 static void *
 thread_pool(void *arg)
@@ -52,6 +106,7 @@ thread_pool(void *arg)
 	struct timespec now;
 	int waited;
 	int lastseenms;
+	struct timespec started;
 
 	pool_ctx = (pool_ctx_t *)arg;
 	assert(pool_ctx->mx);
@@ -108,9 +163,27 @@ thread_pool(void *arg)
 				}
 			}
 
-			if (pool_ctx->count_thread > 8 && pool_ctx->ewma_idle > pool_ctx->count_thread / 2) {
+			/*
+			 * Hysteresis: the pool has a surplus once more than half
+			 * of the threads idle on average, and it lasts until less
+			 * than a quarter do. Threads retire only after the surplus
+			 * has lasted idle_time, one per IDLETIME.
+			 */
+			if (pool_ctx->ewma_idle > pool_ctx->count_thread / 2.0) {
+				if (!pool_ctx->surplus) {
+					pool_ctx->surplus = true;
+					pool_ctx->surplus_since = now;
+				}
+			} else if (pool_ctx->ewma_idle < pool_ctx->count_thread / 4.0) {
+				pool_ctx->surplus = false;
+			}
+
+			if (pool_ctx->surplus && pool_ctx->count_thread > pool_ctx->min_thread
+			    && pool_ctx->count_thread > 1
+			    && ms_diff(&now, &pool_ctx->surplus_since) >= pool_ctx->idle_time) {
 				/* prepare for shutdown */
 				pool_ctx->count_thread--;
+				pool_ctx->retired++;
 				/*
 				 * update the moving average by decrementing it
 				 * brutal, but efficient for the purpose
@@ -151,7 +224,7 @@ thread_pool(void *arg)
 
 		/* wait for new jobs */
 		ret =
-		    get_msg_timed(pool_ctx->info->work_queue_id, &message, sizeof(message.edict),
+		    get_msg_timed(pool_ctx->info->work_queue_id, &message, sizeof(message),
 		    IDLETIME);
 
 		POOL_MUTEX_LOCK;
@@ -175,9 +248,16 @@ thread_pool(void *arg)
 				/* We were the last idling thread, start another */
 				if (pool_ctx->count_thread <= pool_ctx->max_thread
 				    || 0 == pool_ctx->max_thread) {
-					logstr(GLOG_DEBUG, "threadpool '%s' starting another thread",
-					    pool_ctx->info->name);
-					create_thread(NULL, DETACH, &thread_pool, pool_ctx);
+					if (spawn_allowed(pool_ctx)) {
+						logstr(GLOG_DEBUG, "threadpool '%s' starting another thread",
+						    pool_ctx->info->name);
+						pool_ctx->spawned++;
+						create_thread(NULL, DETACH, &thread_pool, pool_ctx);
+					} else {
+						/* the next free thread tries again */
+						logstr(GLOG_DEBUG, "threadpool '%s': spawn rate limit reached",
+						    pool_ctx->info->name);
+					}
 				} else {
 					logstr(GLOG_ERROR,
 					    "threadpool '%s': maximum thread count (%d) reached",
@@ -187,12 +267,23 @@ thread_pool(void *arg)
 			}
 			POOL_MUTEX_UNLOCK;
 
+			/* nobody waits for the result of an expired job */
+			if (process && edict_cancelled(edict)) {
+				logstr(GLOG_DEBUG, "threadpool '%s': job expired before it was run",
+				    pool_ctx->info->name);
+				ATOMIC_ADD_FETCH(&pool_ctx->expired, 1);
+				process = false;
+			}
+
 			/* run the routine with args */
 			if (process) {
+				clock_gettime(CLOCK_TYPE, &started);
+				latency_add(&pool_ctx->wait, us_diff(&started, &message.queued));
 				pool_ctx->routine(pool_ctx->info, &thread_ctx, edict);
-			} else if (edict->resultmq >= 0) {
-				/* failed, and we can inform the caller */
-				send_result(edict, NULL);
+				clock_gettime(CLOCK_TYPE, &now);
+				latency_add(&pool_ctx->run, us_diff(&now, &started));
+			} else {
+				abandon_job(pool_ctx, edict);
 			}
 
 			/* we are done */
@@ -204,6 +295,297 @@ thread_pool(void *arg)
 	}
 }
 
+/*
+ * executor_init	- start the shared executor with nthreads workers
+ */
+void
+executor_init(int nthreads, mseconds_t watchdog_time)
+{
+	executor_worker_t *worker;
+	int i;
+
+	assert(NULL == executor);
+	assert(nthreads > 0);
+
+	executor = Malloc(sizeof(executor_t));
+	memset(executor, 0, sizeof(executor_t));
+	pthread_mutex_init(&executor->mx, NULL);
+	pthread_cond_init(&executor->cv, NULL);
+	executor->nworkers = nthreads;
+	executor->watchdog_time = watchdog_time;
+	clock_gettime(CLOCK_TYPE, &executor->last_check);
+
+	if (pthread_key_create(&executor_key, NULL))
+		daemon_fatal("pthread_key_create");
+
+	executor->workers = Malloc(nthreads * sizeof(executor_worker_t));
+	memset(executor->workers, 0, nthreads * sizeof(executor_worker_t));
+
+	for (i = 0; i < nthreads; i++) {
+		worker = &executor->workers[i];
+		pthread_mutex_init(&worker->mx, NULL);
+		worker->size = 64;
+		worker->tokens = Malloc(worker->size * sizeof(pool_ctx_t *));
+		worker->id = i;
+	}
+
+	logstr(GLOG_DEBUG, "starting the shared executor with %d threads", nthreads);
+	for (i = 0; i < nthreads; i++)
+		create_thread_stack(NULL, DETACH, &executor_thread, &executor->workers[i],
+		    EXECUTOR_STACK_SIZE);
+}
+
+/*
+ * executor_push	- hand out a token for a job queued to the pool
+ */
+static void
+executor_push(pool_ctx_t *pool_ctx)
+{
+	executor_worker_t *worker;
+	pool_ctx_t **tokens;
+	int i;
+
+	/* our own deque if called from a worker, round robin otherwise */
+	worker = pthread_getspecific(executor_key);
+	if (NULL == worker) {
+		EXECUTOR_LOCK;
+		worker = &executor->workers[executor->next++ % executor->nworkers];
+		EXECUTOR_UNLOCK;
+	}
+
+	WORKER_LOCK(worker);
+	if (worker->count == worker->size) {
+		/* full, unwrap into a twice as large deque */
+		tokens = Malloc(2 * worker->size * sizeof(pool_ctx_t *));
+		for (i = 0; i < worker->count; i++)
+			tokens[i] = worker->tokens[(worker->head + i) % worker->size];
+		Free(worker->tokens);
+		worker->tokens = tokens;
+		worker->head = 0;
+		worker->size *= 2;
+	}
+	worker->tokens[(worker->head + worker->count) % worker->size] = pool_ctx;
+	worker->count++;
+	WORKER_UNLOCK(worker);
+
+	/* see executor_thread() why this can not miss a sleeping worker */
+	EXECUTOR_LOCK;
+	if (executor->sleeping > 0)
+		pthread_cond_signal(&executor->cv);
+	EXECUTOR_UNLOCK;
+}
+
+/*
+ * executor_pop		- take the newest token from the worker's own deque
+ */
+static pool_ctx_t *
+executor_pop(executor_worker_t *worker)
+{
+	pool_ctx_t *pool_ctx = NULL;
+
+	WORKER_LOCK(worker);
+	if (worker->count > 0) {
+		worker->count--;
+		pool_ctx = worker->tokens[(worker->head + worker->count) % worker->size];
+	}
+	WORKER_UNLOCK(worker);
+
+	return pool_ctx;
+}
+
+/*
+ * executor_steal	- take the oldest token from another worker
+ */
+static pool_ctx_t *
+executor_steal(executor_worker_t *worker)
+{
+	executor_worker_t *victim;
+	pool_ctx_t *pool_ctx = NULL;
+	int i;
+
+	for (i = 1; i < executor->nworkers && NULL == pool_ctx; i++) {
+		victim = &executor->workers[(worker->id + i) % executor->nworkers];
+		WORKER_LOCK(victim);
+		if (victim->count > 0) {
+			pool_ctx = victim->tokens[victim->head];
+			victim->head = (victim->head + 1) % victim->size;
+			victim->count--;
+		}
+		WORKER_UNLOCK(victim);
+	}
+
+	return pool_ctx;
+}
+
+/*
+ * executor_run		- run the next job of the pool
+ */
+static void
+executor_run(executor_worker_t *worker, pool_ctx_t *pool_ctx)
+{
+	edict_message_t message;
+	edict_t *edict;
+	thread_ctx_t *thread_ctx;
+	struct timespec started, now;
+	bool requeue;
+	int ret;
+
+	/* max_thread limits the jobs of the pool running at the same time */
+	POOL_MUTEX_LOCK;
+	if (pool_ctx->max_thread && pool_ctx->count_thread >= pool_ctx->max_thread) {
+		/* a finishing job hands the token back out */
+		pool_ctx->deferred++;
+		POOL_MUTEX_UNLOCK;
+		return;
+	}
+	pool_ctx->count_thread++;
+	POOL_MUTEX_UNLOCK;
+
+	ret = get_msg_timed(pool_ctx->info->work_queue_id, &message, sizeof(message), -1);
+	if (ret <= 0) {
+		/* the job was dropped from a full queue */
+		goto DONE;
+	}
+
+	edict = message.edict;
+	assert(edict->job);
+
+	thread_ctx = worker->thread_ctx[pool_ctx->index];
+	if (NULL == thread_ctx) {
+		thread_ctx = Malloc(sizeof(thread_ctx_t));
+		memset(thread_ctx, 0, sizeof(thread_ctx_t));
+		worker->thread_ctx[pool_ctx->index] = thread_ctx;
+	}
+
+	if (edict_cancelled(edict)) {
+		logstr(GLOG_DEBUG, "executor thread #%d: job for '%s' expired before it was run",
+		    worker->id, pool_ctx->info->name);
+		ATOMIC_ADD_FETCH(&pool_ctx->expired, 1);
+		abandon_job(pool_ctx, edict);
+		edict_unlink(edict);
+		goto DONE;
+	}
+
+	logstr(GLOG_DEBUG, "executor thread #%d processing for '%s'", worker->id, pool_ctx->info->name);
+
+	WORKER_LOCK(worker);
+	clock_gettime(CLOCK_TYPE, &worker->watchdog.last_seen);
+	worker->busy = true;
+	WORKER_UNLOCK(worker);
+
+	clock_gettime(CLOCK_TYPE, &started);
+	latency_add(&pool_ctx->wait, us_diff(&started, &message.queued));
+	pool_ctx->routine(pool_ctx->info, thread_ctx, edict);
+	clock_gettime(CLOCK_TYPE, &now);
+	latency_add(&pool_ctx->run, us_diff(&now, &started));
+
+	WORKER_LOCK(worker);
+	worker->busy = false;
+	WORKER_UNLOCK(worker);
+
+	edict_unlink(edict);
+
+DONE:
+	POOL_MUTEX_LOCK;
+	pool_ctx->count_thread--;
+	requeue = pool_ctx->deferred > 0;
+	if (requeue)
+		pool_ctx->deferred--;
+	POOL_MUTEX_UNLOCK;
+
+	if (requeue)
+		executor_push(pool_ctx);
+}
+
+/*
+ * executor_watchdog	- interrupt workers stuck in a job, at most once in IDLETIME
+ */
+static void
+executor_watchdog(void)
+{
+	executor_worker_t *worker;
+	struct timespec now;
+	int lastseenms;
+	int i;
+
+	if (0 == executor->watchdog_time)
+		return;
+
+	/* someone else is checking */
+	if (pthread_mutex_trylock(&executor->mx))
+		return;
+
+	clock_gettime(CLOCK_TYPE, &now);
+	if (ms_diff(&now, &executor->last_check) > IDLETIME) {
+		executor->last_check = now;
+		for (i = 0; i < executor->nworkers; i++) {
+			worker = &executor->workers[i];
+			WORKER_LOCK(worker);
+			lastseenms = ms_diff(&now, &worker->watchdog.last_seen);
+			if (worker->busy && lastseenms > executor->watchdog_time) {
+				logstr(GLOG_WARNING, "executor thread #%d stuck, last seen %d ms ago.",
+				    worker->id, lastseenms);
+				pthread_kill(worker->watchdog.tid, SIGALRM);
+			}
+			WORKER_UNLOCK(worker);
+		}
+	}
+	EXECUTOR_UNLOCK;
+}
+
+static void *
+executor_thread(void *arg)
+{
+	executor_worker_t *worker;
+	pool_ctx_t *pool_ctx;
+	struct timespec now, timeout, abstime;
+	bool pending;
+	int i;
+
+	worker = (executor_worker_t *)arg;
+	worker->watchdog.tid = pthread_self();
+	pthread_setspecific(executor_key, worker);
+
+	logstr(GLOG_DEBUG, "executor thread #%d starting", worker->id);
+
+	for (;;) {
+		pool_ctx = executor_pop(worker);
+		if (NULL == pool_ctx)
+			pool_ctx = executor_steal(worker);
+
+		if (pool_ctx) {
+			executor_run(worker, pool_ctx);
+		} else {
+			/*
+			 * Look once more while holding the executor mutex.
+			 * executor_push() takes the mutex after adding
+			 * a token, so either we see the token or the pusher
+			 * sees us sleeping and signals.
+			 */
+			EXECUTOR_LOCK;
+			pending = false;
+			for (i = 0; i < executor->nworkers && false == pending; i++) {
+				WORKER_LOCK(&executor->workers[i]);
+				pending = executor->workers[i].count > 0;
+				WORKER_UNLOCK(&executor->workers[i]);
+			}
+			if (false == pending) {
+				clock_gettime(CLOCK_REALTIME, &now);
+				mstotimespec(IDLETIME, &timeout);
+				ts_sum(&abstime, &now, &timeout);
+				executor->sleeping++;
+				pthread_cond_timedwait(&executor->cv, &executor->mx, &abstime);
+				executor->sleeping--;
+			}
+			EXECUTOR_UNLOCK;
+		}
+
+		executor_watchdog();
+	}
+	/* NOTREACHED */
+	return NULL;
+}
+
 thread_pool_t *
 create_thread_pool(const char *name, int (*routine) (thread_pool_t *, thread_ctx_t *, edict_t *),
     pool_limits_t *limits, void *arg)
@@ -211,7 +593,9 @@ create_thread_pool(const char *name, int (*routine) (thread_pool_t *, thread_ctx
 	thread_pool_t *pool;
 	pthread_mutex_t *pool_mx;
 	pool_ctx_t *pool_ctx;
+	pool_size_t *ps;
 	int ret;
+	int i;
 
 	/* init */
 	pool = (thread_pool_t *)Malloc(sizeof(thread_pool_t));
@@ -223,6 +607,7 @@ create_thread_pool(const char *name, int (*routine) (thread_pool_t *, thread_ctx
 
 	pool->arg = arg;
 	pool->name = name;
+	pool->check = -1;
 
 	pool_mx = (pthread_mutex_t *) Malloc(sizeof(pthread_mutex_t));
 	ret = pthread_mutex_init(pool_mx, NULL);
@@ -230,6 +615,7 @@ create_thread_pool(const char *name, int (*routine) (thread_pool_t *, thread_ctx
 		daemon_fatal("pthread_mutex_init");
 
 	pool_ctx = (pool_ctx_t *)Malloc(sizeof(pool_ctx_t));
+	memset(pool_ctx, 0, sizeof(pool_ctx_t));
 
 	pool_ctx->mx = pool_mx;
 	pool_ctx->routine = routine;
@@ -237,63 +623,223 @@ create_thread_pool(const char *name, int (*routine) (thread_pool_t *, thread_ctx
 	pool_ctx->count_thread = 0;
 	pool_ctx->count_idle = 0;
 	pool_ctx->ewma_idle = 0;
-	pool_ctx->max_thread = limits ? limits->max_thread : 0;
 	pool_ctx->watchdog_time = limits ? limits->watchdog_time : 0;	/* watchdog timer, 0 is disabled */
 	pool_ctx->wdlist = NULL;
 
-	/* start the first thread */
-	create_thread(NULL, DETACH, &thread_pool, pool_ctx);
+	/* pools without limits, ie. the protocol pools, get the defaults */
+	if (limits) {
+		pool_ctx->max_thread = limits->max_thread;
+		pool_ctx->min_thread = limits->min_thread;
+		pool_ctx->idle_time = limits->idle_time;
+		pool_ctx->spawn_rate = limits->spawn_rate;
+	} else {
+		pool_ctx->max_thread = 0;
+		pool_ctx->min_thread = ctx->config.pool_minthreads;
+		pool_ctx->idle_time = ctx->config.pool_idle_time;
+		pool_ctx->spawn_rate = ctx->config.pool_spawn_rate;
+	}
+	for (ps = ctx->config.pool_sizes; ps; ps = ps->next)
+		if (strcmp(ps->name, name) == 0) {
+			pool_ctx->min_thread = ps->min_thread;
+			pool_ctx->max_thread = ps->max_thread;
+		}
+	if (pool_ctx->max_thread && pool_ctx->min_thread > pool_ctx->max_thread)
+		pool_ctx->min_thread = pool_ctx->max_thread;
+	pool_ctx->spawn_budget = pool_ctx->spawn_rate;
+	clock_gettime(CLOCK_TYPE, &pool_ctx->last_spawn);
+
+	if (limits && limits->queue_len > 0) {
+		ret = set_queue_limit(pool->work_queue_id, limits->queue_len, limits->queue_policy,
+		    limits->queue_timeout, &drop_job);
+		if (ret < 0)
+			daemon_fatal("set_queue_limit");
+	}
+
+	pool->pool_ctx = pool_ctx;
+	pool_ctx->shared = false;
+	pool_ctx->index = -1;
+	pool_ctx->deferred = 0;
+
+	POOLS_LOCK;
+	if (npools < MAXPOOLS)
+		pools[npools++] = pool_ctx;
+	POOLS_UNLOCK;
+
+	if (limits && limits->shared && executor) {
+		/* the executor runs the jobs */
+		EXECUTOR_LOCK;
+		if (executor->npools < MAXPOOLS) {
+			pool_ctx->shared = true;
+			pool_ctx->index = executor->npools++;
+		}
+		EXECUTOR_UNLOCK;
+		if (pool_ctx->shared)
+			return pool;
+		logstr(GLOG_WARNING, "threadpool '%s': too many pools for the executor", name);
+	}
+
+	/* start the warm threads, at least one */
+	i = 0;
+	do {
+		POOL_MUTEX_LOCK;
+		pool_ctx->spawned++;
+		POOL_MUTEX_UNLOCK;
+		create_thread(NULL, DETACH, &thread_pool, pool_ctx);
+	} while (++i < pool_ctx->min_thread);
+
 	return pool;
 }
 
- /*
+/*
+ * pool_stats	- describe the pools for the status report
+ */
+int
+pool_stats(char *buf, size_t len)
+{
+	pool_ctx_t *pool_ctx;
+	size_t used = 0;
+	int i;
+
+	*buf = '\0';
+	POOLS_LOCK;
+	for (i = 0; i < npools && used < len; i++) {
+		pool_ctx = pools[i];
+		POOL_MUTEX_LOCK;
+		if (pool_ctx->shared)
+			snprintf(buf + used, len - used, " %s: running %d deferred %d expired %llu",
+			    pool_ctx->info->name, pool_ctx->count_thread, pool_ctx->deferred,
+			    (unsigned long long)ATOMIC_LOAD(&pool_ctx->expired));
+		else
+			snprintf(buf + used, len - used,
+			    " %s: threads %d idle %d spawned %llu retired %llu expired %llu",
+			    pool_ctx->info->name, pool_ctx->count_thread, pool_ctx->count_idle,
+			    (unsigned long long)pool_ctx->spawned, (unsigned long long)pool_ctx->retired,
+			    (unsigned long long)ATOMIC_LOAD(&pool_ctx->expired));
+		POOL_MUTEX_UNLOCK;
+		used = strlen(buf);
+	}
+	POOLS_UNLOCK;
+
+	return used;
+}
+
+/*
+ * pool_latency_stats	- log the queue wait and run time histograms of
+ * the pools and start them over
+ */
+void
+pool_latency_stats(void)
+{
+	pool_ctx_t *pool_ctx;
+	latency_t wait, run;
+	char waitstr[TMP_BUF_SIZE], runstr[TMP_BUF_SIZE];
+	int i;
+
+	POOLS_LOCK;
+	for (i = 0; i < npools; i++) {
+		pool_ctx = pools[i];
+		latency_take(&pool_ctx->wait, &wait);
+		latency_take(&pool_ctx->run, &run);
+		if (0 == wait.count)
+			continue;
+		latency_format(&wait, waitstr, sizeof(waitstr));
+		latency_format(&run, runstr, sizeof(runstr));
+		statstr(STATS_LATENCY, "grossd latency of %s [us] (wait: %s) (run: %s)",
+		    pool_ctx->info->name, waitstr, runstr);
+	}
+	POOLS_UNLOCK;
+}
+
+/*
  * edict_reference     - add a reference to an edict
  */
 void
 edict_reference(edict_t *edict)
 {
-       int ret;
-
-       /* increment reference counter */
-       ret = pthread_mutex_lock(&edict->reference.mx);
-       assert(0 == ret);
-       edict->reference.count++;
-       ret = pthread_mutex_unlock(&edict->reference.mx);
-       assert(0 == ret);
+	int ret;
+
+	ret = REFERENCE_TAKE(&edict->reference);
+	assert(ret > 1);
+}
+
+/*
+ * abandon_job	- the job will not be run. Tell the caller, if it
+ * wants results, and drop the reference the job was holding.
+ */
+static void
+abandon_job(pool_ctx_t *pool_ctx, edict_t *edict)
+{
+	if (edict->results.size > 0)
+		result_fail(edict, pool_ctx ? pool_ctx->info : NULL);
+	if (edict->release)
+		edict->release(edict->job);
+}
+
+/*
+ * drop_job	- called by the message queue for jobs dropped from
+ * a full work queue, fail the job as if the pool were exhausted
+ */
+static void
+drop_job(void *msgp)
+{
+	edict_t *edict;
+
+	edict = ((edict_message_t *)msgp)->edict;
+	abandon_job(NULL, edict);
+	edict_unlink(edict);
 }
 
 /*
- * submit_job	- add a job request to the work queue
+ * submit_job	- add a job request to the work queue. Returns -1
+ * with errno EAGAIN if the work queue is full.
  */
 int
 submit_job(thread_pool_t *pool, edict_t *edict)
 {
+	edict_message_t message;
+	int ret;
+
 	/* increment reference counter */
 	edict_reference(edict);
 
 	/* send the pointer */
-	return put_msg(pool->work_queue_id, &edict, sizeof(edict_t *));
+	message.edict = edict;
+	clock_gettime(CLOCK_TYPE, &message.queued);
+	ret = put_msg(pool->work_queue_id, &message, sizeof(message));
+	if (ret < 0) {
+		/* the job was not queued, the caller still holds a reference */
+		logstr(GLOG_DEBUG, "threadpool '%s': work queue full, job rejected", pool->name);
+		edict_unlink(edict);
+	} else if (pool->pool_ctx->shared) {
+		executor_push(pool->pool_ctx);
+	}
+	return ret;
 }
 
 /*
- * edict_get	- convenience function for creating an edict
+ * edict_get	- convenience function for creating an edict, nresults
+ * is the number of result slots to reserve (0 if results are not wanted)
  */
 edict_t *
-edict_get(bool forget)
+edict_get(int nresults)
 {
 	edict_t *edict;
+	completion_t *c;
 
 	edict = (edict_t *)Malloc(sizeof(edict_t));
 	bzero(edict, sizeof(edict_t));
 
-	/* reserve a message queue, if results are wanted */
-	if (false == forget)
-		edict->resultmq = get_queue();
-	else
-		edict->resultmq = -1;
+	c = &edict->results;
+	if (nresults > 0) {
+		c->slot = Malloc(nresults * sizeof(chkresult_t));
+		bzero(c->slot, nresults * sizeof(chkresult_t));
+		c->size = nresults;
+		pthread_mutex_init(&c->mx, NULL);
+		pthread_cond_init(&c->cv, NULL);
+	}
 
-	pthread_mutex_init(&edict->reference.mx, NULL);
-	edict->reference.count = 1;
+	pthread_mutex_init(&edict->cancel.mx, NULL);
+	REFERENCE_INIT(&edict->reference);
 
 	return edict;
 }
@@ -302,41 +848,220 @@ void
 edict_unlink(edict_t *edict)
 {
 	int ret;
-	poolresult_message_t message;
+	int i;
+	completion_t *c;
 
-	ret = pthread_mutex_lock(&edict->reference.mx);
-	assert(0 == ret);
-	assert(edict->reference.count > 0);
+	ret = REFERENCE_DROP(&edict->reference);
+	assert(ret >= 0);
 
-	if (--edict->reference.count == 0) {
+	if (ret == 0) {
 		/* last reference */
-		if (edict->resultmq > 0)
-			while (release_queue(edict->resultmq) < 0) {
-				/* queue wasn't emtpy */
-				logstr(GLOG_INSANE, "queue not empty, flushing");
-				ret = get_msg_timed(edict->resultmq, &message, sizeof(message.result), -1);
-				if (ret > 0) {
-					assert(message.result);
-					free((chkresult_t *)message.result);
-					message.result = NULL;
-				}
-			}
-		pthread_mutex_unlock(&edict->reference.mx);
+		if (edict->observer)
+			edict->observer(edict, NULL);
+		c = &edict->results;
+		if (c->size > 0) {
+			/* free the results nobody waited for */
+			for (i = 0; i < c->size; i++)
+				if (c->slot[i].reason)
+					Free(c->slot[i].reason);
+			Free(c->slot);
+			pthread_mutex_destroy(&c->mx);
+			pthread_cond_destroy(&c->cv);
+		}
+		assert(NULL == edict->cancel.hooks);
+		pthread_mutex_destroy(&edict->cancel.mx);
 		Free(edict);
-	} else {
-		pthread_mutex_unlock(&edict->reference.mx);
 	}
 }
 
+/*
+ * edict_deadline	- set the absolute deadline of the jobs, timelimit
+ * milliseconds after start (CLOCK_TYPE)
+ */
 void
-send_result(edict_t *edict, void *result)
+edict_deadline(edict_t *edict, const struct timespec *start, mseconds_t timelimit)
 {
-	int ret;
-	poolresult_message_t message;
+	struct timespec timeout;
+
+	mstotimespec(timelimit, &timeout);
+	ts_sum(&edict->deadline, start, &timeout);
+}
+
+/*
+ * edict_timeleft	- milliseconds left before the deadline, 0 if it
+ * has passed. An edict without a deadline never runs out of time.
+ */
+mseconds_t
+edict_timeleft(edict_t *edict)
+{
+	struct timespec now;
+	int left;
+
+	if (0 == edict->deadline.tv_sec && 0 == edict->deadline.tv_nsec)
+		return INT_MAX;
+	clock_gettime(CLOCK_TYPE, &now);
+	left = ms_diff(&edict->deadline, &now);
+	return left > 0 ? left : 0;
+}
+
+/*
+ * edict_cancelled	- true if nobody waits for the results any more,
+ * either because the edict was cancelled or its deadline has passed
+ */
+bool
+edict_cancelled(edict_t *edict)
+{
+	if (ATOMIC_LOAD(&edict->cancel.cancelled))
+		return true;
+	return 0 == edict_timeleft(edict);
+}
+
+/*
+ * edict_cancel	- tell the running jobs to give up, and wake up
+ * those sleeping on a registered hook
+ */
+void
+edict_cancel(edict_t *edict)
+{
+	cancel_hook_t *hook;
+
+	pthread_mutex_lock(&edict->cancel.mx);
+	ATOMIC_STORE(&edict->cancel.cancelled, 1);
+	for (hook = edict->cancel.hooks; hook; hook = hook->next)
+		hook->wakeup(hook->arg);
+	pthread_mutex_unlock(&edict->cancel.mx);
+}
+
+/*
+ * cancel_register	- run hook->wakeup if the edict is cancelled
+ * before cancel_unregister(). The hook runs at once if the edict has
+ * already been cancelled. The hook must not block.
+ */
+void
+cancel_register(edict_t *edict, cancel_hook_t *hook)
+{
+	pthread_mutex_lock(&edict->cancel.mx);
+	if (ATOMIC_LOAD(&edict->cancel.cancelled))
+		hook->wakeup(hook->arg);
+	hook->next = edict->cancel.hooks;
+	edict->cancel.hooks = hook;
+	pthread_mutex_unlock(&edict->cancel.mx);
+}
+
+/*
+ * cancel_unregister	- remove the hook, it is not run after this
+ */
+void
+cancel_unregister(edict_t *edict, cancel_hook_t *hook)
+{
+	cancel_hook_t **hookp;
+
+	pthread_mutex_lock(&edict->cancel.mx);
+	for (hookp = &edict->cancel.hooks; *hookp; hookp = &(*hookp)->next)
+		if (*hookp == hook) {
+			*hookp = hook->next;
+			break;
+		}
+	pthread_mutex_unlock(&edict->cancel.mx);
+}
+
+/*
+ * result_reserve	- hand out a result slot. The slots are sized
+ * by the caller of edict_get(), running out of them is a bug. The
+ * slot is tagged with the check of the pool, if any.
+ */
+chkresult_t *
+result_reserve(edict_t *edict, thread_pool_t *pool)
+{
+	chkresult_t *result;
+	int i;
+
+	i = ATOMIC_FETCH_ADD(&edict->results.reserved, 1);
+	assert(i < edict->results.size);
+	result = &edict->results.slot[i];
+	result->check = pool ? pool->check : -1;
+	return result;
+}
+
+/*
+ * result_publish	- mark a reserved slot ready and wake up the
+ * waiter if it is sleeping
+ */
+void
+result_publish(edict_t *edict, chkresult_t *result)
+{
+	completion_t *c = &edict->results;
+
+	if (edict->observer)
+		edict->observer(edict, result);
+	ATOMIC_STORE(&result->state, SLOT_READY);
+	ATOMIC_ADD_FETCH(&c->published, 1);
+	if (ATOMIC_LOAD(&c->waiting)) {
+		pthread_mutex_lock(&c->mx);
+		pthread_cond_signal(&c->cv);
+		pthread_mutex_unlock(&c->mx);
+	}
+}
+
+/*
+ * result_fail	- tell the waiter a job never ran
+ */
+void
+result_fail(edict_t *edict, thread_pool_t *pool)
+{
+	chkresult_t *result;
+
+	result = result_reserve(edict, pool);
+	result->failed = true;
+	result_publish(edict, result);
+}
+
+/*
+ * result_take	- return the first published but not consumed slot
+ */
+static chkresult_t *
+result_take(completion_t *c)
+{
+	int i, reserved;
+
+	if (ATOMIC_LOAD(&c->published) == c->consumed)
+		return NULL;
+
+	reserved = MIN(ATOMIC_LOAD(&c->reserved), c->size);
+	for (i = 0; i < reserved; i++)
+		if (ATOMIC_LOAD(&c->slot[i].state) == SLOT_READY) {
+			c->slot[i].state = SLOT_CONSUMED;
+			c->consumed++;
+			return &c->slot[i];
+		}
+	/* NOTREACHED */
+	return NULL;
+}
+
+/*
+ * result_wait	- wait for the next result until the deadline
+ * (CLOCK_REALTIME). Returns NULL if the deadline passed. Only one
+ * thread may wait for the results of an edict.
+ */
+chkresult_t *
+result_wait(edict_t *edict, const struct timespec *deadline)
+{
+	completion_t *c = &edict->results;
+	chkresult_t *result;
+	int ret = 0;
+
+	assert(c->size > 0);
+
+	result = result_take(c);
+	if (result)
+		return result;
 
-	message.result = result;
+	pthread_mutex_lock(&c->mx);
+	ATOMIC_STORE(&c->waiting, 1);
+	while (NULL == (result = result_take(c)) && ret != ETIMEDOUT)
+		ret = pthread_cond_timedwait(&c->cv, &c->mx, deadline);
+	ATOMIC_STORE(&c->waiting, 0);
+	pthread_mutex_unlock(&c->mx);
 
-	ret = put_msg(edict->resultmq, &message, sizeof(message));
-	if (ret < 0)
-		gerror("send_result");
+	return result;
 }
@@ -18,6 +18,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <poll.h>
+
 #include "common.h"
 #include "utils.h"
 
@@ -114,26 +116,181 @@ writen(int fd, const void *vptr, size_t n)
 	return n;
 }
 
+/*
+ * writevn	- write all the buffers of an iovec to a descriptor. The
+ * iovec is consumed on the way. A non-blocking descriptor is waited
+ * for at most WRITEVN_TIMEOUT at a time.
+ */
+ssize_t
+writevn(int fd, struct iovec *iov, int iovcnt)
+{
+	struct pollfd pfd;
+	size_t n = 0;
+	ssize_t nwritten;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		n += iov[i].iov_len;
+
+	while (iovcnt > 0) {
+		if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+			if (errno == EINTR)
+				continue;	/* and call writev() again */
+			if (nwritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				pfd.fd = fd;
+				pfd.events = POLLOUT;
+				if (poll(&pfd, 1, WRITEVN_TIMEOUT) > 0)
+					continue;
+			}
+			return -1;	/* error */
+		}
+		/* skip what was written */
+		while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+			nwritten -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + nwritten;
+			iov->iov_len -= nwritten;
+		}
+	}
+	return n;
+}
+
+/*
+ * rbuf_init	- start reading a descriptor through a buffer
+ */
+void
+rbuf_init(rbuf_t *rb, int fd)
+{
+	rb->fd = fd;
+	rb->start = 0;
+	rb->end = 0;
+}
+
+/*
+ * rbuf_fill	- read as much as fits in the buffer with a single read().
+ * The data consumed is dropped first, so the pointers returned by
+ * rbuf_line() are not valid after this. Returns what read() returned.
+ */
+ssize_t
+rbuf_fill(rbuf_t *rb)
+{
+	ssize_t n;
+
+	if (rb->start > 0) {
+		memmove(rb->buf, rb->buf + rb->start, rb->end - rb->start);
+		rb->end -= rb->start;
+		rb->start = 0;
+	}
+	do {
+		n = read(rb->fd, rb->buf + rb->end, RBUFSZ - rb->end);
+	} while (n < 0 && EINTR == errno);
+	if (n > 0)
+		rb->end += n;
+	return n;
+}
+
+/*
+ * rbuf_line	- the next line in the buffer without the line terminator
+ * (\n or \r\n), or NULL if there is no complete line. A line longer
+ * than the buffer is cut in pieces like readline() does.
+ */
+char *
+rbuf_line(rbuf_t *rb, size_t *len)
+{
+	char *line, *end;
+
+	line = rb->buf + rb->start;
+	end = memchr(line, '\n', rb->end - rb->start);
+	if (end) {
+		rb->start = end - rb->buf + 1;
+		if (end > line && '\r' == end[-1])
+			end--;
+	} else if (0 == rb->start && RBUFSZ == rb->end) {
+		/* a full buffer without a newline */
+		end = rb->buf + RBUFSZ;
+		rb->start = RBUFSZ;
+	} else {
+		return NULL;
+	}
+	*end = '\0';
+	if (len)
+		*len = end - line;
+	return line;
+}
+
+/*
+ * rbuf_readline	- the blocking counterpart of rbuf_line(), returns
+ * like readline()
+ */
+int
+rbuf_readline(rbuf_t *rb, char **line)
+{
+	ssize_t n;
+
+	while (NULL == (*line = rbuf_line(rb, NULL))) {
+		n = rbuf_fill(rb);
+		if (n < 0)
+			return ERROR;	/* error, errno set by read() */
+		if (0 == n) {
+			if (rb->start == rb->end)
+				return EMPTY;	/* EOF, no data read */
+			/* EOF, some data read */
+			rb->buf[rb->end] = '\0';
+			*line = rb->buf + rb->start;
+			rb->start = rb->end;
+			break;
+		}
+	}
+	return DATA;
+}
+
+/*
+ * rbuf_readn	- the buffered counterpart of readn()
+ */
+ssize_t
+rbuf_readn(rbuf_t *rb, void *vptr, size_t n)
+{
+	size_t nleft, chunk;
+	ssize_t nread;
+	char *ptr;
+
+	ptr = vptr;
+	nleft = n;
+	while (nleft > 0) {
+		if (rb->start == rb->end) {
+			if ((nread = rbuf_fill(rb)) < 0)
+				return -1;
+			else if (nread == 0)
+				break;
+		}
+		chunk = rb->end - rb->start;
+		if (chunk > nleft)
+			chunk = nleft;
+		memcpy(ptr, rb->buf + rb->start, chunk);
+		rb->start += chunk;
+		nleft -= chunk;
+		ptr += chunk;
+	}
+
+	return n - nleft;
+}
+
 /* 
  * writet	- write a terminated string to a descriptor
  */
 ssize_t
 writet(int fd, const char *line, const char *terminator)
 {
-	char *str;
-	size_t linelen;
-	size_t len;
-
-	linelen = strlen(line) + strlen(terminator) + 1;
-	str = malloc(linelen);
-	if (!str) {
-		gerror("malloc");
-		return -1;
-	}
-	snprintf(str, linelen, "%s%s", line, terminator);
-	len = writen(fd, str, linelen - 1);
-	Free(str);
-	return len;
+	struct iovec iov[2];
+
+	iov[0].iov_base = (void *)line;
+	iov[0].iov_len = strlen(line);
+	iov[1].iov_base = (void *)terminator;
+	iov[1].iov_len = strlen(terminator);
+	return writevn(fd, iov, 2);
 }
 
 /* 
@@ -208,6 +365,15 @@ ms_diff(struct timespec *t1, struct timespec *t2)
 	return (t1->tv_sec - t2->tv_sec) * SI_KILO + (t1->tv_nsec - t2->tv_nsec) / SI_MEGA;
 }
 
+/*
+ * us_diff	- as ms_diff, in microseconds
+ */
+int
+us_diff(struct timespec *t1, struct timespec *t2)
+{
+	return (t1->tv_sec - t2->tv_sec) * SI_MEGA + (t1->tv_nsec - t2->tv_nsec) / SI_KILO;
+}
+
 /*
  * ts_sum	- calculate sum of t1 and t2 and save result in sum
  */
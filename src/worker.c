@@ -18,6 +18,9 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdarg.h>
+#include <sys/time.h>
+
 #include "common.h"
 #include "srvutils.h"
 #include "syncmgr.h"
@@ -28,6 +31,8 @@
 
 #include "msgqueue.h"
 #include "worker.h"
+#include "checkcache.h"
+#include "qlog.h"
 #include "utils.h"
 
 /* these are implemented in worker_*.c */
@@ -35,9 +40,61 @@ void postfix_server_init();
 void sjsms_server_init();
 void milter_server_init();
 
+/* the results of the checks combined so far */
+typedef struct
+{
+	judgment_t judgment;
+	int susp_weight;
+	int checks_running;
+	int definitives_running;
+	/*
+	 * definitive is set when there is no need to wait for the rest
+	 * of the checks. We must wait all the definitive checks to complete,
+	 * that is all tests which can return a STATUS_TRUST or STATUS_BLOCK
+	 * response.
+	 */
+	bool definitive;
+	char *reasonstr;
+	int block_threshold;
+	int grey_threshold;
+	int *room;		/* the weight each check may still add */
+	int headroom;		/* sum of room */
+	int *drop;		/* the weight each check may still take away, <= 0 */
+	int footroom;		/* sum of drop */
+	int definitives_left;	/* definitive checks not returned, started or not */
+} tally_t;
+
+/* where the results of a check come from */
+typedef enum
+{
+	SOURCE_JOB = 0,		/* a job of our own */
+	SOURCE_CACHE,
+	SOURCE_FLIGHT,		/* the job of another request */
+} source_t;
+
+typedef struct
+{
+	source_t source;
+	cached_result_t *results;	/* SOURCE_CACHE */
+	int count;
+} check_source_t;
+
+/* the flights an edict leads, indexed by check */
+typedef struct
+{
+	int count;
+	flight_t **flight;
+} flights_t;
+
+/* latency of the stages of the queries, see trace_mark() */
+static latency_t trace_latency[TRACE_STAGES];
+static const char *trace_names[TRACE_STAGES] =
+    { "parse", "hash", "bloom", "submit", "checks", "verdict", "respond" };
+static uint64_t querylog_lines = 0;	/* atomic, for querylog_trace */
+
 /* internals */
 void update_counters(int status);
-char *grey_mask(char *ipstr);
+int grey_mask(unsigned char *addr, const char *ipstr);
 
 /*
  * destructor for client_info_t
@@ -62,39 +119,32 @@ request_unlink(grey_tuple_t *request)
 {
 	int ret;
 
-	ret = pthread_mutex_lock(&request->reference.mx);
 	assert(request);
-	assert(0 == ret);
-	assert(request->reference.count > 0);
-
-	request->reference.count = request->reference.count - 1;
-	if (request->reference.count == 0) {
-		/* last reference */
-		if (request->sender)
-			Free(request->sender);
-		if (request->recipient)
-			Free(request->recipient);
-		if (request->client_address)
-			Free(request->client_address);
-		if (request->helo_name)
-			Free(request->helo_name);
-		pthread_mutex_unlock(&request->reference.mx);
-		Free(request);
-	} else {
-		pthread_mutex_unlock(&request->reference.mx);
+	ret = REFERENCE_DROP(&request->reference);
+	assert(ret >= 0);
+
+	if (ret == 0) {
+		/* last reference, the request itself lives in the arena */
+		arena_destroy(request->arena);
 	}
 }
 
+/*
+ * request_new	- create a request in its own arena. Everything allocated
+ * for the request is released in one step by the last request_unlink().
+ */
 grey_tuple_t *
 request_new()
 {
 	grey_tuple_t *request;
+	arena_t *arena;
 
-	request = Malloc(sizeof(grey_tuple_t));
+	arena = arena_create(REQUEST_ARENA_SIZE);
+	request = arena_alloc(arena, sizeof(grey_tuple_t));
 	bzero(request, sizeof(grey_tuple_t));
+	request->arena = arena;
 
-	pthread_mutex_init(&request->reference.mx, NULL);
-	request->reference.count = 1;
+	REFERENCE_INIT(&request->reference);
 
 	return request;
 }
@@ -104,58 +154,93 @@ request_reference(grey_tuple_t *request)
 {
 	int ret;
 
-	ret = pthread_mutex_lock(&request->reference.mx);
-	assert(0 == ret);
-	request->reference.count++;
-	ret = pthread_mutex_unlock(&request->reference.mx);
-	assert(0 == ret);
+	ret = REFERENCE_TAKE(&request->reference);
+	assert(ret > 1);
 }
 
+/*
+ * release_request	- drop the reference of a check job that was
+ * never run, see edict->release
+ */
+static void
+release_request(void *job)
+{
+	request_unlink((grey_tuple_t *)job);
+}
 
-char *
-grey_mask(char *ipstr)
+
+/*
+ * grey_mask	- parse ipstr and apply grey_mask (or grey_mask6) to it.
+ * The masked address is stored in addr in network order, addr must
+ * hold 16 bytes. Returns the address family, or -1 on error.
+ */
+int
+grey_mask(unsigned char *addr, const char *ipstr)
 {
-	int ret;
 	unsigned int ip, net, mask;
-	const char *ptr = NULL;
-	char masked[INET_ADDRSTRLEN] = { '\0' };
 	struct in_addr inaddr;
-
-	/*
-	 * apply checkmask to the ip 
-	 */
-	if (strlen(ipstr) > INET_ADDRSTRLEN) {
-		logstr(GLOG_NOTICE, "invalid ipaddress: %s", ipstr);
-		return NULL;
-	}
-
-	ret = inet_pton(AF_INET, ipstr, &inaddr);
-	switch (ret) {
-	case -1:
-		logstr(GLOG_ERROR, "test_tuple: inet_pton: %s", strerror(errno));
-		return NULL;
-		break;
-	case 0:
-		logstr(GLOG_ERROR, "not a valid ip address: %s", ipstr);
-		return NULL;
-		break;
+	int i, bits;
+
+	if (inet_pton(AF_INET, ipstr, &inaddr) == 1) {
+		ip = inaddr.s_addr;
+
+		/* this is 0xffffffff ^ (2 ** (32 - mask - 1) - 1) */
+		mask = 0xffffffff ^ ((1 << (32 - ctx->config.grey_mask)) - 1);
+
+		/* ip is in network order */
+		net = ip & htonl(mask);
+		memcpy(addr, &net, 4);
+		return AF_INET;
+	} else if (inet_pton(AF_INET6, ipstr, addr) == 1) {
+		bits = ctx->config.grey_mask6;
+		for (i = 0; i < 16; i++, bits -= 8) {
+			if (bits <= 0)
+				addr[i] = 0;
+			else if (bits < 8)
+				addr[i] &= 0xff << (8 - bits);
+		}
+		return AF_INET6;
 	}
 
-	/* case default */
-	ip = inaddr.s_addr;
+	logstr(GLOG_ERROR, "not a valid ip address: %s", ipstr);
+	return -1;
+}
 
-	/* this is 0xffffffff ^ (2 ** (32 - mask - 1) - 1) */
-	mask = 0xffffffff ^ ((1 << (32 - ctx->config.grey_mask)) - 1);
+/*
+ * format_ipv4	- dotted quad of an address in network order, as
+ * inet_ntop() would print it
+ */
+static void
+format_ipv4(char *buf, const unsigned char *addr)
+{
+	int i;
+	unsigned int octet;
+
+	for (i = 0; i < 4; i++) {
+		octet = addr[i];
+		if (octet >= 100)
+			*buf++ = '0' + octet / 100;
+		if (octet >= 10)
+			*buf++ = '0' + octet / 10 % 10;
+		*buf++ = '0' + octet % 10;
+		*buf++ = i < 3 ? '.' : '\0';
+	}
+}
 
-	/* ip is in network order */
-	net = ip & htonl(mask);
+/*
+ * tuple_feed	- feed a string to the compatible tuple hash, which
+ * is capped like the snprintf() into a MSGSZ buffer used to be
+ */
+static void
+tuple_feed(sha256_state_t *state, const char *str, size_t *room)
+{
+	size_t len;
 
-	ptr = inet_ntop(AF_INET, &net, masked, INET_ADDRSTRLEN);
-	if (!ptr) {
-		logstr(GLOG_ERROR, "test_tuple: inet_ntop: %s", strerror(errno));
-		return NULL;
-	}
-	return strdup(masked);
+	if (NULL == str)
+		str = "(null)";
+	len = MIN(strlen(str), *room);
+	sha256_update(state, str, len);
+	*room -= len;
 }
 
 void
@@ -194,38 +279,419 @@ static const char *domain_part(const char *email)
 	return p + 1;
 }
 
-int
-test_tuple(final_status_t *final, grey_tuple_t *request, tmout_action_t *ta)
+/*
+ * tuple_digest	- hash the greylisting tuple without building it as a
+ * string. In the compatible format the digest is the hash of
+ * "masked_ip first second", truncated to MSGSZ - 1 characters.
+ */
+static int
+tuple_digest(sha_256_t *digest, grey_tuple_t *request)
+{
+	sha256_state_t state;
+	unsigned char addr[16];
+	char ipstr[INET6_ADDRSTRLEN];
+	const char *first, *second;
+	unsigned char family;
+	size_t room;
+	int af;
+
+	af = grey_mask(addr, request->client_address);
+	if (af < 0)
+		return -1;
+
+	if (ctx->config.grey_tuple == GREY_TUPLE_SERVER) {
+		first = domain_part(request->sender);
+		second = request->helo_name;
+	} else {
+		first = request->sender;
+		second = request->recipient;
+	}
+
+	sha256_init(&state);
+	if (ctx->config.tuple_format == TUPLE_FORMAT_BINARY) {
+		/* the family, the masked address and nul terminated strings */
+		family = af == AF_INET ? 4 : 6;
+		sha256_update(&state, &family, 1);
+		sha256_update(&state, addr, af == AF_INET ? 4 : 16);
+		sha256_update(&state, first, strlen(first) + 1);
+		if (second)
+			sha256_update(&state, second, strlen(second) + 1);
+	} else {
+		if (af == AF_INET)
+			format_ipv4(ipstr, addr);
+		else
+			inet_ntop(AF_INET6, addr, ipstr, INET6_ADDRSTRLEN);
+		room = MSGSZ - 1;
+		tuple_feed(&state, ipstr, &room);
+		tuple_feed(&state, " ", &room);
+		tuple_feed(&state, first, &room);
+		tuple_feed(&state, " ", &room);
+		tuple_feed(&state, second, &room);
+	}
+	*digest = sha256_final(&state);
+
+	return 0;
+}
+
+/*
+ * cache_key	- the part of the request the results of a check depend on
+ */
+static const char *
+cache_key(check_t *check, grey_tuple_t *request)
+{
+	const char *at;
+	const char *helo;
+	char *key;
+	size_t len;
+
+	if (check->cache == CACHE_SENDER_DOMAIN) {
+		/* the last '@', like rhsbl */
+		if (NULL == request->sender)
+			return "";
+		at = strrchr(request->sender, '@');
+		return at ? at + 1 : "";
+	}
+	if (check->cache == CACHE_CLIENT_HELO) {
+		helo = request->helo_name ? request->helo_name : "";
+		len = strlen(request->client_address) + strlen(helo) + 2;
+		key = arena_alloc(request->arena, len);
+		snprintf(key, len, "%s %s", request->client_address, helo);
+		return key;
+	}
+	return request->client_address;
+}
+
+/*
+ * prefetchable	- true if the request already has the part the
+ * results of the check depend on
+ */
+static bool
+prefetchable(check_t *check, grey_tuple_t *request)
+{
+	switch (check->cache) {
+	case CACHE_CLIENT_ADDRESS:
+		return request->client_address != NULL;
+	case CACHE_CLIENT_HELO:
+		return request->client_address != NULL && request->helo_name != NULL;
+	case CACHE_SENDER_DOMAIN:
+		return request->sender != NULL;
+	default:
+		return false;
+	}
+}
+
+/*
+ * observe_result	- pass the results of the checks to the flights
+ * the edict leads, and release the flights with the edict
+ */
+static void
+observe_result(edict_t *edict, chkresult_t *result)
+{
+	flights_t *flights;
+	int i;
+
+	flights = (flights_t *)edict->observer_arg;
+	if (result) {
+		if (result->check >= 0 && result->check < flights->count
+		    && flights->flight[result->check])
+			flight_result(flights->flight[result->check], result);
+	} else {
+		for (i = 0; i < flights->count; i++)
+			if (flights->flight[i])
+				flight_release(flights->flight[i]);
+		Free(flights);
+	}
+}
+
+/*
+ * flights_followed	- true if other requests wait for the checks
+ * the edict runs
+ */
+static bool
+flights_followed(flights_t *flights)
+{
+	int i;
+
+	if (NULL == flights)
+		return false;
+	for (i = 0; i < flights->count; i++)
+		if (flights->flight[i] && flight_followed(flights->flight[i]))
+			return true;
+	return false;
+}
+
+/*
+ * weight_verdict	- the status a weight leads to, unless a check
+ * returns a definitive judgment
+ */
+static int
+weight_verdict(tally_t *tally, int weight)
+{
+	if (tally->block_threshold > 0 && weight >= tally->block_threshold)
+		return STATUS_BLOCK;
+	if (weight >= tally->grey_threshold)
+		return STATUS_GREY;
+	return STATUS_TRUST;
+}
+
+/*
+ * tally_finish	- a check has returned, it can not add more weight
+ */
+static void
+tally_finish(tally_t *tally, int check)
+{
+	if (check < 0)
+		return;
+	tally->headroom -= tally->room[check];
+	tally->room[check] = 0;
+	tally->footroom -= tally->drop[check];
+	tally->drop[check] = 0;
+	if (ctx->checklist[check]->definitive) {
+		tally->definitives_running--;
+		tally->definitives_left--;
+	}
+}
+
+/*
+ * tally_settle	- see if we have a definitive result so far
+ */
+static void
+tally_settle(tally_t *tally)
+{
+	/*
+	 * That is,
+	 * 1.  we have a whitelist match, or
+	 * 2a. all the definitive checks have returned, and
+	 * 2b. susp_weight > grey_threshold, or
+	 * 2c. the final weight, between the least and the most the
+	 *     rest of the checks may add, does not cross a threshold
+	 * broken up for readability 
+	 */
+	if (tally->judgment == J_PASS) {
+		tally->definitive = true;
+	} else if (0 == tally->definitives_running) {
+		if (tally->block_threshold != 0 && tally->susp_weight >= tally->block_threshold)
+			tally->definitive = true;
+		else if (tally->block_threshold == 0
+		    && tally->susp_weight >= tally->grey_threshold)
+			tally->definitive = true;
+		else if (0 == tally->definitives_left
+		    && weight_verdict(tally, tally->susp_weight + tally->footroom) ==
+		    weight_verdict(tally, tally->susp_weight + tally->headroom))
+			tally->definitive = true;
+	}
+}
+
+/*
+ * tally_result	- add a check result to the combined judgment
+ */
+static void
+tally_result(final_status_t *final, tally_t *tally, chkresult_t *result)
+{
+	int weight;
+
+	logstr(GLOG_INSANE,
+	    "Received a check result, check = %s, judgment = %d, weight = %d",
+	    result->checkname, result->judgment, result->weight);
+	/* update the judgment */
+	tally->judgment = MAX(tally->judgment, result->judgment);
+	tally->susp_weight += result->weight;
+
+	/* update querylog entry */
+	if (result->judgment != J_UNDEFINED)
+		record_match(final, result);
+
+	if (result->reason)
+		tally->reasonstr = arena_strdup(final->arena, result->reason);
+
+	/* what is left of the maximum and minimum weight of the check */
+	if (result->check >= 0) {
+		weight = MIN(MAX(result->weight, 0), tally->room[result->check]);
+		tally->room[result->check] -= weight;
+		tally->headroom -= weight;
+		weight = MAX(MIN(result->weight, 0), tally->drop[result->check]);
+		tally->drop[result->check] -= weight;
+		tally->footroom -= weight;
+	}
+
+	/* was this a final result from the check? */
+	if (!result->wait) {
+		tally->checks_running--;
+		if (result->check >= 0)
+			tally_finish(tally, result->check);
+		else if (result->definitive)
+			tally->definitives_running--;
+	}
+
+	tally_settle(tally);
+}
+
+/*
+ * run_stage	- start the checks of a stage. The results of a cacheable
+ * check may be in the cache, or another request may be running the
+ * same job already. Otherwise a job is submitted.
+ */
+static void
+run_stage(int stage, edict_t *edict, final_status_t *final, grey_tuple_t *request,
+    tally_t *tally, check_source_t *sources, flights_t *flights)
+{
+	check_t *check;
+	flight_t *flight;
+	const char *key;
+	chkresult_t cached;
+	int i, j;
+
+	for (i = 0; ctx->checklist[i]; i++) {
+		check = ctx->checklist[i];
+		if (check->stage != stage || check->cache == CACHE_NONE)
+			continue;
+		key = cache_key(check, request);
+		sources[i].count = checkcache_lookup(request->arena, i, key, &sources[i].results);
+		if (sources[i].count >= 0) {
+			sources[i].source = SOURCE_CACHE;
+			continue;
+		}
+		flight = flight_join(i, key, check->results, edict);
+		if (flight)
+			flights->flight[i] = flight;
+		else
+			sources[i].source = SOURCE_FLIGHT;
+	}
+
+	for (i = 0; ctx->checklist[i]; i++) {
+		check = ctx->checklist[i];
+		if (check->stage != stage)
+			continue;
+		if (sources[i].source != SOURCE_JOB) {
+			tally->checks_running++;
+			if (check->definitive)
+				tally->definitives_running++;
+			continue;
+		}
+		request_reference(request);
+		if (submit_job(check->pool, edict) < 0) {
+			/*
+			 * the check is overloaded, treat it as J_UNDEFINED
+			 * and do not wait for it
+			 */
+			request_unlink(request);
+			if (flights && flights->flight[i])
+				flight_abort(flights->flight[i]);
+		} else {
+			tally->checks_running++;
+			if (check->definitive)
+				tally->definitives_running++;
+		}
+	}
+
+	/* the cached results count as if the checks had returned */
+	for (i = 0; ctx->checklist[i]; i++) {
+		if (ctx->checklist[i]->stage != stage || sources[i].source != SOURCE_CACHE)
+			continue;
+		for (j = 0; j < sources[i].count; j++) {
+			memset(&cached, 0, sizeof(cached));
+			cached.check = i;
+			cached.definitive = sources[i].results[j].definitive;
+			cached.wait = sources[i].results[j].wait;
+			cached.weight = sources[i].results[j].weight;
+			cached.judgment = sources[i].results[j].judgment;
+			cached.reason = sources[i].results[j].reason;
+			cached.checkname = sources[i].results[j].checkname;
+			tally_result(final, tally, &cached);
+		}
+	}
+}
+
+/* 
+ * wait_results	- wait until a definitive result arrives, every check
+ * started so far has returned or timeout is reached. The deadlines are
+ * absolute for the condition variable. Returns the timeouts left.
+ */
+static tmout_action_t *
+wait_results(edict_t *edict, final_status_t *final, grey_tuple_t *request, tally_t *tally,
+    tmout_action_t *ta, struct timespec *base, struct timespec *start)
+{
+	chkresult_t *result;
+	struct timespec now, deadline, timeout;
+	mseconds_t timeused;
+
+	mstotimespec(ta->timeout, &timeout);
+	ts_sum(&deadline, base, &timeout);
+
+	while (tally->definitive == false && tally->checks_running > 0 && ta) {
+		result = result_wait(edict, &deadline);
+		if (result) {
+			/* We've got a response */
+			if (result->failed) {
+				/*
+				 * FIXME: if the job was dropped from the queue we do
+				 * not know if the failed check was definitive, so we end
+				 * up waiting until all checks return. It should be a rare
+				 * event, though.
+				 */
+				logstr(GLOG_DEBUG, "failed check result received (job not run)");
+				tally->checks_running--;
+				tally_finish(tally, result->check);
+				tally_settle(tally);
+			} else {
+				tally_result(final, tally, result);
+				if (result->reason)
+					Free(result->reason);
+			}
+		} else {
+			/* the deadline passed, move on to the next one */
+			if (ta->action) {
+				clock_gettime(CLOCK_TYPE, &now);
+				timeused = ms_diff(&now, start);
+				ta->action(ta->arg, timeused);
+			}
+			ta = ta->next;
+			if (ta) {
+				mstotimespec(ta->timeout, &timeout);
+				ts_sum(&deadline, base, &timeout);
+			}
+		}
+	}
+
+	return ta;
+}
+
+/*
+ * run_tuple	- the verdict on the request. With inline_only set only
+ * the verdicts taking no checks are given, the others return
+ * TUPLE_CHECKS before the filter is updated or the query accounted.
+ */
+static int
+run_tuple(final_status_t *final, grey_tuple_t *request, tmout_action_t *ta, bool inline_only)
 {
-	char maskedtuple[MSGSZ];
-	char *chkipstr = NULL;
 	sha_256_t digest;
 	update_message_t update;
 	int ret;
 	int retvalue = STATUS_UNKNOWN;
-	oper_sync_t os;
 	edict_t *edict = NULL;
-	poolresult_message_t message;
-	chkresult_t *result = NULL;
-	struct timespec start, now;
-	mseconds_t timeused;
+	struct timespec start, base;
 	tmout_action_t *tap = NULL;
-	tmout_action_t *ta_default_reserved = NULL;
+	tmout_action_t ta_default;
 	int i;
-	int checks_running;
-	int definitives_running;
 	int checkcount;
+	int cacheable;
+	int nresults;
+	int stage, maxstage;
+	mseconds_t timelimit;
 	int susp_weight = 0;		/* must be initialized to zero J_UNDEFINED */
 	int block_threshold;
 	int grey_threshold;
-	bool free_ta = false;
 	judgment_t judgment;
-	bool definitive;
 	char *reasonstr = NULL;
 	querylog_entry_t *querylog_entry;
+	check_source_t *sources;
+	flights_t *flights = NULL;
+	tally_t tally;
+	bool seen;
 
 	/* record the processing start time */
 	clock_gettime(CLOCK_TYPE, &start);
+	clock_gettime(CLOCK_REALTIME, &base);
 
 	/* default value */
 	final->status = STATUS_FAIL;
@@ -233,23 +699,16 @@ test_tuple(final_status_t *final, grey_tuple_t *request, tmout_action_t *ta)
 	block_threshold = ctx->config.block_threshold;
 	grey_threshold = ctx->config.grey_threshold;
 
-	/* apply grey_mask for client_address */
-	chkipstr = grey_mask(request->client_address);
-	if (NULL == chkipstr) {
-		logstr(GLOG_ERROR, "applying grey_mask failed: %s", request->client_address);
-		return -1;
-	}
-
-	/* greylist */
-	switch (ctx->config.grey_tuple) {
-	case GREY_TUPLE_USER:
-		snprintf(maskedtuple, MSGSZ, "%s %s %s", chkipstr, request->sender, request->recipient);
-		break;
-	case GREY_TUPLE_SERVER:
-		snprintf(maskedtuple, MSGSZ, "%s %s %s", chkipstr, domain_part(request->sender), request->helo_name);
-		break;
+	/* greylist, grey_mask is applied to client_address */
+	if (!final->hashed) {
+		if (tuple_digest(&final->digest, request) < 0) {
+			logstr(GLOG_ERROR, "applying grey_mask failed: %s", request->client_address);
+			return -1;
+		}
+		final->hashed = true;
+		trace_mark(final, TRACE_HASH);
 	}
-	digest = sha256_string(maskedtuple);
+	digest = final->digest;
 
 	querylog_entry = &final->querylog_entry;
 
@@ -258,19 +717,36 @@ test_tuple(final_status_t *final, grey_tuple_t *request, tmout_action_t *ta)
 	querylog_entry->helo = request->helo_name;
 	querylog_entry->client_ip = request->client_address;
 
-	logstr(GLOG_INSANE, "checking ip=%s, net=%s", request->client_address, chkipstr);
+	logstr(GLOG_INSANE, "checking ip=%s", request->client_address);
 
-	Free(chkipstr);
-
-	/* how many checks to run */
+	/* how many checks to run, and how many results they may return */
 	i = 0;
-	while (ctx->checklist[i])
-		++i;
+	nresults = 0;
+	cacheable = 0;
+	maxstage = 0;
+	while (ctx->checklist[i]) {
+		if (ctx->checklist[i]->cache != CACHE_NONE)
+			cacheable++;
+		maxstage = MAX(maxstage, ctx->checklist[i]->stage);
+		nresults += ctx->checklist[i++]->results;
+	}
 	checkcount = i;
 
 	/* check status */
-	if (is_in_ring_queue(ctx->filter, digest) && ((ctx->config.flags & FLG_MATCH_SHORTCUT)
-		|| (0 == checkcount))) {
+	if (final->filtered) {
+		/*
+		 * test_tuple_fast() did the lookup, the time since is
+		 * the wait for a pool thread
+		 */
+		seen = final->seen;
+		trace_mark(final, TRACE_SUBMIT);
+	} else {
+		seen = is_in_ring_queue(ctx->filter, digest);
+		final->seen = seen;
+		final->filtered = true;
+		trace_mark(final, TRACE_BLOOM);
+	}
+	if (seen && ((ctx->config.flags & FLG_MATCH_SHORTCUT) || (0 == checkcount))) {
 		/*
 		 * shortcut when match, iff
 		 *   - traditional greylister (no checks), or
@@ -279,131 +755,95 @@ test_tuple(final_status_t *final, grey_tuple_t *request, tmout_action_t *ta)
 		retvalue = STATUS_MATCH;
 	} else if (0 == checkcount) {
 		/* traditional greylister */
-		reasonstr = strdup(ctx->config.grey_reason);
+		reasonstr = arena_strdup(request->arena, ctx->config.grey_reason);
 		retvalue = STATUS_GREY;
+	} else if (inline_only) {
+		return TUPLE_CHECKS;
 	} else {
 		/* build default entry, if timeout not given */
 		if (!ta) {
-			free_ta = true;
-			ta = Malloc(sizeof(tmout_action_t));
+			ta = &ta_default;
 			ta->timeout = ctx->config.query_timelimit;
 			ta->action = NULL;
 			ta->next = NULL;
-			ta_default_reserved = ta;
 		}
 
-		/* Write the edict */
-		edict = edict_get(false);
+		/*
+		 * Write the edict. The deadline counts from the arrival of
+		 * the query, so the jobs still queued after the last
+		 * timeout are dropped unrun.
+		 */
+		edict = edict_get(nresults);
 		edict->job = (void *)request;
-		tap = ta;
-		while (tap) {
-			edict->timelimit += tap->timeout;
-			tap = tap->next;
-		}
-
-		/* submit jobs for checks */
-		i = 0;
-		definitives_running = 0;
-		while (ctx->checklist[i]) {
-			request_reference(request);
-			submit_job(ctx->checklist[i]->pool, edict);
+		edict->release = &release_request;
+		timelimit = 0;
+		for (tap = ta; tap; tap = tap->next)
+			timelimit += tap->timeout;
+		edict_deadline(edict, &final->starttime, timelimit);
+
+		tally.judgment = J_UNDEFINED;
+		tally.susp_weight = 0;
+		tally.checks_running = 0;
+		tally.definitives_running = 0;
+		tally.definitive = false;
+		tally.reasonstr = NULL;
+		tally.block_threshold = block_threshold;
+		tally.grey_threshold = grey_threshold;
+		tally.room = arena_alloc(request->arena, checkcount * sizeof(int));
+		tally.headroom = 0;
+		tally.drop = arena_alloc(request->arena, checkcount * sizeof(int));
+		tally.footroom = 0;
+		tally.definitives_left = 0;
+		for (i = 0; i < checkcount; i++) {
+			tally.room[i] = ctx->checklist[i]->max_weight;
+			tally.headroom += tally.room[i];
+			tally.drop[i] = ctx->checklist[i]->min_weight;
+			tally.footroom += tally.drop[i];
 			if (ctx->checklist[i]->definitive)
-				definitives_running++;
-			i++;
+				tally.definitives_left++;
 		}
-		checks_running = i;
 
-		/* judgment is the final combined result of all checks */
-		judgment = J_UNDEFINED;
+		sources = arena_alloc(request->arena, checkcount * sizeof(check_source_t));
+		memset(sources, 0, checkcount * sizeof(check_source_t));
+
+		/* the observer must be in place before any results arrive */
+		if (cacheable) {
+			flights = Malloc(sizeof(flights_t) + checkcount * sizeof(flight_t *));
+			flights->count = checkcount;
+			flights->flight = (flight_t **)(flights + 1);
+			memset(flights->flight, 0, checkcount * sizeof(flight_t *));
+			edict->observer_arg = flights;
+			edict->observer = &observe_result;
+		}
 
 		/*
-		 * definitive boolean is used to test if we can short cut 
-		 * from waiting all the cheks complete. We must wait all
-		 * the definitive checks to complete, that is all tests which
-		 * can return a STATUS_TRUST or STATUS_BLOCK response.
+		 * run the checks stage by stage, see 'check_stage'. A stage
+		 * is started only if the verdict is still open.
 		 */
-		definitive = false;
-
-		/* 
-		 * wait until a definitive result arrives, every check has
-		 * returned or timeout is reached.
-		 */
-		while (definitive == false && checks_running > 0 && ta) {
-			clock_gettime(CLOCK_TYPE, &now);
-			timeused = ms_diff(&now, &start);
-			/* make sure timeleft != 0 as it would cause get_msg_timed to block */
-			if (timeused < ta->timeout) {
-				ret = get_msg_timed(edict->resultmq, &message,
-				    sizeof(message.result), ta->timeout - timeused);
-				if (ret > 0) {
-					/* We've got a response */
-					result = (chkresult_t *)message.result;
-					if (NULL == result) {
-						/*
-						 * FIXME: we do not know if the failed check was definitive
-						 * so we end up waiting until all checks return. It should
-						 * be a rare event, though.
-						 */
-						logstr(GLOG_DEBUG,
-						    "NULL check result received (pool exhausted)");
-						checks_running--;
-						/*
-						 * Because the request never reached its destination
-						 * we have to unlink it here
-						 */
-						request_unlink(request);
-					} else {
-						logstr(GLOG_INSANE,
-						    "Received a check result, check = %s, judgment = %d, weight = %d",
-						    result->checkname, result->judgment, result->weight);
-						/* was this a final result from the check? */
-						if (!result->wait)
-							checks_running--;
-						/* update the judgment */
-						judgment = MAX(judgment, result->judgment);
-						susp_weight += result->weight;
-
-						/* update querylog entry */
-						if (result->judgment != J_UNDEFINED)
-							record_match(querylog_entry, result);
-
-						/* was this a definitive result? */
-						if (result->definitive)
-							definitives_running--;
-						if (result->reason) {
-							reasonstr = strdup(result->reason);
-							Free(result->reason);
-						}
-						Free(result);
-					}
-					/*
-					 * Do we have a definitive result so far?
-					 * That is,
-					 * 1.  we have a whitelist match, or
-					 * 2a. all the definitive checks have returned, and
-					 * 2b. susp_weight > grey_threshold
-					 * broken up for readability 
-					 */
-					if (judgment == J_PASS) {
-						definitive = true;
-					} else if (0 == definitives_running) {
-						if (block_threshold != 0 && susp_weight >= block_threshold)
-							definitive = true;
-						else if (block_threshold == 0
-						    && susp_weight >= grey_threshold)
-							definitive = true;
-					}
-				}
-			} else if (ta->action) {
-				ta->action(ta->arg, timeused);
-				ta = ta->next;
-			} else {
-				ta = ta->next;
-			}
+		for (stage = 0; stage <= maxstage && ta; stage++) {
+			tally_settle(&tally);
+			if (tally.definitive)
+				break;
+			run_stage(stage, edict, final, request, &tally, sources, flights);
+			trace_mark(final, TRACE_SUBMIT);
+			ta = wait_results(edict, final, request, &tally, ta, &base, &start);
+			trace_mark(final, TRACE_CHECKS);
 		}
+		for (i = 0; i < checkcount; i++)
+			if (ctx->checklist[i]->stage >= stage)
+				ATOMIC_ADD_FETCH(&ctx->checklist[i]->skipped, 1);
+
+		judgment = tally.judgment;
+		susp_weight = tally.susp_weight;
+		reasonstr = tally.reasonstr;
 
-		/* we don't want more results */
-		edict->obsolete = true;
+		/*
+		 * we don't want more results, unless other requests wait for
+		 * our jobs. A request joining after this gets an undefined
+		 * result if the job gives up early.
+		 */
+		if (!flights_followed(flights))
+			edict_cancel(edict);
 
 		/* Let's sum up the results */
 		switch (judgment) {
@@ -417,7 +857,7 @@ test_tuple(final_status_t *final, grey_tuple_t *request, tmout_action_t *ta)
 		case J_UNDEFINED:
 			if (block_threshold > 0 && susp_weight >= block_threshold) {
 				retvalue = STATUS_BLOCK;
-				reasonstr = strdup(ctx->config.block_reason);
+				reasonstr = arena_strdup(request->arena, ctx->config.block_reason);
 			} else if (susp_weight >= grey_threshold) {
 				/*
 				 * two possibilities here: return TRUST if this 
@@ -426,7 +866,7 @@ test_tuple(final_status_t *final, grey_tuple_t *request, tmout_action_t *ta)
 				if (is_in_ring_queue(ctx->filter, digest)) {
 					retvalue = STATUS_MATCH;
 				} else {
-					reasonstr = strdup(ctx->config.grey_reason);
+					reasonstr = arena_strdup(request->arena, ctx->config.grey_reason);
 					retvalue = STATUS_GREY;
 				}
 			} else {
@@ -446,24 +886,24 @@ test_tuple(final_status_t *final, grey_tuple_t *request, tmout_action_t *ta)
 	/* update the querylog entry */
 	querylog_entry->action = retvalue;
 
-	/* we cannot free(ta) if we got it as parameter */
-	if (free_ta)
-		Free(ta_default_reserved);
-
 	if (((retvalue == STATUS_GREY) || (retvalue == STATUS_MATCH))
 	    || (ctx->config.flags & FLG_UPDATE_ALWAYS)) {
 		/* update the filter */
 		update.mtype = UPDATE;
 		memcpy(update.mtext, &digest, sizeof(sha_256_t));
-		ret = put_msg(ctx->update_q, &update, sizeof(update_message_t));
+		/* the I/O threads do not wait for a full queue */
+		if (inline_only)
+			ret = put_msg_nowait(ctx->update_q, &update, sizeof(update_message_t));
+		else
+			ret = put_msg(ctx->update_q, &update, sizeof(update_message_t));
 		if (ret < 0)
 			gerror("update put_msg");
 
-		/* update peer */
+		/* update peer, the sync sender writes it */
 		if (connected(&(ctx->config.peer))) {
-			os.digest = digest;
-			logstr(GLOG_INSANE, "Sending oper sync");
-			send_oper_sync(&(ctx->config.peer), &os);
+			logstr(GLOG_INSANE, "Queueing oper sync");
+			if (queue_oper_sync(digest) < 0)
+				gerror("oper sync put_msg");
 		}
 	}
 
@@ -476,37 +916,122 @@ test_tuple(final_status_t *final, grey_tuple_t *request, tmout_action_t *ta)
 	final->status = retvalue;
 	if (reasonstr)
 		final->reason = reasonstr;
+	trace_mark(final, TRACE_VERDICT);
 	return 0;
 }
 
+/*
+ * prefetch_checks	- start the first stage checks the partial request
+ * has the keys for, before the rest of the tuple is known. Nobody
+ * waits for the results: they land in the check cache, and the query
+ * that follows finds them there or joins the flight still running.
+ * The later stages are left alone, as the query may never need them.
+ */
+void
+prefetch_checks(grey_tuple_t *request)
+{
+	edict_t *edict;
+	check_t *check;
+	flight_t *flight;
+	flights_t *flights;
+	cached_result_t *cached;
+	struct timespec now;
+	const char *key;
+	int i, checkcount, nresults;
+
+	if (0 == ctx->config.check_cache_size || 0 == ctx->config.check_cache_ttl)
+		return;
+
+	nresults = 0;
+	for (i = 0; ctx->checklist[i]; i++)
+		nresults += ctx->checklist[i]->results;
+	checkcount = i;
+	if (0 == checkcount)
+		return;
+
+	clock_gettime(CLOCK_TYPE, &now);
+	edict = edict_get(nresults);
+	edict->job = (void *)request;
+	edict->release = &release_request;
+	edict_deadline(edict, &now, ctx->config.query_timelimit);
+
+	flights = Malloc(sizeof(flights_t) + checkcount * sizeof(flight_t *));
+	flights->count = checkcount;
+	flights->flight = (flight_t **)(flights + 1);
+	memset(flights->flight, 0, checkcount * sizeof(flight_t *));
+	edict->observer_arg = flights;
+	edict->observer = &observe_result;
+
+	for (i = 0; i < checkcount; i++) {
+		check = ctx->checklist[i];
+		if (check->stage > 0 || !prefetchable(check, request))
+			continue;
+		key = cache_key(check, request);
+		if (checkcache_lookup(request->arena, i, key, &cached) >= 0)
+			continue;
+		flight = flight_join(i, key, check->results, edict);
+		if (NULL == flight)
+			/* already running for another request */
+			continue;
+		flights->flight[i] = flight;
+		request_reference(request);
+		if (submit_job(check->pool, edict) < 0) {
+			request_unlink(request);
+			flight_abort(flight);
+		}
+	}
+
+	/* the jobs keep the edict, and the flights, alive */
+	edict_unlink(edict);
+}
+
+int
+test_tuple(final_status_t *final, grey_tuple_t *request, tmout_action_t *ta)
+{
+	return run_tuple(final, request, ta, false);
+}
+
+/*
+ * test_tuple_fast	- the verdict if it is a hash and a filter lookup
+ * away: a match with FLG_MATCH_SHORTCUT, or no checks configured. The
+ * protocol threads answer these themselves and pass only the rest to
+ * a pool, see TUPLE_CHECKS. The digest is kept in final for the
+ * test_tuple() that follows.
+ */
+int
+test_tuple_fast(final_status_t *final, grey_tuple_t *request)
+{
+	return run_tuple(final, request, NULL, true);
+}
+
 int
 process_parameter(grey_tuple_t *tuple, const char *str)
 {
-	char *match;
+	const char *match;
 
 	/* matching switch */
 	do {
 		match = try_match("sender=", str);
 		if (match) {
-			tuple->sender = match;
+			tuple->sender = arena_strdup(tuple->arena, match);
 			logstr(GLOG_DEBUG, "sender=%s", match);
 			continue;
 		}
 		match = try_match("recipient=", str);
 		if (match) {
-			tuple->recipient = match;
+			tuple->recipient = arena_strdup(tuple->arena, match);
 			logstr(GLOG_DEBUG, "recipient=%s", match);
 			continue;
 		}
 		match = try_match("client_address=", str);
 		if (match) {
-			tuple->client_address = match;
+			tuple->client_address = arena_strdup(tuple->arena, match);
 			logstr(GLOG_DEBUG, "client_address=%s", match);
 			continue;
 		}
 		match = try_match("helo_name=", str);
 		if (match) {
-			tuple->helo_name = match;
+			tuple->helo_name = arena_strdup(tuple->arena, match);
 			logstr(GLOG_DEBUG, "helo_name=%s", match);
 			continue;
 		}
@@ -528,46 +1053,101 @@ check_request(grey_tuple_t *tuple)
 	}
 }
 
-char *
+/*
+ * try_match	- return the part of matchee after matcher, or NULL.
+ * The result points inside matchee.
+ */
+const char *
 try_match(const char *matcher, const char *matchee)
 {
 	if (strncmp(matcher, matchee, strlen(matcher)) == 0)
 		/* found a match, return part after the match */
-		return strdup(matchee + strlen(matcher));
+		return matchee + strlen(matcher);
 	else
 		return NULL;
 }
 
+/*
+ * init_status	- the status lives in the arena of the request, so it
+ * must be finalized before the request is unlinked
+ */
 final_status_t *
-init_status(const char *proto)
+init_status(const char *proto, grey_tuple_t *request)
 {
 	final_status_t *status;
 
-	status = Malloc(sizeof(final_status_t));
+	status = arena_alloc(request->arena, sizeof(final_status_t));
 	memset(status, 0, sizeof(final_status_t));
 
+	status->arena = request->arena;
 	status->querylog_entry.proto = proto;
 	clock_gettime(CLOCK_TYPE, &status->starttime);
 
+	/* parsing ends where the query starts */
+	status->mark = status->starttime;
+	if (request->arrival.tv_sec)
+		status->trace[TRACE_PARSE] = us_diff(&status->starttime, &request->arrival);
+	else
+		status->trace[TRACE_PARSE] = -1;
+
 	return status;
 }
 
+/*
+ * trace_mark	- the query has finished a stage, account the time since
+ * the previous mark to it. A stage may be entered more than once.
+ */
+void
+trace_mark(final_status_t *final, trace_stage_t stage)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_TYPE, &now);
+	final->trace[stage] += us_diff(&now, &final->mark);
+	final->mark = now;
+}
+
+/*
+ * trace_stats	- log the latency histograms of the stages and start
+ * them over
+ */
+void
+trace_stats(void)
+{
+	latency_t snapshot;
+	char buf[TMP_BUF_SIZE];
+	int i;
+
+	for (i = 0; i < TRACE_STAGES; i++) {
+		latency_take(&trace_latency[i], &snapshot);
+		if (0 == snapshot.count)
+			continue;
+		latency_format(&snapshot, buf, sizeof(buf));
+		statstr(STATS_LATENCY, "grossd latency of %s [us] (%s)", trace_names[i], buf);
+	}
+}
+
 /*
  * record_match         - add checkresult info to the query log entry
  */
 void
-record_match(querylog_entry_t *q, chkresult_t *r)
+record_match(final_status_t *final, chkresult_t *r)
 {
 	check_match_t *m, *n;
+	querylog_entry_t *q;
+	struct timespec now;
 
-	m = Malloc(sizeof(check_match_t));
+	q = &final->querylog_entry;
+
+	m = arena_alloc(final->arena, sizeof(check_match_t));
 	memset(m, 0, sizeof(check_match_t));
 	if (r->checkname)
-		/*             m->name = strdup(r->checkname); */
 		m->name = r->checkname;
 	else
-		m->name = strdup("<anonymous>");
+		m->name = "<anonymous>";
 	m->weight = r->weight;
+	clock_gettime(CLOCK_TYPE, &now);
+	m->delay = ms_diff(&now, &final->starttime);
 	m->next = NULL;
 
 	q->totalweight += m->weight;
@@ -608,42 +1188,113 @@ update_delay_stats(querylog_entry_t *q)
 	}
 }
 
+/*
+ * qlogcopy	- copy a string to a fixed size field, NULL is left empty
+ */
+static void
+qlogcopy(char *field, const char *str, size_t size)
+{
+	if (str) {
+		strncpy(field, str, size - 1);
+		field[size - 1] = '\0';
+	}
+}
+
+/*
+ * querylogbinary	- append the query to the binary query log
+ */
+static void
+querylogbinary(qlog_t *qlog, querylog_entry_t *q)
+{
+	qlog_record_t record;
+	struct timeval now;
+	check_match_t *m;
+
+	memset(&record, 0, sizeof(record));
+	gettimeofday(&now, NULL);
+	record.time = (uint64_t)now.tv_sec * 1000000 + now.tv_usec - (uint64_t)q->delay * 1000;
+	record.delay = q->delay;
+	record.totalweight = q->totalweight;
+	record.action = q->action;
+	qlogcopy(record.proto, q->proto, QLOG_PROTOLEN);
+	qlogcopy(record.client_ip, q->client_ip, QLOG_IPLEN);
+	qlogcopy(record.sender, q->sender, QLOG_ADDRLEN);
+	qlogcopy(record.recipient, q->recipient, QLOG_ADDRLEN);
+	qlogcopy(record.helo, q->helo, QLOG_HELOLEN);
+	for (m = q->match; m && record.nmatch < QLOG_MAXMATCH; m = m->next) {
+		qlogcopy(record.match[record.nmatch].name, m->name, QLOG_NAMELEN);
+		record.match[record.nmatch].weight = m->weight;
+		record.match[record.nmatch].delay = m->delay;
+		record.nmatch++;
+	}
+
+	qlog_append(qlog, &record);
+}
+
+/*
+ * finalize	- account and log the query. The status and everything
+ * hanging from it are released with the request.
+ */
 void
 finalize(final_status_t *status)
 {
 	struct timespec now;
-	check_match_t *m, *n;
 	querylog_entry_t *q;
+	const int *trace = NULL;
+	int i;
 
 	q = &status->querylog_entry;
 
+	trace_mark(status, TRACE_RESPOND);
+	for (i = 0; i < TRACE_STAGES; i++)
+		if (status->trace[i] >= 0)
+			latency_add(&trace_latency[i], status->trace[i]);
+
 	clock_gettime(CLOCK_TYPE, &now);
 	q->delay = ms_diff(&now, &status->starttime);
 
 	update_delay_stats(q);
 
-	querylogwrite(q);
+	if (ctx->qlog)
+		querylogbinary(ctx->qlog, q);
 
-	n = q->match;
-	m = n;
-	while (n) {
-		n = m->next;
-		Free(m);
-		m = n;
+	if (GLOG_INFO <= ctx->config.loglevel && querylog_admit()) {
+		if (ctx->config.querylog_trace
+		    && ATOMIC_FETCH_ADD(&querylog_lines, 1) % ctx->config.querylog_trace == 0)
+			trace = status->trace;
+		querylogwrite(q, trace);
 	}
+}
 
-	if (status->reason)
-		Free(status->reason)
-		    Free(status);
+/*
+ * lineappend	- append to a line of size bytes, used bytes taken.
+ * Returns the new length, the line is truncated if it fills up.
+ */
+static size_t
+lineappend(char *line, size_t used, size_t size, const char *fmt, ...)
+{
+	va_list vap;
+	int n;
+
+	if (used >= size - 1)
+		return used;
+	va_start(vap, fmt);
+	n = vsnprintf(line + used, size - used, fmt, vap);
+	va_end(vap);
+	if (n < 0)
+		return used;
+	return MIN(used + n, size - 1);
 }
 
 void
-querylogwrite(querylog_entry_t *q)
+querylogwrite(querylog_entry_t *q, const int *trace)
 {
 	char line[MAXLINELEN];
-	char buffer[MAXLINELEN];
+	size_t len;
 	char *actionstr;
+	const char *sep;
 	check_match_t *m;
+	int i;
 
 	switch (q->action) {
 	case STATUS_GREY:
@@ -679,22 +1330,30 @@ querylogwrite(querylog_entry_t *q)
 	if (NULL == q->recipient)
 		q->recipient = "N/A";
 
-	snprintf(line, MAXLINELEN - 1, "a=%s d=%d w=%d c=%s s=%s r=%s", actionstr, q->delay, q->totalweight,  q->client_ip, q->sender, q->recipient);
-	
-	if (q->helo) {
-		snprintf(buffer, MAXLINELEN - 1, " h=%s", q->helo);
-		strncat(line, buffer, MAXLINELEN - 1);
+	/* a single pass over the line */
+	line[0] = '\0';
+	len = lineappend(line, 0, MAXLINELEN, "a=%s d=%d w=%d c=%s s=%s r=%s", actionstr,
+	    q->delay, q->totalweight, q->client_ip, q->sender, q->recipient);
+
+	if (q->helo)
+		len = lineappend(line, len, MAXLINELEN, " h=%s", q->helo);
+
+	for (m = q->match; m; m = m->next) {
+		if (m->weight)
+			len = lineappend(line, len, MAXLINELEN, " m=%s%+d", m->name, m->weight);
+		else
+			len = lineappend(line, len, MAXLINELEN, " m=%s", m->name);
 	}
 
-	m = q->match;
-	while (m) {
-		snprintf(buffer, MAXLINELEN - 1, " m=%s", m->name);
-		strncat(line, buffer, MAXLINELEN - 1);
-		if (m->weight) {
-			snprintf(buffer, MAXLINELEN - 1, "%+d", m->weight);
-			strncat(line, buffer, MAXLINELEN - 1);
+	/* the stages of the query in microseconds */
+	if (trace) {
+		sep = " t=";
+		for (i = 0; i < TRACE_STAGES; i++) {
+			if (trace[i] < 0)
+				continue;
+			len = lineappend(line, len, MAXLINELEN, "%s%s:%d", sep, trace_names[i], trace[i]);
+			sep = ",";
 		}
-		m = m->next;
 	}
 
 	logstr(GLOG_INFO, "%s", line);
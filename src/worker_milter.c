@@ -41,6 +41,7 @@ sfsistat mlfi_helo(SMFICTX * milter_ctx, char *helohost);
 sfsistat mlfi_envfrom(SMFICTX * milter_ctx, char **argv);
 sfsistat mlfi_envrcpt(SMFICTX * milter_ctx, char **argv);
 sfsistat mlfi_close(SMFICTX * milter_ctx);
+static void milter_prefetch(struct private_ctx_s *priv);
 static void *milter_server(void *arg);
 
 struct smfiDesc grossfilter = {
@@ -59,6 +60,24 @@ struct smfiDesc grossfilter = {
 	mlfi_close		/* connection cleanup */
 };
 
+/*
+ * milter_prefetch	- start the checks on what is known of the
+ * connection so far, so that they are done or well on their way when
+ * the recipient arrives. See prefetch_checks().
+ */
+static void
+milter_prefetch(struct private_ctx_s *priv)
+{
+	grey_tuple_t *tuple;
+
+	tuple = request_new();
+	tuple->client_address = arena_strdup(tuple->arena, priv->client_address);
+	if (priv->helo_name)
+		tuple->helo_name = arena_strdup(tuple->arena, priv->helo_name);
+	prefetch_checks(tuple);
+	request_unlink(tuple);
+}
+
 sfsistat
 mlfi_connect(SMFICTX * milter_ctx, char *hostname, _SOCK_ADDR * hostaddr)
 {
@@ -85,6 +104,9 @@ mlfi_connect(SMFICTX * milter_ctx, char *hostname, _SOCK_ADDR * hostaddr)
 	priv->client_address = strdup(caddr);
 	smfi_setpriv(milter_ctx, priv);
 
+	/* the checks on the client address need not wait for the recipient */
+	milter_prefetch(priv);
+
 	return SMFIS_CONTINUE;
 }
 
@@ -95,7 +117,11 @@ mlfi_helo(SMFICTX * milter_ctx, char *helohost)
 
 	logstr(GLOG_INSANE, "milter: helo");
 
+	if (priv->helo_name)
+		/* a second helo */
+		Free(priv->helo_name);
 	priv->helo_name = strdup(helohost);
+	milter_prefetch(priv);
 
 	return SMFIS_CONTINUE;
 }
@@ -124,13 +150,13 @@ mlfi_envrcpt(SMFICTX * milter_ctx, char **argv)
 	logstr(GLOG_INSANE, "milter: envrcpt");
 
 	tuple = request_new();
-	status = init_status("milter");
+	status = init_status("milter", tuple);
 
-	tuple->sender = strdup(priv->sender);
-	tuple->recipient = strdup(argv[0]);
-	tuple->client_address = strdup(priv->client_address);
+	tuple->sender = arena_strdup(tuple->arena, priv->sender);
+	tuple->recipient = arena_strdup(tuple->arena, argv[0]);
+	tuple->client_address = arena_strdup(tuple->arena, priv->client_address);
 	if (priv->helo_name)
-		tuple->helo_name = strdup(priv->helo_name);
+		tuple->helo_name = arena_strdup(tuple->arena, priv->helo_name);
 
 	ret = test_tuple(status, tuple, NULL);
 
@@ -184,6 +210,7 @@ milter_server(void *arg)
 	ret = smfi_setconn(ctx->config.milter.listen);
 	if (MI_FAILURE == ret)
 		daemon_shutdown(EXIT_FATAL, "smfi_setconn failed");
+	smfi_setbacklog(ctx->config.max_connq);
 
 	if (strncasecmp(ctx->config.milter.listen, "unix:", 5) == 0)
 		unlink(ctx->config.milter.listen + 5);
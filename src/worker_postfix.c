@@ -22,37 +22,57 @@
 #include "worker.h"
 #include "srvutils.h"
 #include "utils.h"
+#include "listener.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+# include <fcntl.h>
+#endif
 
 enum parse_status_t
-{ PARSE_OK, PARSE_CLOSED, PARSE_ERROR, PARSE_SYS_ERROR };
+{ PARSE_OK, PARSE_CLOSED, PARSE_ERROR, PARSE_SYS_ERROR, PARSE_MORE };
+
+#define POSTFIX_IOV 4		/* the response template and the terminator */
 
 /* prototypes of internals */
 int postfix_connection(thread_pool_t *, thread_ctx_t *, edict_t *edict);
-int parse_postfix(client_info_t *info, grey_tuple_t *grey_tuple);
-char *assemble_response(char *result, size_t len, char *template, char *reason);
+int parse_postfix(client_info_t *info, rbuf_t *rb, grey_tuple_t *grey_tuple);
+static void parse_attribute(grey_tuple_t *grey_tuple, const char *line, bool *single_query);
+static int postfix_response(struct iovec *iov, final_status_t *status, int ret);
 
-char *
-assemble_response(char *result, size_t len, char *template, char *reason)
+/*
+ * postfix_response	- point iov at the policy response for the verdict,
+ * returns the number of buffers used. The response is written with a
+ * single writev() straight from the template and the reason.
+ */
+static int
+postfix_response(struct iovec *iov, final_status_t *status, int ret)
 {
-        char *reasonsubstitute;
-        char *prologue;
-        char *epilogue;
-
-        /* ignore the reason if template does not use it */
-        prologue = strdup(template);
-        reasonsubstitute = strstr(prologue, REASONTEMPLATE);
-        if (NULL == reasonsubstitute) {
-                snprintf(result, len, "%s", prologue);
-        } else {
-                /* null terminate the first part */
-                *reasonsubstitute = '\0';
-                epilogue = reasonsubstitute + strlen(REASONTEMPLATE);
-                snprintf(result, len, "%s%s%s", prologue, reason, epilogue);
-		result[len-1] = '\0';
-        }
-        Free(prologue);
-
-	return result;
+	static char dunno[] = "action=dunno";
+	static char terminator[] = "\n\n";
+	int n = 1;
+
+	iov[0].iov_base = dunno;
+	iov[0].iov_len = sizeof(dunno) - 1;
+	if (ret >= 0) {
+		switch (status->status) {
+		case STATUS_BLOCK:
+			n = template_iov(iov, &ctx->config.postfix.responseblock,
+			    status->reason ? status->reason : "Rejected");
+			break;
+		case STATUS_GREY:
+			n = template_iov(iov, &ctx->config.postfix.responsegrey,
+			    status->reason ? status->reason : "Please try again later");
+			break;
+		default:
+			/* trust, match or an error */
+			break;
+		}
+	}
+
+	iov[n].iov_base = terminator;
+	iov[n].iov_len = sizeof(terminator) - 1;
+	return n + 1;
 }
 
 /*
@@ -62,7 +82,8 @@ int
 postfix_connection(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 {
 	grey_tuple_t *request;
-	char response[MAXLINELEN] = { '\0' };
+	struct iovec iov[POSTFIX_IOV];
+	rbuf_t *rb;
 	int ret;
 	client_info_t *client_info;
 	final_status_t *status;
@@ -72,39 +93,18 @@ postfix_connection(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict
 
 	logstr(GLOG_DEBUG, "postfix client connected from %s", client_info->ipstr);
 
+	rb = Malloc(sizeof(rbuf_t));
+	rbuf_init(rb, client_info->connfd);
+
 	while (1) {
 		request = request_new();
-		ret = parse_postfix(client_info, request);
+		ret = parse_postfix(client_info, rb, request);
 		if (ret == PARSE_OK) {
-			status = init_status("postfix");
+			status = init_status("postfix", request);
 			/* We are go */
 			ret = test_tuple(status, request, NULL);
 
-			if (ret < 0) {
-				/* error */
-				snprintf(response, MAXLINELEN, "action=dunno");
-			} else {
-				switch (status->status) {
-				case STATUS_TRUST:
-				case STATUS_MATCH:
-					if (snprintf(response, MAXLINELEN, "action=dunno"));
-					break;
-				case STATUS_BLOCK:
-					assemble_response(response, MAXLINELEN, ctx->config.postfix.responseblock,
-					    status->reason ? status->reason : "Rejected");
-					break;
-				case STATUS_GREY:
-					assemble_response(response, MAXLINELEN, ctx->config.postfix.responsegrey,
-					    status->reason ? status->reason : "Please try again later");
-					break;
-				default:
-					snprintf(response, MAXLINELEN, "action=dunno");
-				}
-			}
-
-			/* Make sure it's terminated */
-			response[MAXLINELEN - 1] = '\0';
-			ret = respond(client_info->connfd, response);
+			ret = writevn(client_info->connfd, iov, postfix_response(iov, status, ret));
 			if (-1 == ret) {
 				logstr(GLOG_ERROR, "respond() failed in handle_connection");
 			}
@@ -128,130 +128,692 @@ postfix_connection(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict
 	}
 
 	close(client_info->connfd);
+	Free(rb);
 	free_client_info(client_info);
 	logstr(GLOG_DEBUG, "postfix_connection returning");
 
 	return ret;
 }
 
+/*
+ * parse_attribute	- add an attribute line of a request to the tuple
+ */
+static void
+parse_attribute(grey_tuple_t *grey_tuple, const char *line, bool *single_query)
+{
+	const char *match;
+
+	/* matching switch */
+	match = try_match("sender=", line);
+	if (match) {
+		grey_tuple->sender = arena_strdup(grey_tuple->arena, match);
+		logstr(GLOG_DEBUG, "sender=%s", match);
+		return;
+	}
+	match = try_match("recipient=", line);
+	if (match) {
+		grey_tuple->recipient = arena_strdup(grey_tuple->arena, match);
+		logstr(GLOG_DEBUG, "recipient=%s", match);
+		return;
+	}
+	match = try_match("client_address=", line);
+	if (match) {
+		grey_tuple->client_address = arena_strdup(grey_tuple->arena, match);
+		logstr(GLOG_DEBUG, "client_address=%s", match);
+		return;
+	}
+	match = try_match("helo_name=", line);
+	if (match) {
+		grey_tuple->helo_name = arena_strdup(grey_tuple->arena, match);
+		logstr(GLOG_DEBUG, "helo_name=%s", match);
+		return;
+	}
+	match = try_match("grossd_mode=", line);
+	if (match) {
+		*single_query = true;
+		logstr(GLOG_DEBUG, "Client requested a single connection mode");
+		return;
+	}
+}
+
 /*
  * parse_postfix	- build the request tuple (sender, recipient, ipaddr)
  */
 int
-parse_postfix(client_info_t *client_info, grey_tuple_t *grey_tuple)
+parse_postfix(client_info_t *client_info, rbuf_t *rb, grey_tuple_t *grey_tuple)
 {
-	char line[MAXLINELEN];
-	char *match;
+	char *line;
 	int input = 0;
 	int ret;
 
 	do {
-		ret = readline(client_info->connfd, &line, MAXLINELEN);
+		ret = rbuf_readline(rb, &line);
 		if (ret == ERROR) {
 			/* error */
-			logstr(GLOG_ERROR, "readline returned error");
+			logstr(GLOG_ERROR, "rbuf_readline returned error");
 			return PARSE_SYS_ERROR;
 		} else if (ret == EMPTY) {
 			/* connection closed */
 			logstr(GLOG_DEBUG, "connection closed by client");
 			return PARSE_CLOSED;
-		} else if (ret == DATA && strlen(line) == 0 && input == 0) {
+		} else if (ret == DATA && *line == '\0' && input == 0) {
 			logstr(GLOG_DEBUG, "connection close requested by client");
 			return PARSE_CLOSED;
 		}
 
+		/* the request starts with its first line, see trace_mark() */
+		if (0 == input)
+			clock_gettime(CLOCK_TYPE, &grey_tuple->arrival);
 		input = 1;
 
-		/* matching switch */
-		match = try_match("sender=", line);
-		if (match) {
-			grey_tuple->sender = match;
-			logstr(GLOG_DEBUG, "sender=%s", match);
-			continue;
+		if (strlen(line) >= MAXLINELEN)
+			line[MAXLINELEN - 1] = '\0';
+		parse_attribute(grey_tuple, line, &client_info->single_query);
+	} while (*line);
+
+	ret = check_request(grey_tuple);
+	if (ret < 0)
+		return PARSE_ERROR;
+	else
+		return PARSE_OK;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * The reactor. With postfix_io_threads set the connections do not get
+ * a thread each. A few I/O threads wait on all of them with epoll, and
+ * only complete requests needing checks are passed to the postfix pool.
+ * The I/O thread answers the rest itself. An idle connection costs no
+ * thread.
+ *
+ * The requests of a connection are pipelined. The parsing goes ahead of
+ * the checks, and up to POSTFIX_PIPELINE requests of a connection run
+ * at the same time, so a slow request does not hold up the ones sent
+ * after it. The responses are still written in the order of the
+ * requests, by whichever thread finds answered requests at the head of
+ * the line. They go to an output buffer of the connection and are
+ * written without blocking, what the socket does not take is left for
+ * the I/O thread to write on EPOLLOUT. A slow reader does not hold up
+ * the other connections of the thread.
+ *
+ * A connection is armed (EPOLLONESHOT) for input only while the
+ * pipeline has room and no output is waiting. Only the I/O thread
+ * frees a connection, so that no event can arrive for a freed one: a
+ * pool thread letting go of the last request arms EPOLLOUT to have the
+ * I/O thread come by.
+ */
+
+#define POSTFIX_EVENTS 64
+#define POSTFIX_PIPELINE 8	/* requests of a connection running at once */
+#define POSTFIX_OBUF 512	/* the initial output buffer */
+
+struct postfix_conn_s;
+
+typedef struct postfix_slot_s
+{
+	struct postfix_conn_s *conn;
+	grey_tuple_t *request;
+	final_status_t *status;	/* NULL if the request was not run */
+	int ret;		/* of test_tuple() */
+	bool done;
+	struct postfix_slot_s *next;	/* in the order of the requests */
+} postfix_slot_t;
+
+typedef struct postfix_conn_s
+{
+	int fd;
+	int epfd;		/* of the I/O thread */
+	char *ipstr;
+	pthread_mutex_t mx;	/* guards the rest */
+	grey_tuple_t *request;	/* being parsed */
+	postfix_slot_t *head;	/* the oldest request not answered */
+	postfix_slot_t *tail;
+	int inflight;		/* requests not answered */
+	uint32_t armed;		/* the events asked from epoll since the last one */
+	bool reading;		/* waiting for input, or being read by the I/O thread */
+	bool blocked;		/* waiting for the socket to take the output */
+	bool writing;		/* a thread is writing the responses */
+	bool closing;		/* no more requests are taken */
+	bool failed;		/* writing failed, the responses are dropped */
+	bool single_query;
+	bool eof;
+	rbuf_t rb;
+	char *obuf;		/* the responses not written yet */
+	size_t osize;
+	size_t ostart;
+	size_t oend;
+} postfix_conn_t;
+
+static thread_pool_t *query_pool;
+static int *reactor_epfds;	/* of the I/O threads */
+static int reactor_threads;
+
+static void conn_free(postfix_conn_t *conn);
+static int conn_parse(postfix_conn_t *conn);
+static void conn_submit(postfix_conn_t *conn);
+static int conn_pump(postfix_conn_t *conn);
+static void conn_append(postfix_conn_t *conn, struct iovec *iov, int n);
+static void conn_write(postfix_conn_t *conn);
+static bool conn_arm(postfix_conn_t *conn, uint32_t events);
+static bool conn_run(postfix_conn_t *conn);
+static void conn_event(postfix_conn_t *conn, uint32_t events);
+static void slot_done(postfix_slot_t *slot, final_status_t *status, int ret);
+static int postfix_query(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict);
+static void postfix_abandon(void *job);
+static void *postfix_reactor(void *arg);
+
+static void
+conn_free(postfix_conn_t *conn)
+{
+	logstr(GLOG_DEBUG, "closing postfix connection from %s", conn->ipstr);
+	/* closing the descriptor removes it from the epoll set */
+	close(conn->fd);
+	if (conn->request)
+		request_unlink(conn->request);
+	pthread_mutex_destroy(&conn->mx);
+	Free(conn->obuf);
+	Free(conn->ipstr);
+	Free(conn);
+}
+
+/*
+ * conn_parse	- parse the buffered lines into conn->request. Returns
+ * PARSE_MORE if the request is not complete yet.
+ */
+static int
+conn_parse(postfix_conn_t *conn)
+{
+	char *line;
+	size_t len;
+	int ret = PARSE_MORE;
+
+	while (PARSE_MORE == ret && (line = rbuf_line(&conn->rb, &len))) {
+		if (NULL == conn->request) {
+			if ('\0' == *line) {
+				logstr(GLOG_DEBUG, "connection close requested by client");
+				ret = PARSE_CLOSED;
+				break;
+			}
+			/* the request starts with its first line, see trace_mark() */
+			conn->request = request_new();
+			clock_gettime(CLOCK_TYPE, &conn->request->arrival);
 		}
-		match = try_match("recipient=", line);
-		if (match) {
-			grey_tuple->recipient = match;
-			logstr(GLOG_DEBUG, "recipient=%s", match);
+
+		if (*line) {
+			if (len >= MAXLINELEN)
+				line[MAXLINELEN - 1] = '\0';
+			parse_attribute(conn->request, line, &conn->single_query);
+		} else {
+			ret = check_request(conn->request) < 0 ? PARSE_ERROR : PARSE_OK;
+		}
+	}
+	return ret;
+}
+
+/*
+ * conn_submit	- queue the parsed request at the end of the line. It
+ * is answered right away if it needs no checks, see test_tuple_fast(),
+ * and passed to the postfix pool otherwise.
+ */
+static void
+conn_submit(postfix_conn_t *conn)
+{
+	postfix_slot_t *slot;
+	edict_t *edict;
+	int ret;
+
+	slot = Malloc(sizeof(postfix_slot_t));
+	memset(slot, 0, sizeof(postfix_slot_t));
+	slot->conn = conn;
+	slot->request = conn->request;
+	conn->request = NULL;
+
+	if (conn->tail)
+		conn->tail->next = slot;
+	else
+		conn->head = slot;
+	conn->tail = slot;
+	conn->inflight++;
+
+	slot->status = init_status("postfix", slot->request);
+	ret = test_tuple_fast(slot->status, slot->request);
+	if (TUPLE_CHECKS != ret) {
+		slot->ret = ret;
+		slot->done = true;
+		return;
+	}
+
+	edict = edict_get(0);
+	edict->job = (void *)slot;
+	edict->release = &postfix_abandon;
+	ret = submit_job(query_pool, edict);
+	edict_unlink(edict);
+	if (ret < 0) {
+		/* the pool is full, let the mail through */
+		logstr(GLOG_ERROR, "postfix pool full, request from %s not checked",
+		    conn->ipstr);
+		slot->status = NULL;
+		slot->ret = -1;
+		slot->done = true;
+	}
+}
+
+/*
+ * conn_pump	- start the buffered requests the pipeline has room for.
+ * Returns PARSE_MORE if it ran out of input, PARSE_OK if the pipeline
+ * is full and something else if no more requests are to be taken.
+ */
+static int
+conn_pump(postfix_conn_t *conn)
+{
+	int ret;
+
+	while (conn->inflight < POSTFIX_PIPELINE) {
+		ret = conn_parse(conn);
+		if (PARSE_OK == ret) {
+			conn_submit(conn);
+			if (conn->single_query) {
+				/* the client closes after this one */
+				conn->closing = true;
+				return PARSE_CLOSED;
+			}
 			continue;
 		}
-		match = try_match("client_address=", line);
-		if (match) {
-			grey_tuple->client_address = match;
-			logstr(GLOG_DEBUG, "client_address=%s", match);
+		if (PARSE_ERROR == ret)
+			logstr(GLOG_ERROR, "couldn't parse request, closing connection");
+		if (PARSE_MORE != ret)
+			conn->closing = true;
+		return ret;
+	}
+	return PARSE_OK;
+}
+
+/*
+ * conn_append	- add a response to the output buffer, only the writing
+ * thread touches it
+ */
+static void
+conn_append(postfix_conn_t *conn, struct iovec *iov, int n)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		len += iov[i].iov_len;
+
+	if (conn->oend + len > conn->osize) {
+		/* move the unwritten part to the front, and grow if need be */
+		memmove(conn->obuf, conn->obuf + conn->ostart, conn->oend - conn->ostart);
+		conn->oend -= conn->ostart;
+		conn->ostart = 0;
+		while (conn->oend + len > conn->osize)
+			conn->osize *= 2;
+		conn->obuf = realloc(conn->obuf, conn->osize);
+		if (NULL == conn->obuf)
+			daemon_fatal("realloc");
+	}
+
+	for (i = 0; i < n; i++) {
+		memcpy(conn->obuf + conn->oend, iov[i].iov_base, iov[i].iov_len);
+		conn->oend += iov[i].iov_len;
+	}
+}
+
+/*
+ * conn_write	- write the answered requests at the head of the line,
+ * and what was left over before. The lock is released for the writing,
+ * conn->writing keeps the other threads from writing at the same time.
+ * The socket is never waited for: if it does not take everything the
+ * connection is left blocked, and the I/O thread goes on on EPOLLOUT.
+ */
+static void
+conn_write(postfix_conn_t *conn)
+{
+	struct iovec iov[POSTFIX_IOV];
+	postfix_slot_t *slot, *first, *end, *next;
+	ssize_t n;
+	int count = 0;
+	int failed = 0;
+
+	/* take the answered ones off the line */
+	first = conn->head;
+	for (slot = first; slot && slot->done; slot = slot->next)
+		count++;
+	/* the head may move on while unlocked, the run ends here */
+	end = slot;
+	conn->head = end;
+	if (NULL == conn->head)
+		conn->tail = NULL;
+	conn->writing = true;
+	pthread_mutex_unlock(&conn->mx);
+
+	for (slot = first; slot != end; slot = next) {
+		next = slot->next;
+		if (!conn->failed)
+			conn_append(conn, iov, postfix_response(iov, slot->status, slot->ret));
+		if (slot->status)
+			finalize(slot->status);
+		request_unlink(slot->request);
+		Free(slot);
+	}
+
+	while (!conn->failed && conn->ostart < conn->oend) {
+		n = write(conn->fd, conn->obuf + conn->ostart, conn->oend - conn->ostart);
+		if (n > 0) {
+			conn->ostart += n;
 			continue;
 		}
-		match = try_match("helo_name=", line);
-		if (match) {
-			grey_tuple->helo_name = match;
-			logstr(GLOG_DEBUG, "helo_name=%s", match);
+		if (n < 0 && EINTR == errno)
 			continue;
+		if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+			break;
+		failed = n < 0 ? errno : EPIPE;
+		break;
+	}
+
+	pthread_mutex_lock(&conn->mx);
+	if (failed) {
+		logstr(GLOG_ERROR, "respond() failed for %s: %s", conn->ipstr, strerror(failed));
+		conn->failed = true;
+		conn->closing = true;
+	}
+	if (conn->failed || conn->ostart == conn->oend)
+		conn->ostart = conn->oend = 0;
+	else
+		conn->blocked = true;
+	conn->inflight -= count;
+	conn->writing = false;
+}
+
+/*
+ * conn_arm	- ask the I/O thread for the events, called with the lock
+ * held. Returns false if the connection can not be waited for.
+ */
+static bool
+conn_arm(postfix_conn_t *conn, uint32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = conn;
+	if (epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+		gerror("epoll_ctl");
+		conn->closing = true;
+		conn->failed = true;
+		conn->reading = false;
+		conn->blocked = false;
+		conn->ostart = conn->oend = 0;
+		return false;
+	}
+	conn->armed = events;
+	return true;
+}
+
+/*
+ * conn_run	- move the connection on after a change: write the
+ * responses due, start the buffered requests the pipeline has room
+ * for and arm the connection for what it waits for. Called with the
+ * lock held. Returns true if nobody holds the connection any more.
+ */
+static bool
+conn_run(postfix_conn_t *conn)
+{
+	uint32_t events;
+
+	for (;;) {
+		if (!conn->reading && !conn->blocked && !conn->closing
+		    && conn->inflight < POSTFIX_PIPELINE && PARSE_MORE == conn_pump(conn)) {
+			if (conn->eof)
+				conn->closing = true;
+			else
+				conn->reading = true;
 		}
-		match = try_match("grossd_mode=", line);
-		if (match) {
-			client_info->single_query = true;
-			logstr(GLOG_DEBUG, "Client requested a single connection mode");
+		if (!conn->writing && !conn->blocked
+		    && ((conn->head && conn->head->done) || conn->ostart < conn->oend)) {
+			conn_write(conn);
+			/* there may be room in the pipeline now */
 			continue;
 		}
+		break;
+	}
 
-	} while (strlen(line) > 0);
+	events = (conn->reading ? EPOLLIN : 0) | (conn->blocked ? EPOLLOUT : 0);
+	if (events && (events & ~conn->armed))
+		conn_arm(conn, events);
 
-	ret = check_request(grey_tuple);
-	if (ret < 0)
-		return PARSE_ERROR;
-	else
-		return PARSE_OK;
+	return !conn->reading && !conn->blocked && !conn->writing && 0 == conn->inflight;
 }
 
 /*
- * The main worker thread for tcp_protocol. Listens for connections
- * and starts a new thread to handle each connection.
+ * conn_event	- an event of the connection, in the I/O thread: read
+ * what the client has sent and write what the socket takes
  */
-static void *
-postfix_server(void *arg)
+static void
+conn_event(postfix_conn_t *conn, uint32_t events)
+{
+	ssize_t n;
+	bool idle;
+
+	pthread_mutex_lock(&conn->mx);
+	/* the event is spent */
+	conn->armed = 0;
+
+	if (conn->reading && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+		/* the lines of the last round have been parsed */
+		while (conn->rb.start > 0 || conn->rb.end < RBUFSZ) {
+			n = rbuf_fill(&conn->rb);
+			if (n > 0)
+				continue;
+			if (0 == n) {
+				logstr(GLOG_DEBUG, "connection closed by client");
+				conn->eof = true;
+			} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				gerror("read");
+				conn->eof = true;
+			}
+			break;
+		}
+		conn->reading = false;
+	}
+	if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+		conn->blocked = false;
+
+	idle = conn_run(conn);
+	pthread_mutex_unlock(&conn->mx);
+
+	if (idle)
+		conn_free(conn);
+}
+
+/*
+ * slot_done	- the request has been run, answer it in its turn. If it
+ * was the last thing holding the connection, the I/O thread is asked
+ * over to free it. Only if that fails nothing can come for the
+ * connection any more, and it is freed here.
+ */
+static void
+slot_done(postfix_slot_t *slot, final_status_t *status, int ret)
 {
+	postfix_conn_t *conn = slot->conn;
+	bool idle;
+
+	pthread_mutex_lock(&conn->mx);
+	slot->status = status;
+	slot->ret = ret;
+	slot->done = true;
+	idle = conn_run(conn) && 0 == conn->armed && !conn_arm(conn, EPOLLOUT);
+	pthread_mutex_unlock(&conn->mx);
+
+	if (idle)
+		conn_free(conn);
+}
+
+/*
+ * postfix_query	- run a request of a reactor connection
+ */
+static int
+postfix_query(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
+{
+	postfix_slot_t *slot;
+	final_status_t *status;
 	int ret;
-	int grossfd;
-	int opt;
-	client_info_t *client_info;
-	socklen_t clen;
-	thread_pool_t *postfix_pool;
-	edict_t *edict;
 
-	/* create socket for incoming requests */
-	grossfd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (grossfd < 0)
-		daemon_fatal("postfix_server: socket");
-	opt = 1;
-	ret = setsockopt(grossfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-	if (ret < 0)
-		daemon_fatal("setsockopt (SO_REUSEADDR)");
+	slot = (postfix_slot_t *)edict->job;
+	status = slot->status;
+	ret = test_tuple(status, slot->request, NULL);
+	slot_done(slot, status, ret);
 
-	ret = bind(grossfd, (struct sockaddr *)&(ctx->config.gross_host), sizeof(struct sockaddr_in));
-	if (ret < 0)
-		daemon_fatal("bind");
+	return 0;
+}
 
-	ret = listen(grossfd, MAXCONNQ);
-	if (ret < 0)
-		daemon_fatal("listen");
+/*
+ * postfix_abandon	- the pool could not run the request, let the
+ * mail through. See edict->release.
+ */
+static void
+postfix_abandon(void *job)
+{
+	postfix_slot_t *slot = (postfix_slot_t *)job;
+
+	logstr(GLOG_ERROR, "postfix request from %s not checked", slot->conn->ipstr);
+	slot_done(slot, NULL, -1);
+}
+
+/*
+ * postfix_reactor	- an I/O thread
+ */
+static void *
+postfix_reactor(void *arg)
+{
+	struct epoll_event events[POSTFIX_EVENTS];
+	int epfd;
+	int i, n;
+
+	epfd = *(int *)arg;
+	for (;;) {
+		n = epoll_wait(epfd, events, POSTFIX_EVENTS, -1);
+		if (n < 0) {
+			if (EINTR == errno)
+				continue;
+			daemon_fatal("epoll_wait");
+		}
+		for (i = 0; i < n; i++)
+			conn_event((postfix_conn_t *)events[i].data.ptr, events[i].events);
+	}
+	/* NOTREACHED */
+	return NULL;
+}
+
+/*
+ * postfix_reactor_init	- start the postfix pool and the I/O threads
+ */
+static void
+postfix_reactor_init(void)
+{
+	int i;
 
-	/* initialize the thread pool */
 	logstr(GLOG_INFO, "initializing postfix thread pool");
-	postfix_pool = create_thread_pool("postfix", &postfix_connection, NULL, NULL);
-	if (postfix_pool == NULL)
+	query_pool = create_thread_pool("postfix", &postfix_query, NULL, NULL);
+	if (query_pool == NULL)
 		daemon_fatal("create_thread_pool");
 
+	reactor_threads = ctx->config.postfix_io_threads;
+	reactor_epfds = Malloc(reactor_threads * sizeof(int));
+	for (i = 0; i < reactor_threads; i++) {
+		reactor_epfds[i] = epoll_create(POSTFIX_EVENTS);
+		if (reactor_epfds[i] < 0)
+			daemon_fatal("epoll_create");
+		create_thread(NULL, DETACH, &postfix_reactor, &reactor_epfds[i]);
+	}
+	logstr(GLOG_INFO, "postfix policy server running %d I/O threads", reactor_threads);
+}
+
+/*
+ * postfix_reactor_accept	- accept the connections of a listener and
+ * divide them between the I/O threads
+ */
+static void
+postfix_reactor_accept(listener_t *listener)
+{
+	struct sockaddr_storage caddr;
+	struct epoll_event ev;
+	postfix_conn_t *conn;
+	socklen_t clen;
+	int next = listener->index;
+	int fd;
+
+	for (;;) {
+		clen = sizeof(caddr);
+		logstr(GLOG_INSANE, "waiting for connections");
+		fd = accept(listener->fd, (struct sockaddr *)&caddr, &clen);
+		if (fd < 0) {
+			if (errno != EINTR)
+				daemon_fatal("accept()");
+			continue;
+		}
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+			gerror("fcntl");
+			close(fd);
+			continue;
+		}
+
+		conn = Malloc(sizeof(postfix_conn_t));
+		memset(conn, 0, sizeof(postfix_conn_t));
+		conn->fd = fd;
+		conn->epfd = reactor_epfds[next++ % reactor_threads];
+		conn->ipstr = ipstr((struct sockaddr *)&caddr);
+		pthread_mutex_init(&conn->mx, NULL);
+		conn->reading = true;
+		conn->armed = EPOLLIN;
+		conn->osize = POSTFIX_OBUF;
+		conn->obuf = Malloc(conn->osize);
+		rbuf_init(&conn->rb, fd);
+		logstr(GLOG_DEBUG, "postfix client connected from %s", conn->ipstr);
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = conn;
+		if (epoll_ctl(conn->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			gerror("epoll_ctl");
+			conn_free(conn);
+		}
+	}
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
+/*
+ * The listener threads for tcp_protocol. They accept the connections
+ * and pass them to the reactor, or to the postfix pool for a thread
+ * each.
+ */
+static thread_pool_t *postfix_pool;
+
+static void *
+postfix_listener(listener_t *listener)
+{
+	client_info_t *client_info;
+	socklen_t clen;
+	edict_t *edict;
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (ctx->config.postfix_io_threads > 0) {
+		postfix_reactor_accept(listener);
+		/* NOT REACHED */
+	}
+#endif /* HAVE_SYS_EPOLL_H */
+
 	/* server loop */
 	for (;;) {
 		/* client_info struct is free()d by the worker thread */
 		client_info = Malloc(sizeof(client_info_t));
 		memset(client_info, 0, sizeof(client_info_t));
-		client_info->caddr = Malloc(sizeof(struct sockaddr_in));
+		client_info->caddr = Malloc(sizeof(struct sockaddr_storage));
 
-		clen = sizeof(struct sockaddr_in);
+		clen = sizeof(struct sockaddr_storage);
 
 		logstr(GLOG_INSANE, "waiting for connections");
-		client_info->connfd = accept(grossfd, (struct sockaddr *)client_info->caddr, &clen);
+		client_info->connfd = accept(listener->fd, (struct sockaddr *)client_info->caddr, &clen);
 		if (client_info->connfd < 0) {
 			if (errno != EINTR)
 				daemon_fatal("accept()");
@@ -260,19 +822,47 @@ postfix_server(void *arg)
 			/* a client is connected, handle the
 			 * connection over to a worker thread
 			 */
-			client_info->ipstr = ipstr(client_info->caddr);
+			client_info->caddrlen = clen;
+			client_info->ipstr = ipstr((struct sockaddr *)client_info->caddr);
 			/* Write the edict */
-			edict = edict_get(true);
+			edict = edict_get(0);
 			edict->job = (void *)client_info;
 			submit_job(postfix_pool, edict);
 			edict_unlink(edict);
 		}
 	}
+	/* NOTREACHED */
+	return NULL;
 }
 
 void
 postfix_server_init()
 {
+	pool_limits_t limits;
+
 	logstr(GLOG_INFO, "starting postfix policy server");
-	create_thread(&ctx->process_parts.postfix_server, DETACH, &postfix_server, NULL);
+#ifdef HAVE_SYS_EPOLL_H
+	if (ctx->config.postfix_io_threads > 0)
+		postfix_reactor_init();
+	else
+#endif /* HAVE_SYS_EPOLL_H */
+	{
+		/*
+		 * A connection holds its thread until the client leaves,
+		 * so the spawn rate must not stall a full listen backlog.
+		 */
+		memset(&limits, 0, sizeof(limits));
+		limits.min_thread = ctx->config.pool_minthreads;
+		limits.idle_time = ctx->config.pool_idle_time;
+
+		/* initialize the thread pool */
+		logstr(GLOG_INFO, "initializing postfix thread pool");
+		postfix_pool = create_thread_pool("postfix", &postfix_connection, &limits, NULL);
+		if (postfix_pool == NULL)
+			daemon_fatal("create_thread_pool");
+	}
+	start_listeners(&ctx->process_parts.postfix_server, SOCK_STREAM, ctx->config.postfix.listen,
+	    &postfix_listener);
+	logstr(GLOG_INFO, "postfix policy server listening in %d threads",
+	    ctx->config.listen_threads);
 }
@@ -18,16 +18,87 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/* for recvmmsg() and sendmmsg() */
+#define _GNU_SOURCE
+
+#include <pthread.h>
+
 #include "common.h"
 #include "proto_sjsms.h"
 #include "srvutils.h"
 #include "worker.h"
 #include "utils.h"
+#include "listener.h"
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+# define SJSMS_MMSG
+typedef struct mmsghdr mmsghdr_t;
+#else
+typedef struct
+{
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+} mmsghdr_t;
+#endif /* HAVE_RECVMMSG && HAVE_SENDMMSG */
+
+#define SJSMS_BATCH	16	/* datagrams per recvmmsg() and sendmmsg() */
+#define SJSMS_SPARE	256	/* free datagram buffers kept for reuse */
+
+/*
+ * The responses to a socket are queued in two batches. The worker
+ * finding no flush in progress sends the batch being filled and any
+ * responses queued meanwhile, the others only queue theirs.
+ */
+typedef struct
+{
+	struct sockaddr_storage caddr;
+	socklen_t caddrlen;
+	size_t len;
+	char data[MAXLINELEN];
+} sjsms_reply_t;
+
+typedef struct
+{
+	int fd;
+	pthread_mutex_t mx;
+	bool flushing;
+	int fill;		/* the batch being filled */
+	int count[2];
+	sjsms_reply_t batch[2][SJSMS_BATCH];
+} sjsms_socket_t;
+
+/* a received datagram, recycled through the free list */
+typedef struct sjsms_dgram_s
+{
+	client_info_t client_info;	/* the job, must be first */
+	sjsms_socket_t *sock;
+	grey_tuple_t *tuple;	/* parsed by the receiver, or NULL */
+	final_status_t *status;
+	struct sockaddr_storage caddr;
+	char ipstr[INET_ADDRSTRLEN];
+	char message[MAXLINELEN];
+	struct sjsms_dgram_s *next;	/* linked list */
+} sjsms_dgram_t;
+
+static pthread_mutex_t dgram_mx = PTHREAD_MUTEX_INITIALIZER;
+static sjsms_dgram_t *dgram_free;
+static int dgram_nfree;
 
 /* internal functions */
 int mappingstr(const char *from, char *to, size_t len);
-char *assemble_mapresult(char *template, char *reason);
+char *assemble_mapresult(char *result, size_t len, const response_template_t *template,
+    const char *reason);
 grey_tuple_t *unfold(grey_req_t *request);
+static sjsms_dgram_t *dgram_get(void);
+static void dgram_put(sjsms_dgram_t *dgram);
+static void sjsms_flush(sjsms_socket_t *sock, sjsms_reply_t *batch, int count);
+static void sjsms_respond(sjsms_dgram_t *dgram, const char *response, size_t len);
+static void sjsms_message(client_info_t *client_info, sjsms_msg_t *msg);
+static void sjsms_text(client_info_t *client_info, sjsms_msg_t *msg, int level, const char *what);
+static grey_tuple_t *sjsms_parse(sjsms_msg_t *msg);
+static void sjsms_answer(sjsms_dgram_t *dgram, final_status_t *status, int ret);
+static bool sjsms_inline(sjsms_dgram_t *dgram);
+static void sjsms_abandon(void *job);
 
 int
 mappingstr(const char *from, char *to, size_t len)
@@ -55,31 +126,15 @@ mappingstr(const char *from, char *to, size_t len)
 
 
 char *
-assemble_mapresult(char *template, char *reason)
+assemble_mapresult(char *result, size_t len, const response_template_t *template, const char *reason)
 {
-	char result[MAXLINELEN] = { '\0' };
-	char *reasonsubstitute;
-	char *prologue;
-	char *epilogue;
 	char mapreason[MAXLINELEN] = { '\0' };
 
 	/* convert the reason string to mapping format */
-	mappingstr(reason, mapreason, MAXLINELEN);
-
-	/* ignore the reason if template does not use it */
-	prologue = strdup(template);
-	reasonsubstitute = strstr(prologue, REASONTEMPLATE);
-	if (NULL == reasonsubstitute) {
-		snprintf(result, MAXLINELEN, "%s", prologue);
-	} else {
-		/* null terminate the first part */
-		*reasonsubstitute = '\0';
-		epilogue = reasonsubstitute + strlen(REASONTEMPLATE);
-		snprintf(result, MAXLINELEN, "%s%s%s", prologue, mapreason, epilogue);
-	}
-	Free(prologue);
+	if (template->epilogue)
+		mappingstr(reason, mapreason, MAXLINELEN);
 
-	return strdup(result);
+	return expand_template(result, len, template, mapreason);
 }
 
 grey_tuple_t *
@@ -90,7 +145,7 @@ parsequery(const char *request)
 	int ret;
 
 	tuple = request_new();
-	start = end = copy = strdup(request);
+	start = end = copy = arena_strdup(tuple->arena, request);
 
 	/* for each line */
 	do {
@@ -107,11 +162,9 @@ parsequery(const char *request)
 		end++;
 	} while (1);
 
-	Free(copy);
-
 	ret = check_request(tuple);
 	if (ret < 0) {
-		Free(tuple);
+		request_unlink(tuple);
 		errno = ENOMSG;
 		return NULL;
 	}
@@ -133,16 +186,144 @@ unfold(grey_req_t *request)
 
 	if (sender >= MAXLINELEN ||
 	    recipient >= MAXLINELEN || client_address >= MAXLINELEN || helo_name >= MAXLINELEN) {
+		request_unlink(tuple);
 		errno = ENOMSG;
 		return NULL;
 	}
-	tuple->sender = strdup(request->message + sender);
-	tuple->recipient = strdup(request->message + recipient);
-	tuple->client_address = strdup(request->message + client_address);
-	tuple->helo_name = strdup("<unknown>");
+	tuple->sender = arena_strdup(tuple->arena, request->message + sender);
+	tuple->recipient = arena_strdup(tuple->arena, request->message + recipient);
+	tuple->client_address = arena_strdup(tuple->arena, request->message + client_address);
+	tuple->helo_name = arena_strdup(tuple->arena, "<unknown>");
 	return tuple;
 }
 
+/*
+ * dgram_get	- a datagram buffer from the free list or a new one
+ */
+static sjsms_dgram_t *
+dgram_get(void)
+{
+	sjsms_dgram_t *dgram;
+
+	pthread_mutex_lock(&dgram_mx);
+	dgram = dgram_free;
+	if (dgram) {
+		dgram_free = dgram->next;
+		dgram_nfree--;
+	}
+	pthread_mutex_unlock(&dgram_mx);
+
+	if (NULL == dgram)
+		dgram = Malloc(sizeof(sjsms_dgram_t));
+	memset(&dgram->client_info, 0, sizeof(client_info_t));
+	dgram->tuple = NULL;
+	dgram->status = NULL;
+	dgram->client_info.caddr = &dgram->caddr;
+	dgram->client_info.ipstr = dgram->ipstr;
+	dgram->client_info.message = dgram->message;
+	return dgram;
+}
+
+/*
+ * dgram_put	- return a datagram buffer to the free list
+ */
+static void
+dgram_put(sjsms_dgram_t *dgram)
+{
+	pthread_mutex_lock(&dgram_mx);
+	if (dgram_nfree < SJSMS_SPARE) {
+		dgram->next = dgram_free;
+		dgram_free = dgram;
+		dgram_nfree++;
+		dgram = NULL;
+	}
+	pthread_mutex_unlock(&dgram_mx);
+
+	if (dgram)
+		Free(dgram);
+}
+
+/*
+ * sjsms_flush	- send a batch of responses
+ */
+static void
+sjsms_flush(sjsms_socket_t *sock, sjsms_reply_t *batch, int count)
+{
+	mmsghdr_t msgs[SJSMS_BATCH];
+	struct iovec iov[SJSMS_BATCH];
+	int i, ret;
+
+	memset(msgs, 0, count * sizeof(mmsghdr_t));
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = batch[i].data;
+		iov[i].iov_len = batch[i].len;
+		msgs[i].msg_hdr.msg_name = &batch[i].caddr;
+		msgs[i].msg_hdr.msg_namelen = batch[i].caddrlen;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	i = 0;
+	while (i < count) {
+#ifdef SJSMS_MMSG
+		ret = sendmmsg(sock->fd, msgs + i, count - i, 0);
+#else
+		ret = sendmsg(sock->fd, &msgs[i].msg_hdr, 0) < 0 ? -1 : 1;
+#endif /* SJSMS_MMSG */
+		if (ret < 0) {
+			if (EINTR == errno)
+				continue;
+			/* skip the response that failed */
+			gerror("sjsms: sendmmsg");
+			ret = 1;
+		}
+		i += ret;
+	}
+}
+
+/*
+ * sjsms_respond	- queue a response to the client of dgram
+ */
+static void
+sjsms_respond(sjsms_dgram_t *dgram, const char *response, size_t len)
+{
+	sjsms_socket_t *sock = dgram->sock;
+	sjsms_reply_t *reply;
+	int b;
+
+	pthread_mutex_lock(&sock->mx);
+	b = sock->fill;
+	if (SJSMS_BATCH == sock->count[b]) {
+		/* the flush is behind, do not wait for it */
+		pthread_mutex_unlock(&sock->mx);
+		sendto(sock->fd, response, len, 0, (struct sockaddr *)&dgram->caddr,
+		    dgram->client_info.caddrlen);
+		return;
+	}
+	reply = &sock->batch[b][sock->count[b]++];
+	memcpy(&reply->caddr, &dgram->caddr, dgram->client_info.caddrlen);
+	reply->caddrlen = dgram->client_info.caddrlen;
+	reply->len = MIN(len, MAXLINELEN);
+	memcpy(reply->data, response, reply->len);
+
+	if (sock->flushing) {
+		pthread_mutex_unlock(&sock->mx);
+		return;
+	}
+
+	sock->flushing = true;
+	while (sock->count[sock->fill] > 0) {
+		b = sock->fill;
+		sock->fill = !b;
+		pthread_mutex_unlock(&sock->mx);
+		sjsms_flush(sock, sock->batch[b], sock->count[b]);
+		pthread_mutex_lock(&sock->mx);
+		sock->count[b] = 0;
+	}
+	sock->flushing = false;
+	pthread_mutex_unlock(&sock->mx);
+}
+
 /*
  *timeout action for sending the 1 second "PROGRESS" packet
  */
@@ -151,44 +332,135 @@ calm_client(void *arg, mseconds_t timeused)
 {
 	client_info_t *client_info;
 	char response = 'P';
-	socklen_t len;
 
-	len = sizeof(struct sockaddr_in);
 	client_info = (client_info_t *)arg;
-	sendto(client_info->connfd, &response, 1, 0, (struct sockaddr *)client_info->caddr, len);
+	sendto(client_info->connfd, &response, 1, 0, (struct sockaddr *)client_info->caddr,
+	    client_info->caddrlen);
 
 	logstr(GLOG_DEBUG, "timeout: used %d ms. PROGRESS sent", timeused);
 }
 
 /*
- * sjsms_connection    - the actual greylist server
+ * sjsms_message	- the message of a datagram in host order
  */
-int
-sjsms_connection(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
+static void
+sjsms_message(client_info_t *client_info, sjsms_msg_t *msg)
+{
+	/* clean the input */
+	memset(msg, 0, sizeof(sjsms_msg_t));
+	memcpy(msg, client_info->message, MIN(client_info->msglen, sizeof(sjsms_msg_t)));
+
+	sjsms_to_host_order(msg);
+}
+
+/*
+ * sjsms_text	- log a text message of a client. msglen comes from the
+ * client, so it is checked against the buffer and the datagram.
+ */
+static void
+sjsms_text(client_info_t *client_info, sjsms_msg_t *msg, int level, const char *what)
+{
+	char str[MAXLINELEN];
+	int len;
+
+	len = MIN(msg->msglen, MAXLINELEN);
+	len = MIN(len, client_info->msglen - (int)(2 * sizeof(uint16_t)));
+	if (len <= 0) {
+		logstr(GLOG_ERROR, "Empty message from client %s", client_info->ipstr);
+		return;
+	}
+	memcpy(str, msg->message, len);
+	str[len - 1] = '\0';
+	logstr(level, "Client %s %s: %s", client_info->ipstr, what, str);
+}
+
+/*
+ * sjsms_parse	- the tuple of a query message, NULL on error
+ */
+static grey_tuple_t *
+sjsms_parse(sjsms_msg_t *msg)
 {
-	socklen_t len;
 	grey_req_t request;
-	sjsms_msg_t *msg;
 	grey_tuple_t *tuple;
+	char *querystr;
+
+	if (MSGTYPE_QUERY == msg->msgtype) {
+		recvquery(msg, &request);
+		tuple = unfold(&request);
+	} else {
+		querystr = recvquerystr(msg);
+		tuple = parsequery(querystr);
+		Free(querystr);
+	}
+
+	/* FIX: shouldn't crash the whole server */
+	if (!tuple)
+		logstr(GLOG_ERROR, "unfold: %s", strerror(errno));
+	return tuple;
+}
+
+/*
+ * sjsms_answer	- respond to a query with the verdict
+ */
+static void
+sjsms_answer(sjsms_dgram_t *dgram, final_status_t *status, int ret)
+{
 	char response[MAXLINELEN];
-	final_status_t *status;
+	char mapstr[MAXLINELEN - 2];	/* the room after the verdict */
+
+	if (ret < 0) {
+		snprintf(response, MAXLINELEN, "F");
+	} else {
+		switch (status->status) {
+		case STATUS_MATCH:
+			snprintf(response, MAXLINELEN, "M %s", ctx->config.sjsms.responsematch);
+			break;
+		case STATUS_GREY:
+			assemble_mapresult(mapstr, sizeof(mapstr), &ctx->config.sjsms.responsegrey,
+			    status->reason);
+			snprintf(response, MAXLINELEN, "G %s", mapstr);
+			break;
+		case STATUS_BLOCK:
+			assemble_mapresult(mapstr, sizeof(mapstr), &ctx->config.sjsms.responseblock,
+			    status->reason);
+			snprintf(response, MAXLINELEN, "B %s", mapstr);
+			break;
+		case STATUS_TRUST:
+			snprintf(response, MAXLINELEN, "T %s", ctx->config.sjsms.responsetrust);
+			break;
+		default:
+			snprintf(response, MAXLINELEN, "F");
+		}
+	}
+
+	response[MAXLINELEN - 1] = '\0';
+
+	sjsms_respond(dgram, response, strlen(response));
+}
+
+/*
+ * sjsms_connection    - the actual greylist server. A query the
+ * receiver has parsed comes with its tuple and status.
+ */
+int
+sjsms_connection(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
+{
+	sjsms_dgram_t *dgram;
+	sjsms_msg_t msg;
+	grey_tuple_t *tuple;
+	final_status_t *status = NULL;
 	int ret;
 	tmout_action_t ta1, ta2;
-	char *mapstr;
-	char *str;
 	client_info_t *client_info;
-	char *querystr = NULL;
 
 	client_info = edict->job;
 	assert(client_info);
 	assert(0 < client_info->msglen);
 	assert(client_info->msglen <= MSGSZ);
+	dgram = (sjsms_dgram_t *)client_info;
 
 	logstr(GLOG_DEBUG, "query from %s", client_info->ipstr);
 
-	/* default response is 'FAIL' */
-	strncpy(response, "F", MAXLINELEN);
-
 	if (ctx->config.query_timelimit > 1000) {
 		/* build the tmout_action_t list */
 		ta1.timeout = 1000;	/* 1 second */
@@ -205,156 +477,187 @@ sjsms_connection(thread_pool_t *info, thread_ctx_t *thread_ctx, edict_t *edict)
 		ta1.next = NULL;
 	}
 
-	/* clean the input */
-	msg = Malloc(sizeof(sjsms_msg_t));
-	memset(msg, 0, sizeof(sjsms_msg_t));
-	memcpy(msg, client_info->message, client_info->msglen);
-
-	sjsms_to_host_order(msg);
-
-	switch (msg->msgtype) {
-	case MSGTYPE_QUERY:
-	case MSGTYPE_QUERY_V2:
-		if (MSGTYPE_QUERY == msg->msgtype) {
-			recvquery(msg, &request);
-			tuple = unfold(&request);
-		} else {
-			querystr = recvquerystr(msg);
-			tuple = parsequery(querystr);
-			Free(querystr);
-		}
-
-		/* FIX: shouldn't crash the whole server */
-		if (!tuple) {
-			logstr(GLOG_ERROR, "unfold: %s", strerror(errno));
-			goto OUT;
+	tuple = dgram->tuple;
+	status = dgram->status;
+	if (NULL == tuple) {
+		sjsms_message(client_info, &msg);
+
+		switch (msg.msgtype) {
+		case MSGTYPE_QUERY:
+		case MSGTYPE_QUERY_V2:
+			tuple = sjsms_parse(&msg);
+			if (tuple)
+				status = init_status("sjsms", tuple);
+			break;
+		case MSGTYPE_LOGMSG:
+			sjsms_text(client_info, &msg, GLOG_ERROR, "said");
+			break;
+		case MSGTYPE_STATS:
+			sjsms_text(client_info, &msg, GLOG_INFO, "grosscheck stats");
+			break;
+		default:
+			logstr(GLOG_ERROR, "Unknown message from client %s", client_info->ipstr);
+			break;
 		}
+	}
 
-		status = init_status("sjsms");
-
+	if (tuple) {
 		/* We are go */
 		ret = test_tuple(status, tuple, &ta1);
-
-		if (ret < 0) {
-			snprintf(response, MAXLINELEN, "F");
-		} else {
-			switch (status->status) {
-			case STATUS_MATCH:
-				snprintf(response, MAXLINELEN, "M %s", ctx->config.sjsms.responsematch);
-				break;
-			case STATUS_GREY:
-				mapstr = assemble_mapresult(ctx->config.sjsms.responsegrey, status->reason);
-				snprintf(response, MAXLINELEN, "G %s", mapstr);
-				Free(mapstr);
-				break;
-			case STATUS_BLOCK:
-				mapstr = assemble_mapresult(ctx->config.sjsms.responseblock, status->reason);
-				snprintf(response, MAXLINELEN, "B %s", mapstr);
-				Free(mapstr);
-				break;
-			case STATUS_TRUST:
-				snprintf(response, MAXLINELEN, "T %s", ctx->config.sjsms.responsetrust);
-				break;
-			default:
-				snprintf(response, MAXLINELEN, "F");
-			}
-		}
-
-		response[MAXLINELEN - 1] = '\0';
-
-		len = sizeof(struct sockaddr_in);
-		sendto(client_info->connfd, response, strlen(response),
-		    0, (struct sockaddr *)client_info->caddr, len);
+		sjsms_answer(dgram, status, ret);
 
 		finalize(status);
 		request_unlink(tuple);
-		break;
-	case MSGTYPE_LOGMSG:
-		str = (char *)Malloc(msg->msglen);
-		memcpy(str, msg->message, MIN(msg->msglen, MAXLINELEN));
-		str[msg->msglen - 1] = '\0';
-		logstr(GLOG_ERROR, "Client %s said: %s", client_info->ipstr, str);
-		Free(str);
-		break;
-	default:
-		logstr(GLOG_ERROR, "Unknown message from client %s", client_info->ipstr);
-		break;
 	}
-      OUT:
-
-	Free(msg);
 
-	free_client_info(client_info);
+	dgram_put(dgram);
 	logstr(GLOG_DEBUG, "sjsms_connection returning");
 
 	return 1;
 }
 
 /*
- * The main worker thread for udp protocol. It first initializes
- * worker thread pool. Then, it listens for requests and
- * and feeds them to the thread pool.
+ * sjsms_inline	- answer a query in the receiver thread if it needs no
+ * checks, see test_tuple_fast(). Returns false if the datagram is to
+ * be passed to the pool.
  */
+static bool
+sjsms_inline(sjsms_dgram_t *dgram)
+{
+	sjsms_msg_t msg;
+	int ret;
+
+	sjsms_message(&dgram->client_info, &msg);
+	if (MSGTYPE_QUERY != msg.msgtype && MSGTYPE_QUERY_V2 != msg.msgtype)
+		return false;
+
+	dgram->tuple = sjsms_parse(&msg);
+	if (NULL == dgram->tuple) {
+		dgram_put(dgram);
+		return true;
+	}
+	dgram->status = init_status("sjsms", dgram->tuple);
+	ret = test_tuple_fast(dgram->status, dgram->tuple);
+	if (TUPLE_CHECKS == ret)
+		return false;
+
+	sjsms_answer(dgram, dgram->status, ret);
+	finalize(dgram->status);
+	request_unlink(dgram->tuple);
+	dgram_put(dgram);
+	return true;
+}
+
+/*
+ * sjsms_abandon	- the pool could not run the query, the client
+ * will ask again. See edict->release.
+ */
+static void
+sjsms_abandon(void *job)
+{
+	sjsms_dgram_t *dgram = (sjsms_dgram_t *)job;
+
+	if (dgram->tuple) {
+		finalize(dgram->status);
+		request_unlink(dgram->tuple);
+	}
+	dgram_put(dgram);
+}
+
+/*
+ * The receiver threads for udp protocol. Each one receives batches
+ * of requests on its socket and feeds them to the thread pool.
+ */
+static thread_pool_t *sjsms_pool;
+
 static void *
-sjsms_server(void *arg)
+sjsms_receiver(listener_t *listener)
 {
-	int grossfd, ret, msglen;
-	socklen_t clen;
-	client_info_t *client_info;
-	char mesg[MAXLINELEN];
+	sjsms_dgram_t *dgram[SJSMS_BATCH];
+	mmsghdr_t msgs[SJSMS_BATCH];
+	struct iovec iov[SJSMS_BATCH];
+	sjsms_socket_t *sock;
 	edict_t *edict;
-	thread_pool_t *sjsms_pool;
+	int i, n;
 
-	grossfd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	if (grossfd < 0)
-		daemon_fatal("socket");
+	sock = Malloc(sizeof(sjsms_socket_t));
+	memset(sock, 0, sizeof(sjsms_socket_t));
+	sock->fd = listener->fd;
+	pthread_mutex_init(&sock->mx, NULL);
 
-	ret = bind(grossfd, (struct sockaddr *)&(ctx->config.gross_host), sizeof(struct sockaddr_in));
-	if (ret < 0)
-		daemon_fatal("bind");
-
-	/* initialize the thread pool */
-	logstr(GLOG_INFO, "initializing sjsms worker thread pool");
-	sjsms_pool = create_thread_pool("sjsms", &sjsms_connection, NULL, NULL);
-	if (sjsms_pool == NULL)
-		daemon_fatal("create_thread_pool");
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < SJSMS_BATCH; i++)
+		dgram[i] = NULL;
 
 	/* server loop */
 	for (;;) {
-		/* client_info struct is free()d by the worker thread */
-		client_info = Malloc(sizeof(client_info_t));
-		memset(client_info, 0, sizeof(client_info_t));
-		client_info->caddr = Malloc(sizeof(struct sockaddr_in));
-
-		clen = sizeof(struct sockaddr_in);
-		msglen = recvfrom(grossfd, mesg, MAXLINELEN, 0, (struct sockaddr *)client_info->caddr, &clen);
+		/* the buffers are returned to the free list by the worker thread */
+		for (i = 0; i < SJSMS_BATCH; i++) {
+			if (NULL == dgram[i]) {
+				dgram[i] = dgram_get();
+				dgram[i]->sock = sock;
+				iov[i].iov_base = dgram[i]->message;
+				iov[i].iov_len = MAXLINELEN;
+				msgs[i].msg_hdr.msg_name = &dgram[i]->caddr;
+				msgs[i].msg_hdr.msg_iov = &iov[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+		}
 
-		if (msglen < 0) {
+#ifdef SJSMS_MMSG
+		n = recvmmsg(listener->fd, msgs, SJSMS_BATCH, MSG_WAITFORONE, NULL);
+#else
+		n = recvmsg(listener->fd, &msgs[0].msg_hdr, 0);
+		if (n >= 0) {
+			msgs[0].msg_len = n;
+			n = 1;
+		}
+#endif /* SJSMS_MMSG */
+		if (n < 0) {
 			if (errno == EINTR)
 				continue;
-			daemon_fatal("recvfrom");
-			free_client_info(client_info);
-			return NULL;
-		} else {
-			client_info->message = Malloc(msglen);
-			client_info->connfd = grossfd;
-			client_info->msglen = msglen;
-			client_info->ipstr = ipstr(client_info->caddr);
-			memcpy(client_info->message, mesg, msglen);
+			daemon_fatal("recvmmsg");
+		}
+
+		for (i = 0; i < n; i++) {
+			if (0 == msgs[i].msg_len)
+				continue;
+			dgram[i]->client_info.connfd = listener->fd;
+			dgram[i]->client_info.msglen = msgs[i].msg_len;
+			dgram[i]->client_info.caddrlen = msgs[i].msg_hdr.msg_namelen;
+			ipstr_r((struct sockaddr *)&dgram[i]->caddr, dgram[i]->ipstr);
+
+			if (sjsms_inline(dgram[i])) {
+				dgram[i] = NULL;
+				continue;
+			}
 
 			/* Write the edict */
-			edict = edict_get(true);
-			edict->job = (void *)client_info;
-			submit_job(sjsms_pool, edict);
+			edict = edict_get(0);
+			edict->job = (void *)&dgram[i]->client_info;
+			edict->release = &sjsms_abandon;
+			if (submit_job(sjsms_pool, edict) < 0)
+				sjsms_abandon(dgram[i]);
 			edict_unlink(edict);
+			dgram[i] = NULL;
 		}
 	}
 	/* NOTREACHED */
+	return NULL;
 }
 
 void
 sjsms_server_init()
 {
 	logstr(GLOG_INFO, "starting sjsms policy server");
-	create_thread(&ctx->process_parts.sjsms_server, DETACH, &sjsms_server, NULL);
+
+	/* initialize the thread pool */
+	logstr(GLOG_INFO, "initializing sjsms worker thread pool");
+	sjsms_pool = create_thread_pool("sjsms", &sjsms_connection, NULL, NULL);
+	if (sjsms_pool == NULL)
+		daemon_fatal("create_thread_pool");
+
+	start_listeners(&ctx->process_parts.sjsms_server, SOCK_DGRAM, ctx->config.sjsms.listen,
+	    &sjsms_receiver);
 }